@@ -0,0 +1,86 @@
+/*
+ * alloccounter - Heap Allocation Counter for Debug Builds
+ *
+ * Debug builds (CMAKE_BUILD_TYPE=Debug) replace the allocation functions of
+ * the C library with ones that count every call before handing it on to
+ * glibc. Since the executable defines them, OpenCV, libav and operator new
+ * end up here as well, so this sees every heap allocation of the program.
+ *
+ * Counts are kept per thread, so a worker can look at its own allocations
+ * without the decoder threads of other workers getting in the way.
+ *
+ */
+
+#include "alloccounter.hpp"
+
+#ifdef ALLOCATION_COUNTER
+
+#include <errno.h>
+#include <stddef.h>
+
+extern "C"
+{
+	void* __libc_malloc(size_t size);
+	void* __libc_calloc(size_t count, size_t size);
+	void* __libc_realloc(void* ptr, size_t size);
+	void* __libc_memalign(size_t alignment, size_t size);
+}
+
+static __thread unsigned long m_Allocations;
+
+unsigned long allocation_count()
+{
+	return m_Allocations;
+}
+
+extern "C"
+{
+
+void* malloc(size_t size)
+{
+	m_Allocations++;
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+	m_Allocations++;
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+	m_Allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+	m_Allocations++;
+	return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+	m_Allocations++;
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+	if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+		return EINVAL;
+
+	m_Allocations++;
+
+	void* mem = __libc_memalign(alignment, size);
+
+	if (mem == NULL && size != 0)
+		return ENOMEM;
+
+	*ptr = mem;
+	return 0;
+}
+
+}
+#endif
@@ -0,0 +1,15 @@
+/*
+ * alloccounter - Heap Allocation Counter for Debug Builds
+ *
+ */
+
+#ifndef ALLOCCOUNTER_HPP
+#define ALLOCCOUNTER_HPP
+
+#ifdef ALLOCATION_COUNTER
+// Heap allocations made by the calling thread so far
+unsigned long allocation_count();
+#else
+inline unsigned long allocation_count() { return 0; }
+#endif
+#endif
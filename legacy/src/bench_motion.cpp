@@ -0,0 +1,655 @@
+/*
+ * bench_motion - Benchmark for the Motion Detection Pipeline
+ *
+ * Generates synthetic video clips (a textured background, sensor noise and
+ * a few bright or dark boxes moving across the picture) and runs them
+ * through the motion detector of the maintenance program. Clips are made
+ * from a seed only, so the same clip always has the same content, and they
+ * are kept in a directory so they only have to be encoded once.
+ *
+ * For every clip, the pipeline is timed stage by stage on a single thread:
+ * decoding the luma plane, cropping and shrinking it to what is analysed,
+ * and the differencing kernel (plus, optionally, the old OpenCV chain it
+ * replaced). Then video_motion_detection() runs on the clip just like
+ * maintenance would run it, which gives frames/s and the motion count.
+ *
+ * With a golden file, the motion count and the sum of changed pixels of
+ * every clip are compared against earlier results, and any difference
+ * makes the benchmark fail. Record the golden results with "-u" before
+ * changing the detector, and check them afterwards.
+ *
+ */
+
+#include "bench_motion.hpp"
+
+extern bool	m_Verbose;
+extern bool	m_Syslog;
+extern int	m_Workers;
+extern int	m_PipelineDepth;
+
+// name, width, height, fps, seconds, noise, objects, seed
+static const benchclip m_Corpus[] =
+{
+	{ "quiet",   640,  360,  25, 10, 6,  0, 1 },
+	{ "objects", 640,  360,  25, 10, 4,  3, 2 },
+	{ "crowd",   640,  360,  25, 10, 8, 12, 3 },
+	{ "hd",      1280, 720,  25, 10, 4,  2, 4 },
+	{ "fullhd",  1920, 1080, 25,  5, 4,  2, 5 },
+};
+
+int main(int argc, char* const argv[])
+{
+	string directory = BENCH_DIRECTORY;
+	string golden;
+	vector<benchclip> clips;
+	bool update = false;
+	bool reference = false;
+	bool masked = false;
+	int scale = 1;
+	double analysisfps = 0;
+	char opt;
+
+	m_Verbose = false;
+	m_Syslog = false;
+	m_Workers = 1;
+	m_PipelineDepth = 8;
+
+	while ((opt = getopt(argc, argv, "a:c:d:F:g:mp:Ru")) != EOF)
+		switch(opt)
+		{
+			case 'a':
+				scale = atoi(optarg);
+				break;
+			case 'c':
+			{
+				benchclip clip;
+
+				if (!parse_clip(optarg, clip))
+					exit_usage(argv[0]);
+
+				clips.push_back(clip);
+				break;
+			}
+			case 'd':
+				directory = optarg;
+				break;
+			case 'F':
+				analysisfps = atof(optarg);
+				break;
+			case 'g':
+				golden = optarg;
+				break;
+			case 'm':
+				masked = true;
+				break;
+			case 'p':
+				m_PipelineDepth = max(0, atoi(optarg));
+				break;
+			case 'R':
+				reference = true;
+				break;
+			case 'u':
+				update = true;
+				break;
+			case '?':
+			default:
+				exit_usage(argv[0]);
+				break;
+		}
+
+	if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+		exit_usage(argv[0]);
+
+	if (update && golden.empty())
+		exit_usage(argv[0]);
+
+	if (clips.empty())
+		clips.assign(m_Corpus, m_Corpus + sizeof(m_Corpus) / sizeof(m_Corpus[0]));
+
+	system::error_code error;
+	filesystem::create_directories(directory, error);
+
+	if (error)
+	{
+		printf("Error: Directory \"%s\" could not be created (%s).\n",
+			directory.c_str(), error.message().c_str());
+		return 1;
+	}
+
+	property_tree::ptree results;
+
+	if (!golden.empty() && !update)
+	{
+		try
+		{
+			property_tree::ini_parser::read_ini(golden, results);
+		}
+		catch (const property_tree::ini_parser::ini_parser_error &e)
+		{
+			printf("Error: Golden file \"%s\" could not be read (%s).\n",
+				golden.c_str(), e.message().c_str());
+			return 1;
+		}
+	}
+
+	motiondetector detector;
+
+	detector.buffered = Size();
+	detector.copies = false;
+
+	printf("Kernel: %s, analysis scale: %d, analysis fps: %g, mask: %s, pipeline depth: %d\n\n",
+		motion_kernel_name(), scale, analysisfps, masked ? "yes" : "no", m_PipelineDepth);
+
+	printf("%-10s %7s %12s %12s %12s %12s %10s %7s\n", "clip", "frames",
+		"decode ns/f", "scale ns/f", "kernel ns/f", "ref ns/f", "frames/s", "motion");
+
+	int failures = 0;
+
+	for (vector<benchclip>::iterator clip = clips.begin(); clip != clips.end(); ++clip)
+	{
+		const string filename = clip_filename(directory, *clip);
+
+		if (!filesystem::exists(filename))
+		{
+			printf("Generating clip \"%s\"...\n", filename.c_str());
+
+			if (!generate_clip(filename, *clip))
+			{
+				printf("Error: Clip \"%s\" could not be generated.\n", filename.c_str());
+				return 1;
+			}
+		}
+
+		camera cam;
+
+		cam.deleteafterdays = 0;
+		cam.retentionweight = 1;
+		cam.retentionmindays = 0;
+		cam.motionpriority = 1;
+		cam.motionquality = 0;
+		cam.motionsensitivity = 50;
+		cam.motionmaxdeviation = 10;
+		cam.motioncontinuation = -1;
+		cam.motioncontinuationms = 200;
+		cam.motionanalysisscale = scale;
+		cam.motionanalysisfps = analysisfps;
+		cam.name = clip->name;
+		cam.destination = directory;
+
+		prepare_camera(cam, masked ? bench_mask(clip->width, clip->height) : Mat());
+		cam.settings = camera_settings(cam);
+
+		benchresult result;
+
+		if (!measure_stages(filename, cam, reference, result) ||
+			!measure_detection(filename, cam, detector, result))
+		{
+			printf("Error: Clip \"%s\" could not be analysed.\n", filename.c_str());
+			return 1;
+		}
+
+		printf("%-10s %7lu %12.0f %12.0f %12.0f %12s %10.1f %7d\n",
+			clip->name.c_str(), result.frames, result.decode_ns, result.scale_ns,
+			result.kernel_ns, reference ? to_string((long)result.reference_ns).c_str() : "-",
+			result.detection_fps, result.motion);
+
+		if (result.reference_mismatch)
+		{
+			printf("FAIL: Kernel and reference chain disagree on clip \"%s\".\n", clip->name.c_str());
+			failures++;
+		}
+
+		if (golden.empty())
+			continue;
+
+		const string key = golden_key(*clip, cam);
+
+		if (update)
+		{
+			results.put(key + ".motion", result.motion);
+			results.put(key + ".changes", result.changes);
+			continue;
+		}
+
+		int motion = results.get<int>(key + ".motion", -1);
+		unsigned long changes = results.get<unsigned long>(key + ".changes", 0);
+
+		if (motion != result.motion || changes != result.changes)
+		{
+			printf("FAIL: Clip \"%s\" has motion %d and %lu changed pixel(s), expected %d and %lu.\n",
+				key.c_str(), result.motion, result.changes, motion, changes);
+			failures++;
+		}
+	}
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("\nPeak RSS: %ld KiB\n", usage.ru_maxrss);
+
+	if (update)
+	{
+		property_tree::ini_parser::write_ini(golden, results);
+		printf("Golden results were written to \"%s\".\n", golden.c_str());
+	}
+	else if (!golden.empty() && failures == 0)
+	{
+		printf("All results match the golden file.\n");
+	}
+
+	return failures == 0 ? 0 : 1;
+}
+
+void exit_usage(const char* argv0)
+{
+	printf("\n");
+	printf("Benchmark for the Motion Detection Pipeline\n");
+	printf("\n");
+	printf("Usage: %s [-c clip]... [-d directory] [-a scale] [-F fps] [-m] [-p depth]\n", argv0);
+	printf("       [-R] [-g goldenfile [-u]]\n");
+	printf("\n");
+	printf("-c clip          Benchmark this clip instead of the built-in ones. Format:\n");
+	printf("                 WIDTHxHEIGHT@FPS:SECONDS:NOISE:OBJECTS:SEED\n");
+	printf("-d directory     Where generated clips are kept (default %s).\n", BENCH_DIRECTORY);
+	printf("-a scale         Like \"motionanalysisscale\" (1, 2, 4 or 8).\n");
+	printf("-F fps           Like \"motionanalysisfps\".\n");
+	printf("-m               Use a mask that excludes the top and the right of the picture.\n");
+	printf("-p depth         Like \"pipelinedepth\" (default 8).\n");
+	printf("-R               Also time the OpenCV chain the kernel replaced, and compare.\n");
+	printf("-g goldenfile    Fail if motion results differ from the ones in this file.\n");
+	printf("-u               Write the results to the golden file instead.\n");
+	printf("\n");
+	exit(-EINVAL);
+}
+
+bool parse_clip(const char* spec, benchclip& clip)
+{
+	int consumed = 0;
+
+	if (sscanf(spec, "%dx%d@%d:%d:%d:%d:%u%n", &clip.width, &clip.height, &clip.fps,
+		&clip.seconds, &clip.noise, &clip.objects, &clip.seed, &consumed) != 7 ||
+		spec[consumed] != '\0')
+	{
+		return false;
+	}
+
+	if (clip.width < 16 || clip.height < 16 || clip.width % 2 != 0 || clip.height % 2 != 0 ||
+		clip.fps <= 0 || clip.seconds <= 0 || clip.noise < 0 || clip.objects < 0)
+	{
+		return false;
+	}
+
+	clip.name = "custom";
+
+	return true;
+}
+
+string clip_filename(const string& directory, const benchclip& clip)
+{
+	// Everything that goes into a clip is in its name.
+
+	char* filename_buffer = NULL;
+
+	asprintf(&filename_buffer, "%dx%d-%dfps-%ds-noise%d-objects%d-seed%u.ts",
+		clip.width, clip.height, clip.fps, clip.seconds, clip.noise, clip.objects, clip.seed);
+
+	filesystem::path path = filesystem::path(directory) / filesystem::path(filename_buffer);
+
+	free(filename_buffer);
+
+	return path.string();
+}
+
+bool generate_clip(const string& filename, const benchclip& clip)
+{
+	// Encodes the clip as MPEG-4 part 2 in an MPEG transport stream. The
+	// encoder is built into every libavcodec, and with a fixed quantiser
+	// and a single thread, its output only depends on the input.
+
+	uint32_t state = clip.seed * 2654435761u + 1;
+
+	vector<uint8_t> background((size_t)clip.width * clip.height);
+
+	for (int y = 0; y < clip.height; y++)
+	{
+		for (int x = 0; x < clip.width; x++)
+		{
+			int checker = ((x / 32 + y / 32) % 2) ? 96 : 128;
+			background[(size_t)y * clip.width + x] = checker + (int)(xorshift(state) % 17) - 8;
+		}
+	}
+
+	const int frames = clip.fps * clip.seconds;
+
+	vector<benchobject> objects(clip.objects);
+
+	for (vector<benchobject>::iterator object = objects.begin(); object != objects.end(); ++object)
+	{
+		object->width = clip.width / 16 + xorshift(state) % (clip.width / 8);
+		object->height = clip.height / 16 + xorshift(state) % (clip.height / 8);
+		object->x = xorshift(state) % (clip.width - object->width);
+		object->y = xorshift(state) % (clip.height - object->height);
+		object->dx = ((int)(xorshift(state) % 13) - 6) * clip.width / 640.0;
+		object->dy = ((int)(xorshift(state) % 9) - 4) * clip.height / 360.0;
+		object->brightness = (xorshift(state) % 2) ? 230 : 20;
+		object->first = xorshift(state) % frames;
+		object->last = object->first + clip.fps + xorshift(state) % (frames - object->first + 1);
+	}
+
+	AVFormatContext* format = NULL;
+	AVCodecContext* codec = NULL;
+	AVFrame* frame = NULL;
+	AVPacket* packet = NULL;
+
+	bool success = false;
+	bool opened = false;
+	const string temporary = filename + ".tmp";
+
+	const AVCodec* encoder = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+
+	if (encoder == NULL || avformat_alloc_output_context2(&format, NULL, "mpegts", temporary.c_str()) < 0)
+		goto done;
+
+	{
+		AVStream* stream = avformat_new_stream(format, NULL);
+		codec = avcodec_alloc_context3(encoder);
+		frame = av_frame_alloc();
+		packet = av_packet_alloc();
+
+		if (stream == NULL || codec == NULL || frame == NULL || packet == NULL)
+			goto done;
+
+		codec->width = clip.width;
+		codec->height = clip.height;
+		codec->time_base.num = 1;
+		codec->time_base.den = clip.fps;
+		codec->framerate.num = clip.fps;
+		codec->framerate.den = 1;
+		codec->pix_fmt = AV_PIX_FMT_YUV420P;
+		codec->gop_size = clip.fps;
+		codec->max_b_frames = 0;
+		codec->thread_count = 1;
+		codec->flags |= AV_CODEC_FLAG_QSCALE;
+		codec->global_quality = FF_QP2LAMBDA * 3;
+
+		if (format->oformat->flags & AVFMT_GLOBALHEADER)
+			codec->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+		if (avcodec_open2(codec, encoder, NULL) < 0 ||
+			avcodec_parameters_from_context(stream->codecpar, codec) < 0)
+		{
+			goto done;
+		}
+
+		stream->time_base = codec->time_base;
+
+		if (avio_open(&format->pb, temporary.c_str(), AVIO_FLAG_WRITE) < 0)
+			goto done;
+
+		opened = true;
+
+		if (avformat_write_header(format, NULL) < 0)
+			goto done;
+
+		frame->format = codec->pix_fmt;
+		frame->width = clip.width;
+		frame->height = clip.height;
+
+		if (av_frame_get_buffer(frame, 0) < 0)
+			goto done;
+
+		for (int i = 0; i < frames; i++)
+		{
+			if (av_frame_make_writable(frame) < 0)
+				goto done;
+
+			render_frame(clip, background, objects, i, frame->data[0], frame->linesize[0]);
+
+			// No colour at all
+			for (int y = 0; y < clip.height / 2; y++)
+			{
+				memset(frame->data[1] + (size_t)y * frame->linesize[1], 128, clip.width / 2);
+				memset(frame->data[2] + (size_t)y * frame->linesize[2], 128, clip.width / 2);
+			}
+
+			frame->pts = i;
+			frame->quality = codec->global_quality;
+
+			if (!encode_frame(format, stream, codec, frame, packet))
+				goto done;
+		}
+
+		if (!encode_frame(format, stream, codec, NULL, packet) || av_write_trailer(format) < 0)
+			goto done;
+
+		success = true;
+	}
+
+done:
+	if (opened)
+		avio_closep(&format->pb);
+
+	av_packet_free(&packet);
+	av_frame_free(&frame);
+	avcodec_free_context(&codec);
+	avformat_free_context(format);
+
+	if (success)
+		success = rename(temporary.c_str(), filename.c_str()) == 0;
+	else
+		unlink(temporary.c_str());
+
+	return success;
+}
+
+void render_frame(const benchclip& clip, const vector<uint8_t>& background,
+	const vector<benchobject>& objects, int index, uint8_t* plane, int linesize)
+{
+	// Background plus noise, then the boxes that are visible right now at
+	// where they are by now. Boxes bounce off the edges of the picture.
+
+	uint32_t state = (clip.seed + 1) * 2246822519u ^ (index + 1) * 3266489917u;
+
+	for (int y = 0; y < clip.height; y++)
+	{
+		uint8_t* row = plane + (size_t)y * linesize;
+		const uint8_t* bg = &background[(size_t)y * clip.width];
+
+		for (int x = 0; x < clip.width; x++)
+		{
+			int value = bg[x];
+
+			if (clip.noise > 0)
+				value += (int)(xorshift(state) % (2 * clip.noise + 1)) - clip.noise;
+
+			row[x] = (uint8_t)min(255, max(0, value));
+		}
+	}
+
+	for (vector<benchobject>::const_iterator object = objects.begin(); object != objects.end(); ++object)
+	{
+		if (index < object->first || index >= object->last)
+			continue;
+
+		const int steps = index - object->first;
+		const int xrange = clip.width - object->width;
+		const int yrange = clip.height - object->height;
+
+		// Position on a path that goes back and forth between the edges
+		int x = (int)fmod(fabs(object->x + object->dx * steps), 2.0 * xrange);
+		int y = (int)fmod(fabs(object->y + object->dy * steps), 2.0 * yrange);
+
+		if (x > xrange) x = 2 * xrange - x;
+		if (y > yrange) y = 2 * yrange - y;
+
+		for (int row = y; row < y + object->height; row++)
+			memset(plane + (size_t)row * linesize + x, object->brightness, object->width);
+	}
+}
+
+bool encode_frame(AVFormatContext* format, AVStream* stream, AVCodecContext* codec,
+	AVFrame* frame, AVPacket* packet)
+{
+	// Sends a frame (or NULL to flush) and writes out every packet that the
+	// encoder has ready.
+
+	if (avcodec_send_frame(codec, frame) < 0)
+		return false;
+
+	for (;;)
+	{
+		int ret = avcodec_receive_packet(codec, packet);
+
+		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+			return true;
+
+		if (ret < 0)
+			return false;
+
+		av_packet_rescale_ts(packet, codec->time_base, stream->time_base);
+		packet->stream_index = stream->index;
+
+		if (av_interleaved_write_frame(format, packet) < 0)
+			return false;
+	}
+}
+
+Mat bench_mask(int width, int height)
+{
+	// White, except for a band at the top (think timestamp overlay) and
+	// the right quarter of the picture (think busy road).
+
+	Mat mask(height, width, CV_8UC1, Scalar(255));
+
+	mask(Rect(0, 0, width, height / 10)).setTo(Scalar(0));
+	mask(Rect(width - width / 4, 0, width / 4, height)).setTo(Scalar(0));
+
+	return mask;
+}
+
+bool measure_stages(const string& filename, const camera& cam, bool reference, benchresult& result)
+{
+	// Times every stage of the pipeline separately, on every frame and on a
+	// single thread. Also adds up how many pixels the kernel finds changed,
+	// which catches any change to the kernel's results.
+
+	lumadecoder capture;
+
+	if (!lumadecoder_open(capture, filename, 1))
+		return false;
+
+	Mat ring[MOTION_RING];
+	Mat levels[MOTION_PYRAMID_LEVELS];
+	Mat luma;
+
+	double decode = 0, scale = 0, kernel = 0, chain = 0;
+	unsigned long frames = 0, triples = 0;
+	vector<uchar> scratch;
+
+	result.changes = 0;
+	result.reference_mismatch = false;
+
+	for (;;)
+	{
+		double start = monotonic_seconds();
+
+		if (!lumadecoder_grab(capture) || !lumadecoder_retrieve(capture, luma))
+			break;
+
+		double decoded = monotonic_seconds();
+
+		Mat& frame = ring[frames % MOTION_RING];
+		const Mat area = cam.roi.empty() ? luma : luma(cam.roi);
+
+		shrink_for_analysis(area, frame, cam.motionanalysisscale, levels);
+
+		double scaled = monotonic_seconds();
+
+		decode += decoded - start;
+		scale += scaled - decoded;
+		frames++;
+
+		if (frames < MOTION_RING)
+			continue;
+
+		const Mat& prev = ring[(frames - 3) % MOTION_RING];
+		const Mat& current = ring[(frames - 2) % MOTION_RING];
+		const Mat& next = ring[(frames - 1) % MOTION_RING];
+
+		int changes = motion_changes(prev, current, next, cam.analysismask, scratch);
+
+		double differenced = monotonic_seconds();
+
+		kernel += differenced - scaled;
+		result.changes += changes;
+		triples++;
+
+		if (reference)
+		{
+			int expected = motion_changes_reference(prev, current, next, cam.analysismask);
+
+			chain += monotonic_seconds() - differenced;
+
+			if (expected != changes)
+				result.reference_mismatch = true;
+		}
+	}
+
+	for (int i = 0; i < MOTION_RING; i++)
+		ring[i].release();
+
+	lumadecoder_close(capture);
+
+	result.frames = frames;
+	result.decode_ns = frames > 0 ? decode * 1e9 / frames : 0;
+	result.scale_ns = frames > 0 ? scale * 1e9 / frames : 0;
+	result.kernel_ns = triples > 0 ? kernel * 1e9 / triples : 0;
+	result.reference_ns = triples > 0 ? chain * 1e9 / triples : 0;
+
+	return frames > 0;
+}
+
+bool measure_detection(const string& filename, const camera& cam, motiondetector& detector,
+	benchresult& result)
+{
+	// The whole thing, just like maintenance does it.
+
+	motionresult detection;
+
+	const double start = monotonic_seconds();
+
+	result.motion = video_motion_detection(filename, cam, detector, detection, false);
+
+	const double elapsed = monotonic_seconds() - start;
+
+	result.detection_fps = elapsed > 0 ? detection.frames / elapsed : 0;
+
+	return result.motion >= 0;
+}
+
+string golden_key(const benchclip& clip, const camera& cam)
+{
+	// Results depend on the clip and on the analysis settings. Dots would
+	// split the key in the golden file, so there are none.
+
+	string key = clip_filename("", clip);
+
+	key += "-scale" + to_string(cam.motionanalysisscale);
+	key += "-fps" + to_string((int)lround(cam.motionanalysisfps * 1000));
+	key += cam.mask.empty() ? "-unmasked" : "-masked";
+
+	replace_all(key, ".", "_");
+
+	return key;
+}
+
+uint32_t xorshift(uint32_t& state)
+{
+	// Tiny, fast and the same everywhere, unlike rand()
+
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+
+	return state;
+}
@@ -0,0 +1,78 @@
+/*
+ * bench_motion - Benchmark for the Motion Detection Pipeline
+ *
+ */
+
+#ifndef BENCH_MOTION_HPP
+#define BENCH_MOTION_HPP
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/resource.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/property_tree/ini_parser.hpp>
+
+#include "maintenance.hpp"
+
+#define BENCH_DIRECTORY "/tmp/camsrv-bench"
+
+using namespace std;
+using namespace boost;
+
+typedef struct benchclip
+{
+	string name;
+	int width;
+	int height;
+	int fps;
+	int seconds;
+	int noise;
+	int objects;
+	unsigned int seed;
+} benchclip;
+
+typedef struct benchobject
+{
+	double x;
+	double y;
+	double dx;
+	double dy;
+	int width;
+	int height;
+	uint8_t brightness;
+	int first;
+	int last;
+} benchobject;
+
+typedef struct benchresult
+{
+	unsigned long frames;
+	double decode_ns;
+	double scale_ns;
+	double kernel_ns;
+	double reference_ns;
+	unsigned long changes;
+	bool reference_mismatch;
+	int motion;
+	double detection_fps;
+} benchresult;
+
+int main(int argc, char* const argv[]);
+void exit_usage(const char* argv0);
+bool parse_clip(const char* spec, benchclip& clip);
+string clip_filename(const string& directory, const benchclip& clip);
+bool generate_clip(const string& filename, const benchclip& clip);
+void render_frame(const benchclip& clip, const vector<uint8_t>& background,
+	const vector<benchobject>& objects, int index, uint8_t* plane, int linesize);
+bool encode_frame(AVFormatContext* format, AVStream* stream, AVCodecContext* codec,
+	AVFrame* frame, AVPacket* packet);
+Mat bench_mask(int width, int height);
+bool measure_stages(const string& filename, const camera& cam, bool reference, benchresult& result);
+bool measure_detection(const string& filename, const camera& cam, motiondetector& detector,
+	benchresult& result);
+string golden_key(const benchclip& clip, const camera& cam);
+uint32_t xorshift(uint32_t& state);
+#endif
@@ -0,0 +1,168 @@
+/*
+ * bench_spawn - Benchmark for Starting Camera Commands
+ *
+ * Times how long camsrvd is busy starting a camera command, i.e. until
+ * run_process() returns with the PID, the way camsrvd does it now
+ * (posix_spawn()) and the way it used to (fork() and execv()). The time
+ * fork() takes grows with the memory of the process that calls it, as all
+ * of its page tables are copied, so the benchmark is repeated with more and
+ * more memory in use ("ballast") to stand in for a supervisor that looks
+ * after many cameras.
+ *
+ * Only the time until the parent can go on is measured. The children are
+ * waited for in between, so they do not pile up.
+ *
+ */
+
+#include "bench_spawn.hpp"
+
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+int main(int argc, char* const argv[])
+{
+	string command = BENCH_SPAWN_COMMAND;
+	vector<size_t> ballasts;
+	int count = 500;
+	char opt;
+
+	while ((opt = getopt(argc, argv, "b:c:n:")) != EOF)
+		switch(opt)
+		{
+			case 'b':
+				ballasts.push_back((size_t)atol(optarg));
+				break;
+			case 'c':
+				command = optarg;
+				break;
+			case 'n':
+				count = atoi(optarg);
+				break;
+			case '?':
+			default:
+				exit_usage(argv[0]);
+				break;
+		}
+
+	if (count < 1)
+		exit_usage(argv[0]);
+
+	if (ballasts.empty())
+	{
+		ballasts.push_back(0);
+		ballasts.push_back(256);
+		ballasts.push_back(1024);
+	}
+
+	NARGV* args = parse_command(command);
+
+	if (args == NULL)
+		return 1;
+
+	prepare_spawn();
+
+	printf("Command: \"%s\", starts per measurement: %d\n\n", command.c_str(), count);
+	printf("%-12s %-12s %10s %10s %10s %10s\n", "ballast MiB", "method", "mean us", "p50 us", "p99 us", "max us");
+
+	for (vector<size_t>::iterator ballast = ballasts.begin(); ballast != ballasts.end(); ++ballast)
+	{
+		// Touched, so that it is really mapped and fork() has to copy the
+		// page tables for it.
+		vector<char> memory(*ballast << 20, 1);
+
+		for (int use_fork = 0; use_fork <= 1; use_fork++)
+		{
+			benchspawnresult result;
+
+			if (!measure_spawn(args, use_fork, count, result))
+			{
+				printf("Error: \"%s\" could not be started.\n", command.c_str());
+				return 1;
+			}
+
+			printf("%-12zu %-12s %10.1f %10.1f %10.1f %10.1f\n", *ballast,
+				use_fork ? "fork+execv" : "posix_spawn",
+				result.mean_us, result.p50_us, result.p99_us, result.max_us);
+		}
+	}
+
+	nargv_free(args);
+
+	return 0;
+}
+
+void exit_usage(const char* argv0)
+{
+	printf("\n");
+	printf("Benchmark for Starting Camera Commands\n");
+	printf("\n");
+	printf("Usage: %s [-b MiB]... [-c command] [-n count]\n", argv0);
+	printf("\n");
+	printf("-b MiB           Measure with this much memory in use (default 0, 256\n");
+	printf("                 and 1024).\n");
+	printf("-c command       Start this command line (default %s).\n", BENCH_SPAWN_COMMAND);
+	printf("-n count         Starts per measurement (default 500).\n");
+	printf("\n");
+	exit(-EINVAL);
+}
+
+pid_t fork_process(const NARGV* args)
+{
+	// How run_process() used to start commands
+
+	pid_t pid = fork();
+
+	if (pid == -1)
+		return -1;
+
+	if (pid == 0)
+	{
+		/* Child here */
+
+		unblock_signals();
+
+		execv(args->argv[0], args->argv);
+		_exit(127);
+	}
+
+	return pid;
+}
+
+bool measure_spawn(const NARGV* args, bool use_fork, int count, benchspawnresult& result)
+{
+	vector<double> times;
+
+	times.reserve(count);
+
+	for (int i = 0; i < count; i++)
+	{
+		const double start = monotonic_seconds();
+
+		pid_t pid = use_fork ? fork_process(args) : run_process(args, &m_SpawnActions);
+
+		times.push_back((monotonic_seconds() - start) * 1e6);
+
+		if (pid == -1)
+			return false;
+
+		int status;
+		waitpid(pid, &status, 0);
+	}
+
+	sort(times.begin(), times.end());
+
+	double sum = 0;
+
+	for (vector<double>::iterator time = times.begin(); time != times.end(); ++time)
+		sum += *time;
+
+	result.mean_us = sum / count;
+	result.p50_us = times[times.size() / 2];
+	result.p99_us = times[min(times.size() - 1, times.size() * 99 / 100)];
+	result.max_us = times.back();
+
+	return true;
+}
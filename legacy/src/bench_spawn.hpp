@@ -0,0 +1,31 @@
+/*
+ * bench_spawn - Benchmark for Starting Camera Commands
+ *
+ */
+
+#ifndef BENCH_SPAWN_HPP
+#define BENCH_SPAWN_HPP
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "camsrvd.hpp"
+
+#define BENCH_SPAWN_COMMAND "/bin/true"
+
+using namespace std;
+
+typedef struct benchspawnresult
+{
+	double mean_us;
+	double p50_us;
+	double p99_us;
+	double max_us;
+} benchspawnresult;
+
+void exit_usage(const char* argv0);
+pid_t fork_process(const NARGV* args);
+bool measure_spawn(const NARGV* args, bool use_fork, int count, benchspawnresult& result);
+#endif
@@ -5,8 +5,8 @@
 
 #include "camsrvd.hpp"
 
-int		m_LoggerPipe[2];
-pid_t	m_LoggerPID;
+// Messages on their way to the system log, see logring.cpp
+logring	m_Log;
 
 string	m_MailTo;
 string	m_CommandTpl;
@@ -14,11 +14,36 @@ string	m_FilenameTpl;
 
 int		m_MaxFailures;
 int		m_ResetTimer;
+int		m_RestartDelay;
+int		m_MaxRestartDelay;
+int		m_ProbeInterval;
+int		m_OutputBurst;
+int		m_OutputInterval;
 
 vector<camera> m_Cameras;
+size_t	m_DisabledCameras;
+
+int		m_Epoll;
+int		m_SignalFd;
+int		m_TimerFd;
+bool	m_UsePidfd;
+
+// Two timers per camera: one for whatever is next for it (a restart,
+// forgetting its failures, or a probe if it is disabled), and one for the
+// end of its output window (see log_camera_output())
+timerwheel m_Timers;
+
+unsigned long m_Restarts;
+double	m_TotalRestartLatency;
+double	m_MaxRestartLatency;
+
+// How cameras are started, see prepare_spawn()
+posix_spawnattr_t m_SpawnAttributes;
+posix_spawn_file_actions_t m_SpawnActions;
 
 bool	TERMINATE;
 
+#ifndef CAMSRVD_NO_MAIN
 int main(int argc, const char* argv[])
 {
 	if (argc != 2)
@@ -31,6 +56,7 @@ int main(int argc, const char* argv[])
 	setup_signal_handler();
 
 	become_daemon();
+	prepare_spawn();
 
 	// Unfortunately we can only create a lock file after we
 	// have become a daemon, since the checking and creating
@@ -44,115 +70,47 @@ int main(int argc, const char* argv[])
 		case -1:
 			posix_fail("Could not create lock file.", true);
 		case  1:
-			fprintf(stderr, "Another instance is already running.\n");
+			LOG(LOG_ERR, "Another instance is already running.");
 			exit(1);
 		case  0:
 			// Happy days.
 			break;
 	}
 
-	// Required for infinite sleep
-	sigset_t empty_signalset;
-	sigemptyset(&empty_signalset);
+	// Everything that can happen (signals, cameras exiting, restarts that
+	// are due) comes in through one epoll descriptor, so nothing has to be
+	// polled and a camera exiting is dealt with right away.
+	open_event_loop();
+
+	for (vector<camera>::iterator cam = m_Cameras.begin() ; cam != m_Cameras.end(); ++cam)
+		open_camera_output(*cam);
 
 	// Launch the instances
-	printf("Starting commands for cameras.\n");
+	LOG(LOG_NOTICE, "Starting commands for cameras.");
 
 	for (vector<camera>::iterator cam = m_Cameras.begin() ; cam != m_Cameras.end(); ++cam)
 	{
-		printf("Starting camera \"%s\".\n", cam->name.c_str());
-
-		cam->laststart = time(NULL);
-		cam->pid = run_process(cam->command);
+		CAMERA_LOG(LOG_NOTICE, *cam, cam->pid, "Starting camera \"%s\".", cam->name.c_str());
+		start_camera(*cam);
 	}
 
-	printf("Starting command monitoring.\n");
+	LOG(LOG_NOTICE, "Starting command monitoring.");
 
 	while (!TERMINATE)
 	{
-		bool all_cameras_disabled = true;
-		unsigned int sleep_time = 0;
-
-		for (vector<camera>::iterator cam = m_Cameras.begin() ; cam != m_Cameras.end(); ++cam)
-		{
-			if (cam->disabled)
-				continue; // for
-
-			time_t now = time(NULL);
-
-			if (!cam->resetting && (cam->pid == -1 || kill(cam->pid, 0) == -1))
-			{
-				cam->errcount++;
-
-				printf("Camera \"%s\" with PID %d is no longer running. It has termined unexpectedly %d time(s) before.\n",
-					cam->name.c_str(), cam->pid, cam->errcount);
-
-				if (cam->errcount >= m_MaxFailures)
-				{
-					cam->disabled = true;
-					printf("Camera \"%s\" has failed too many times and has been disabled.\n", cam->name.c_str());
-					notify_camera_disabled(*cam);
-
-					continue; // for
-				}
-
-				cam->resetting = true;
-				cam->lastreset = time(NULL);
-			}
-			else if (cam->resetting && now - cam->lastreset >= m_ResetTimer)
-			{
-				assert(cam->lastreset != (time_t)-1);
-
-				printf("Attempting to recover camera \"%s\"...\n", cam->name.c_str());
-				cam->laststart = now;
-				cam->resetting = false;
-				cam->lastreset = (time_t)-1;
-				cam->pid = run_process(cam->command);
-			}
-			else if (cam->errcount != 0 && (now - cam->laststart >= m_ResetTimer))
-			{
-				printf("Camera \"%s\"appears to be working fine again, so resetting error count.\n", cam->name.c_str());
-				cam->errcount = 0;
-			}
-
-			all_cameras_disabled = false;
-
-			if (cam->resetting || cam->errcount != 0)
-			{
-				// Figure out how long to sleep until something needs to
-				// be reset or restarted.
-				unsigned int tmp;
-
-				if (cam->resetting)
-					tmp = (unsigned int)(m_ResetTimer - (now - cam->lastreset));
-				else if (cam->errcount != 0)
-					tmp = (unsigned int)(m_ResetTimer - (now - cam->laststart));
-
-				if (sleep_time == 0)
-					sleep_time = tmp;
-				else
-					sleep_time = min(sleep_time, tmp);
-			}
-		}
-
-		if (all_cameras_disabled)
+		// Disabled cameras that are probed now and then may come back.
+		if (m_DisabledCameras == m_Cameras.size() && m_ProbeInterval == 0)
 		{
-			printf("All cameras have become disabled. There is nothing left to do.\n");
+			LOG(LOG_NOTICE, "All cameras have become disabled. There is nothing left to do.");
 			break; // while
 		}
 
-		if (sleep_time == 0)
-		{
-			printf("Suspending until something happens.\n");
-			sigsuspend(&empty_signalset);
-			printf("Something has happened.\n");
-		}
-		else
-		{
-			printf("Sleeping for %d seconds or less.\n", sleep_time);
-			sleep(sleep_time);
-			printf("Woke up from sleep.\n");
-		}
+		arm_restart_timer();
+
+		// Logging never waits; what the log does not take now is sent
+		// a little later.
+		logring_flush(m_Log, false);
+		wait_for_events(logring_pending(m_Log) ? CAMSRVD_LOG_RETRY_MS : -1);
 	}
 
 	// Terminate processes, wait 5 seconds, then try to kill remaining
@@ -166,22 +124,19 @@ int main(int argc, const char* argv[])
 
 		for (vector<camera>::iterator cam = m_Cameras.begin() ; cam != m_Cameras.end(); ++cam)
 		{
-			if (cam->disabled)
-				continue; // for
-
-			if (cam->pid == -1 || kill(cam->pid, 0) == -1) // Not running
+			if (cam->pid == -1) // Not running
 				continue; // for
 
 			if (send_sigkill)
 			{
-				printf("Killing camera \"%s\" process with PID %d.\n", cam->name.c_str(), cam->pid);
+				CAMERA_LOG(LOG_NOTICE, *cam, cam->pid, "Killing camera \"%s\" process with PID %d.", cam->name.c_str(), cam->pid);
 
 				if (kill(cam->pid, SIGKILL) == -1)
 					posix_fail("Unable to kill process.", false);
 			}
 			else
 			{
-				printf("Terminating camera \"%s\" process with PID %d.\n", cam->name.c_str(), cam->pid);
+				CAMERA_LOG(LOG_NOTICE, *cam, cam->pid, "Terminating camera \"%s\" process with PID %d.", cam->name.c_str(), cam->pid);
 
 				if (kill(cam->pid, SIGTERM) == -1)
 					posix_fail("Unable to terminate process.", false);
@@ -193,19 +148,527 @@ int main(int argc, const char* argv[])
 		if (!terminated_something) // We are done!
 			break; // for
 
-		printf("Giving all camera processes some time to exit.\n");
+		LOG(LOG_NOTICE, "Giving all camera processes some time to exit.");
 
-		for (uint remaining = 5; remaining > 0;)
-			remaining = sleep(remaining);
+		const double give_up = monotonic_seconds() + 5;
+
+		while (running_cameras() > 0 && monotonic_seconds() < give_up)
+		{
+			logring_flush(m_Log, false);
+			wait_for_events((int)((give_up - monotonic_seconds()) * 1000) + 1);
+		}
 
 		 // If we sent SIGTERM, the next round is with SIGKILL
 		if (!send_sigkill) send_sigkill = true;
 	}
 
-	printf("Terminating.\n");
+	LOG(LOG_NOTICE, "Terminating.");
 
 	return 0;
 }
+#endif
+
+void open_event_loop()
+{
+	m_Epoll = epoll_create1(EPOLL_CLOEXEC);
+
+	if (m_Epoll == -1)
+		posix_fail("Could not create epoll descriptor.", true);
+
+	// The signals were blocked by setup_signal_handler() before becoming
+	// a daemon, so none of them got lost in the meantime. SIGHUP was
+	// ignored while becoming a daemon; ignored signals are discarded
+	// rather than left pending, so it needs its default back.
+	signal(SIGHUP, SIG_DFL);
+
+	sigset_t mask;
+	sigprocmask(SIG_BLOCK, NULL, &mask);
+
+	m_SignalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+	if (m_SignalFd == -1)
+		posix_fail("Could not create signal descriptor.", true);
+
+	m_TimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (m_TimerFd == -1)
+		posix_fail("Could not create timer descriptor.", true);
+
+	watch_descriptor(m_SignalFd, CAMSRVD_EVENT_SIGNAL);
+	watch_descriptor(m_TimerFd, CAMSRVD_EVENT_TIMER);
+
+	timerwheel_init(m_Timers, 2 * m_Cameras.size(), monotonic_tick(monotonic_seconds(), false));
+
+	// Jitter for restarts, so that cameras that went down together (e.g.
+	// because a switch was rebooted) do not all come back at once
+	srand48(time(NULL) ^ getpid());
+
+	// Without pidfds (before Linux 5.3), cameras exiting are found out
+	// about from SIGCHLD instead.
+	int self = pidfd_open(getpid());
+
+	m_UsePidfd = self != -1;
+
+	if (self != -1)
+		close(self);
+	else
+		LOG(LOG_NOTICE, "Process descriptors are not available, so SIGCHLD is used to notice cameras exiting.");
+}
+
+void watch_descriptor(int fd, uint64_t tag)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u64 = tag;
+
+	if (epoll_ctl(m_Epoll, EPOLL_CTL_ADD, fd, &event) == -1)
+		posix_fail("Could not add descriptor to epoll.", true);
+}
+
+int pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+void wait_for_events(int timeout_ms)
+{
+	struct epoll_event events[CAMSRVD_EVENTS];
+
+	int count = epoll_wait(m_Epoll, events, CAMSRVD_EVENTS, timeout_ms);
+
+	if (count == -1)
+	{
+		if (errno != EINTR)
+			posix_fail("Waiting for events failed.", true);
+
+		return;
+	}
+
+	// Before anything else, so that timers set while handling the events
+	// are set relative to now (see expire_timers()).
+	expire_timers();
+
+	for (int i = 0; i < count; i++)
+	{
+		const uint64_t tag = events[i].data.u64;
+
+		if (tag == CAMSRVD_EVENT_SIGNAL)
+			handle_signals();
+		else if (tag == CAMSRVD_EVENT_TIMER)
+			handle_timer();
+		else if ((tag & CAMSRVD_EVENT_OUTPUT) && (tag & ~CAMSRVD_EVENT_OUTPUT) < m_Cameras.size())
+			read_camera_output(m_Cameras[tag & ~CAMSRVD_EVENT_OUTPUT]);
+		else if (tag < m_Cameras.size())
+			reap_camera(m_Cameras[tag]);
+	}
+}
+
+void unblock_signals()
+{
+	// The signals the supervisor blocks are not for the processes it runs.
+
+	sigset_t none;
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+}
+
+void handle_signals()
+{
+	struct signalfd_siginfo info;
+
+	while (read(m_SignalFd, &info, sizeof(info)) == sizeof(info))
+	{
+		switch (info.ssi_signo)
+		{
+			case SIGTERM:
+				TERMINATE = true;
+				break;
+			case SIGCHLD:
+				if (!m_UsePidfd)
+					reap_children();
+				break;
+			case SIGUSR1:
+				output_statistics();
+				break;
+			case SIGHUP:
+				enable_cameras();
+				break;
+		}
+	}
+}
+
+void handle_timer()
+{
+	// The cameras whose timers have gone off were already dealt with by
+	// expire_timers(); this only rearms the descriptor.
+
+	uint64_t expirations;
+
+	if (read(m_TimerFd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+}
+
+void expire_timers()
+{
+	// Moves the timer wheel on to now and deals with every camera whose
+	// timer has gone off. How long that takes depends on how many have,
+	// not on how many cameras there are. This happens whenever camsrvd
+	// wakes up, not just when the timer descriptor fires: the wheel can
+	// only set timers up to TIMERWHEEL_SPAN ahead of where it is, so after
+	// weeks without any timers, a new one would otherwise be due in the
+	// past and go off right away.
+
+	vector<size_t> expired;
+
+	timerwheel_advance(m_Timers, monotonic_tick(monotonic_seconds(), false), expired);
+
+	// Nothing is restarted or probed while shutting down.
+	if (TERMINATE)
+		return;
+
+	const double now = monotonic_seconds();
+
+	for (vector<size_t>::iterator index = expired.begin() ; index != expired.end(); ++index)
+	{
+		if (*index < m_Cameras.size())
+			camera_timer(m_Cameras[*index]);
+		else
+			end_output_window(m_Cameras[*index - m_Cameras.size()], now);
+	}
+}
+
+void arm_restart_timer()
+{
+	// One timer for whichever camera needs looking after first.
+
+	struct itimerspec timer;
+	memset(&timer, 0, sizeof(timer));
+
+	uint64_t tick;
+
+	if (timerwheel_next(m_Timers, tick))
+	{
+		// Zero would disarm it, so the first tick is a tiny bit later.
+		const double due = max((double)tick / CAMSRVD_TICKS_PER_SECOND, 1e-6);
+
+		timer.it_value.tv_sec = (time_t)due;
+		timer.it_value.tv_nsec = (long)((due - (time_t)due) * 1e9);
+	}
+
+	if (timerfd_settime(m_TimerFd, TFD_TIMER_ABSTIME, &timer, NULL) == -1)
+		posix_fail("Could not set restart timer.", false);
+}
+
+void schedule_camera(camera& cam, double due)
+{
+	timerwheel_set(m_Timers, &cam - &m_Cameras[0], monotonic_tick(due, true));
+}
+
+void camera_timer(camera& cam)
+{
+	if (cam.disabled && cam.pid == -1)
+	{
+		CAMERA_LOG(LOG_NOTICE, cam, cam.pid, "Probing disabled camera \"%s\"...", cam.name.c_str());
+
+		cam.probing = true;
+		start_camera(cam);
+	}
+	else if (cam.disabled)
+	{
+		CAMERA_LOG(LOG_NOTICE, cam, cam.pid, "Camera \"%s\" has been working fine since it was probed, so enabling it again.", cam.name.c_str());
+
+		cam.disabled = false;
+		cam.probing = false;
+		cam.errcount = 0;
+		m_DisabledCameras--;
+	}
+	else if (cam.resetting)
+	{
+		CAMERA_LOG(LOG_NOTICE, cam, cam.pid, "Attempting to recover camera \"%s\"...", cam.name.c_str());
+		start_camera(cam);
+	}
+	else if (cam.errcount != 0 && cam.pid != -1)
+	{
+		CAMERA_LOG(LOG_NOTICE, cam, cam.pid, "Camera \"%s\" appears to be working fine again, so resetting error count.", cam.name.c_str());
+		cam.errcount = 0;
+	}
+}
+
+double restart_delay(const camera& cam)
+{
+	// Twice as long after every failure in a row, up to a limit, and give
+	// or take a quarter.
+
+	double delay = m_RestartDelay * ldexp(1.0, min(cam.errcount - 1, 30));
+
+	delay = min(delay, (double)m_MaxRestartDelay);
+	delay *= 0.75 + drand48() / 2;
+
+	return min(delay, (double)m_MaxRestartDelay);
+}
+
+void start_camera(camera& cam)
+{
+	const double now = monotonic_seconds();
+
+	if (cam.resetting)
+	{
+		// How much later than planned the restart happened, and how long
+		// the camera did not record
+		cam.restartlatency = now - cam.restartdue;
+		cam.downtime = now - cam.exitedat;
+
+		m_Restarts++;
+		m_TotalRestartLatency += cam.restartlatency;
+		m_MaxRestartLatency = max(m_MaxRestartLatency, cam.restartlatency);
+	}
+
+	cam.laststart = time(NULL);
+	cam.startedat = now;
+	cam.resetting = false;
+	cam.lastreset = (time_t)-1;
+	cam.pid = run_process(cam.args, &cam.actions);
+
+	if (cam.pid == -1)
+	{
+		camera_exited(cam, -1);
+		return;
+	}
+
+	CAMERA_LOG(LOG_NOTICE, cam, cam.pid, "Started \"%s\" with PID %d.", cam.args->argv[0], cam.pid);
+
+	// Probes only count once they have been running for as long as it
+	// takes to forget about failures.
+	cam.healthydue = now + m_ResetTimer;
+
+	if (cam.errcount != 0 || cam.probing)
+		schedule_camera(cam, cam.healthydue);
+	else
+		timerwheel_cancel(m_Timers, &cam - &m_Cameras[0]);
+
+	if (!m_UsePidfd)
+		return;
+
+	cam.pidfd = pidfd_open(cam.pid);
+
+	if (cam.pidfd == -1)
+	{
+		// A camera that cannot be watched cannot be restarted either, so
+		// it counts as having failed to start.
+		posix_fail("Could not open process descriptor.", false);
+
+		int status;
+		kill(cam.pid, SIGKILL);
+		waitpid(cam.pid, &status, 0);
+
+		camera_exited(cam, -1);
+		return;
+	}
+
+	watch_descriptor(cam.pidfd, &cam - &m_Cameras[0]);
+}
+
+void reap_camera(camera& cam)
+{
+	// The process descriptor of a camera says it has exited; the process
+	// cannot have been replaced by another with the same PID, as it has
+	// not been waited for yet.
+
+	if (cam.pid == -1)
+		return;
+
+	int status;
+
+	if (waitpid(cam.pid, &status, WNOHANG) != cam.pid)
+		return;
+
+	camera_exited(cam, status);
+}
+
+void reap_children()
+{
+	// Without process descriptors, the cameras that have exited are found
+	// by their PID.
+
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+	{
+		for (vector<camera>::iterator cam = m_Cameras.begin() ; cam != m_Cameras.end(); ++cam)
+		{
+			if (cam->pid == pid)
+			{
+				camera_exited(*cam, status);
+				break; // for
+			}
+		}
+	}
+}
+
+void camera_exited(camera& cam, int status)
+{
+	// "status" is as returned by waitpid(), or -1 if the command could not
+	// be started at all.
+
+	if (cam.pidfd != -1)
+	{
+		close(cam.pidfd); // Also takes it out of epoll
+		cam.pidfd = -1;
+	}
+
+	// What it wrote last usually says why it exited, so it is logged
+	// before that, and anything that was held back is summed up.
+	read_camera_output(cam);
+
+	const double now = monotonic_seconds();
+
+	if (!cam.partial.empty())
+	{
+		log_camera_output(cam, cam.partial.c_str(), cam.partial.size(), now);
+		cam.partial.clear();
+	}
+
+	end_output_window(cam, now);
+
+	const pid_t pid = cam.pid;
+
+	cam.pid = -1;
+	cam.exitedat = monotonic_seconds();
+
+	if (TERMINATE)
+	{
+		CAMERA_LOG(LOG_NOTICE, cam, pid, "Camera \"%s\" with PID %d has exited.", cam.name.c_str(), pid);
+		timerwheel_cancel(m_Timers, &cam - &m_Cameras[0]);
+		return;
+	}
+
+	if (cam.probing)
+	{
+		// Failed probes do not send another email.
+		cam.probing = false;
+		cam.restartdue = cam.exitedat + m_ProbeInterval;
+
+		CAMERA_LOG(LOG_WARNING, cam, pid, "Probing camera \"%s\" failed, it stays disabled. Probing again in %d second(s).",
+			cam.name.c_str(), m_ProbeInterval);
+
+		schedule_camera(cam, cam.restartdue);
+		return;
+	}
+
+	cam.errcount++;
+
+	if (status == -1)
+	{
+		CAMERA_LOG(LOG_WARNING, cam, pid, "Camera \"%s\" could not be started. It has termined unexpectedly %d time(s) before.",
+			cam.name.c_str(), cam.errcount);
+	}
+	else if (WIFSIGNALED(status))
+	{
+		CAMERA_LOG(LOG_WARNING, cam, pid, "Camera \"%s\" with PID %d was killed by signal %d after %.0f second(s). It has termined unexpectedly %d time(s) before.",
+			cam.name.c_str(), pid, WTERMSIG(status), cam.exitedat - cam.startedat, cam.errcount);
+	}
+	else
+	{
+		CAMERA_LOG(LOG_WARNING, cam, pid, "Camera \"%s\" with PID %d exited with status %d after %.0f second(s). It has termined unexpectedly %d time(s) before.",
+			cam.name.c_str(), pid, WEXITSTATUS(status), cam.exitedat - cam.startedat, cam.errcount);
+	}
+
+	if (cam.errcount >= m_MaxFailures)
+	{
+		cam.disabled = true;
+		m_DisabledCameras++;
+		CAMERA_LOG(LOG_ERR, cam, pid, "Camera \"%s\" has failed too many times and has been disabled.", cam.name.c_str());
+		notify_camera_disabled(cam);
+
+		if (m_ProbeInterval > 0)
+		{
+			cam.restartdue = cam.exitedat + m_ProbeInterval;
+			schedule_camera(cam, cam.restartdue);
+		}
+		else
+		{
+			timerwheel_cancel(m_Timers, &cam - &m_Cameras[0]);
+		}
+
+		return;
+	}
+
+	cam.resetting = true;
+	cam.lastreset = time(NULL);
+	cam.restartdue = cam.exitedat + restart_delay(cam);
+
+	CAMERA_LOG(LOG_NOTICE, cam, pid, "Restarting camera \"%s\" in %.1f second(s).", cam.name.c_str(), cam.restartdue - cam.exitedat);
+
+	schedule_camera(cam, cam.restartdue);
+}
+
+void enable_cameras()
+{
+	// SIGHUP gives disabled cameras another go, e.g. once whatever was
+	// wrong with them has been fixed.
+
+	for (vector<camera>::iterator cam = m_Cameras.begin() ; cam != m_Cameras.end(); ++cam)
+	{
+		if (!cam->disabled)
+			continue; // for
+
+		CAMERA_LOG(LOG_NOTICE, *cam, cam->pid, "Enabling camera \"%s\" again.", cam->name.c_str());
+
+		cam->disabled = false;
+		cam->errcount = 0;
+		cam->resetting = false;
+		m_DisabledCameras--;
+
+		// One that is being probed just keeps running.
+		if (cam->probing)
+		{
+			cam->probing = false;
+			timerwheel_cancel(m_Timers, cam - m_Cameras.begin());
+			continue; // for
+		}
+
+		start_camera(*cam);
+	}
+}
+
+size_t running_cameras()
+{
+	size_t running = 0;
+
+	for (vector<camera>::iterator cam = m_Cameras.begin() ; cam != m_Cameras.end(); ++cam)
+	{
+		if (cam->pid != -1)
+			running++;
+	}
+
+	return running;
+}
+
+double monotonic_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t monotonic_tick(double seconds, bool round_up)
+{
+	// The tick of the restart timers a point in time falls into. Timers
+	// are rounded up, so that they never go off early.
+
+	const double ticks = seconds * CAMSRVD_TICKS_PER_SECOND;
+
+	return (uint64_t)(round_up ? ceil(ticks) : floor(ticks));
+}
 
 void notify_camera_disabled(const camera camdis)
 {
@@ -225,6 +688,11 @@ void notify_camera_disabled(const camera camdis)
 	{
 		/* Child here */
 
+		unblock_signals();
+
+		// The parent sends whatever is waiting to be logged.
+		logring_discard(m_Log);
+
 		FILE *mp = popen(SENDMAIL_EXECUTABLE, "w");
 
 		if (!mp)
@@ -260,11 +728,11 @@ void notify_camera_disabled(const camera camdis)
 
 	if (retval != 0)
 	{
-		fprintf(stderr, "Unable to send notification. Sendmail returned %d.\n", retval);
+		LOG(LOG_ERR, "Unable to send notification. Sendmail returned %d.", retval);
 		return;
 	}
 
-	printf("Successfully sent notification. Sendmail returned %d.\n", retval);
+	LOG(LOG_NOTICE, "Successfully sent notification. Sendmail returned %d.", retval);
 }
 
 void load_settings(const string& filename)
@@ -298,6 +766,11 @@ void load_settings(const string& filename)
 
 		m_MaxFailures = pt.get<int>("camsrvd.maxfailures");
 		m_ResetTimer = pt.get<int>("camsrvd.resettimer");
+		m_RestartDelay = pt.get<int>("camsrvd.restartdelay", 10);
+		m_MaxRestartDelay = pt.get<int>("camsrvd.maxrestartdelay", max(m_ResetTimer, m_RestartDelay));
+		m_ProbeInterval = pt.get<int>("camsrvd.probeinterval", 3600);
+		m_OutputBurst = pt.get<int>("camsrvd.outputburst", 200);
+		m_OutputInterval = pt.get<int>("camsrvd.outputinterval", 10);
 
 		cameras = pt.get<string>("camsrvd.cameras");
 	}
@@ -337,6 +810,16 @@ void load_settings(const string& filename)
 		fprintf(stderr, "Configuration is invalid! Reason: must declare at least one camera.");
 		exit(1);
 	}
+	else if (m_RestartDelay < 1 || m_MaxRestartDelay < m_RestartDelay || m_ProbeInterval < 0)
+	{
+		fprintf(stderr, "Configuration is invalid! Reason: restart delays must be at least 1 second and probe interval must not be negative.");
+		exit(1);
+	}
+	else if (m_OutputBurst < 0 || m_OutputInterval < 1)
+	{
+		fprintf(stderr, "Configuration is invalid! Reason: output burst must not be negative and output interval must be at least 1 second.");
+		exit(1);
+	}
 
 	for (vector<string>::iterator el = cameras_split.begin() ; el != cameras_split.end(); ++el)
 	{
@@ -378,12 +861,39 @@ void load_settings(const string& filename)
 		cam.command = m_CommandTpl;
 		replace_all(cam.command, "{STREAM}", "\"" + stream + "\"");
 		replace_all(cam.command, "{DESTINATION}", "\"" + destination + "\"");
+
+		// Parsed once here rather than on every start
+		cam.args = parse_command(cam.command);
+
+		if (cam.args == NULL)
+		{
+			fprintf(stderr, "Configuration is invalid! Reason: command of camera \"%s\" cannot be parsed.\n",
+				el->c_str());
+			exit(1);
+		}
+
 		cam.pid = (pid_t)-1;
+		cam.pidfd = -1;
 		cam.errcount = 0;
 		cam.disabled = false;
+		cam.probing = false;
 		cam.resetting = false;
 		cam.lastreset = (time_t)-1;
 		cam.laststart = (time_t)-1;
+		cam.startedat = 0;
+		cam.exitedat = 0;
+		cam.restartdue = 0;
+		cam.healthydue = 0;
+		cam.restartlatency = 0;
+		cam.downtime = 0;
+		cam.output[0] = -1;
+		cam.output[1] = -1;
+		cam.outputbytes = 0;
+		cam.outputlines = 0;
+		cam.suppressedlines = 0;
+		cam.windowlines = 0;
+		cam.windowsuppressed = 0;
+		cam.windowstart = 0;
 
 		m_Cameras.push_back(cam);
 	}
@@ -391,41 +901,20 @@ void load_settings(const string& filename)
 
 void setup_signal_handler()
 {
-	struct sigaction sigact;
-
-	sigact.sa_handler = handle_signal;
-	sigact.sa_flags = 0;
+	// The signals are read from a signalfd by the event loop rather than
+	// handled asynchronously, see open_event_loop(). They are blocked right
+	// away, so any that arrive before then stay pending. Processes started
+	// later get the default mask back, see prepare_spawn().
 
 	sigset_t mask;
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGTERM);
 	sigaddset(&mask, SIGCHLD);
 	sigaddset(&mask, SIGUSR1);
-	sigact.sa_mask = mask;
-
-	sigaction(SIGTERM, &sigact, NULL);
-	sigaction(SIGCHLD, &sigact, NULL);
-	sigaction(SIGUSR1, &sigact, NULL);
-}
-
-void handle_signal(int signum)
-{
-	switch (signum)
-	{
-		case SIGTERM:
-			if (!TERMINATE)
-				TERMINATE = true;
-			break;
-		case SIGCHLD:
-			pid_t pid;
-			int retval;
+	sigaddset(&mask, SIGHUP);
 
-			while((pid = waitpid(-1, &retval, WNOHANG)) > 0);
-			break;
-		case SIGUSR1:
-			output_statistics();
-			break;
-	}
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+		posix_fail("Could not block signals.", true);
 }
 
 void become_daemon()
@@ -440,6 +929,27 @@ void become_daemon()
 	if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
 		posix_fail("Cannot get file limit.", true);
 
+	// Every camera needs a few descriptors (its output pipe and process
+	// descriptor), which is more than the usual soft limit of 1024 allows
+	// for with a few hundred cameras. It is raised as far as needed, but
+	// no further, as the cameras inherit it.
+	{
+		const rlim_t needed = m_Cameras.size() * CAMSRVD_CAMERA_FILES + CAMSRVD_SPARE_FILES;
+
+		if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < needed)
+		{
+			struct rlimit raised = rl;
+			raised.rlim_cur = rl.rlim_max == RLIM_INFINITY ? needed : min(needed, rl.rlim_max);
+
+			if (setrlimit(RLIMIT_NOFILE, &raised) < 0)
+				posix_fail("Could not raise file limit.", false);
+
+			if (raised.rlim_cur < needed)
+				fprintf(stderr, "Warning: The file limit of %lu is too low for %zu cameras; the output of some may not be logged.\n",
+					(unsigned long)raised.rlim_cur, m_Cameras.size());
+		}
+	}
+
 	// Become a session leader to lose controlling TTY.
 	if ((pid = fork()) < 0)
 		posix_fail("Could not fork to become daemon.", true);
@@ -513,71 +1023,180 @@ void become_daemon()
 			posix_fail("Unable to duplicate /dev/null to standard error.", true);
 	}
 
-	// Standard output and standard error go to logger from here
-	redirect_output_to_logger();
+	// Messages go to the system log from here
+	open_log();
 }
 
-void redirect_output_to_logger()
+void open_log()
 {
-	// Kludge to redirect stdout and stderr to syslog. This is required so that
-	// the processes that are run output all of their shit to syslog. As a side-
-	// effect, we don't need to bother with calling syslog functions.
+	// camsrvd itself logs through m_Log. Its stdout and stderr stay
+	// /dev/null; every camera gets a pipe of its own as theirs instead
+	// (see open_camera_output()).
 
-	if (pipe(m_LoggerPipe) != 0)
-		posix_fail("Unable to create a pipe for logger.", true);
+	logring_open(m_Log, LOGGER_TAG, LOGGER_FACILITY);
 
-	m_LoggerPID = fork();
+	atexit(close_log);
+}
 
-	if (m_LoggerPID == -1)
-		posix_fail("Could not fork to start logger.", true);
+void close_log()
+{
+	logring_close(m_Log);
+}
 
-	if (m_LoggerPID == 0)
+void open_camera_output(camera& cam)
+{
+	// The stdout and stderr of a camera are a pipe that camsrvd reads and
+	// logs, tagged with the camera. It stays the same from one start of
+	// the camera to the next, so its file actions are only set up once.
+
+	if (pipe2(cam.output, O_CLOEXEC) != 0)
 	{
-		/* Child here */
+		// E.g. out of descriptors. The camera still runs, but what it
+		// writes goes to /dev/null.
+		posix_fail("Unable to create a pipe for the output of a camera.", false);
+
+		cam.output[0] = -1;
+		cam.output[1] = -1;
+		prepare_file_actions(cam.actions, -1);
+		return;
+	}
+
+	if (fcntl(cam.output[0], F_SETFL, O_NONBLOCK) == -1)
+		posix_fail("Unable to make the output pipe of a camera non-blocking.", true);
+
+	// More room than the default 64 KiB, so a burst of errors does not
+	// hold up the camera. Not having it is no reason to fail.
+	fcntl(cam.output[0], F_SETPIPE_SZ, CAMSRVD_OUTPUT_PIPE);
+
+	prepare_file_actions(cam.actions, cam.output[1]);
+
+	cam.windowstart = monotonic_seconds();
+
+	watch_descriptor(cam.output[0], CAMSRVD_EVENT_OUTPUT | (uint64_t)(&cam - &m_Cameras[0]));
+}
+
+void read_camera_output(camera& cam)
+{
+	// Logs what a camera wrote to stdout and stderr, a line at a time.
+
+	if (cam.output[0] == -1)
+		return;
+
+	char buffer[CAMSRVD_OUTPUT_READ];
+	ssize_t got;
+
+	while ((got = read(cam.output[0], buffer, sizeof(buffer))) > 0)
+	{
+		const double now = monotonic_seconds();
 
-		// Child inherits /dev/null as stdout and stderr from become_daemon()
+		cam.outputbytes += got;
+		cam.partial.append(buffer, got);
 
-		close(m_LoggerPipe[1]); // Close child's writing end of the pipe
+		size_t start = 0;
+		size_t end;
 
-		dup2(m_LoggerPipe[0], STDIN_FILENO); // Child's stdin becomes the pipe
-		close(m_LoggerPipe[0]); // OK as parent still has it open
+		while ((end = cam.partial.find('\n', start)) != string::npos)
+		{
+			log_camera_output(cam, cam.partial.c_str() + start, end - start, now);
+			start = end + 1;
+		}
 
-		if (execl(LOGGER_EXECUTABLE, LOGGER_EXECUTABLE,
-			"-t", LOGGER_TAG, "-p", LOGGER_PRIORITY, NULL) == -1)
+		cam.partial.erase(0, start);
+
+		// Lines that never end are logged in pieces.
+		if (cam.partial.size() >= LOGRING_MESSAGE - 1)
 		{
-			posix_fail("Starting logger failed.", true);
+			log_camera_output(cam, cam.partial.c_str(), cam.partial.size(), now);
+			cam.partial.clear();
 		}
 	}
+}
 
-	/* Parent here */
+void log_camera_output(camera& cam, const char* line, size_t length, double now)
+{
+	// At most "outputburst" lines of a camera are logged every
+	// "outputinterval" seconds, so one camera that floods its output with
+	// errors does not drown out the others.
 
-	close(m_LoggerPipe[0]); // Close parent's reading end of the pipe
+	cam.outputlines++;
 
-	int ret;
+	if (now - cam.windowstart >= m_OutputInterval)
+		end_output_window(cam, now);
 
-	ret = dup2(m_LoggerPipe[1], STDOUT_FILENO);
-	if (ret == -1) posix_fail("Unable to duplicate logger file descriptor to stdout.", true);
+	if (m_OutputBurst > 0 && cam.windowlines >= (unsigned long)m_OutputBurst)
+	{
+		// The summary is logged when the window is over, even if the
+		// camera has gone quiet by then.
+		if (cam.windowsuppressed == 0)
+			timerwheel_set(m_Timers, output_timer(cam), monotonic_tick(cam.windowstart + m_OutputInterval, true));
 
-	ret = dup2(m_LoggerPipe[1], STDERR_FILENO);
-	if (ret == -1) posix_fail("Unable to duplicate logger file descriptor to stderr.", true);
+		cam.windowsuppressed++;
+		cam.suppressedlines++;
+		return;
+	}
 
-	setbuf(stdout, NULL);
-	setbuf(stderr, NULL);
+	cam.windowlines++;
 
-	atexit(close_logger);
+	CAMERA_LOG(LOG_NOTICE, cam, cam.pid, "[%s] %.*s", cam.name.c_str(), (int)length, line);
 }
 
-void close_logger()
+void end_output_window(camera& cam, double now)
 {
-	int ret;
+	if (cam.windowsuppressed > 0)
+	{
+		CAMERA_LOG(LOG_WARNING, cam, cam.pid, "Camera \"%s\" wrote %lu more line(s) of output in %.0f second(s) that were not logged.",
+			cam.name.c_str(), cam.windowsuppressed, now - cam.windowstart);
+	}
 
-	close(m_LoggerPipe[1]);
-	close(STDOUT_FILENO);
-	close(STDERR_FILENO);
+	cam.windowstart = now;
+	cam.windowlines = 0;
+	cam.windowsuppressed = 0;
 
-	waitpid(m_LoggerPID, &ret, 0); // Logger exits once its stdin closes
+	timerwheel_cancel(m_Timers, output_timer(cam));
+}
 
-	// stdout and stderr are still closed from here. Caller has to fix this.
+size_t output_timer(const camera& cam)
+{
+	// The output window of a camera has a timer of its own, after those
+	// of all cameras (see schedule_camera()).
+
+	return m_Cameras.size() + (&cam - &m_Cameras[0]);
+}
+
+void LOG(int priority, const char* format, ...)
+{
+	va_list arguments;
+
+	va_start(arguments, format);
+	log_message(priority, NULL, 0, format, arguments);
+	va_end(arguments);
+}
+
+void CAMERA_LOG(int priority, const camera& cam, pid_t pid, const char* format, ...)
+{
+	// Like LOG(), and the journal also gets the camera and the PID of its
+	// command as fields of their own.
+
+	va_list arguments;
+
+	va_start(arguments, format);
+	log_message(priority, &cam, pid, format, arguments);
+	va_end(arguments);
+}
+
+void log_message(int priority, const camera* cam, pid_t pid, const char* format, va_list arguments)
+{
+	// Until the log is open, messages go to stderr (e.g. while starting
+	// up, or in bench_spawn).
+
+	if (!m_Log.open)
+	{
+		vfprintf(stderr, format, arguments);
+		fputc('\n', stderr);
+		return;
+	}
+
+	logring_push(m_Log, priority, cam != NULL ? cam->name.c_str() : NULL, pid, format, arguments);
 }
 
 void output_statistics()
@@ -593,65 +1212,132 @@ void output_statistics()
 		info = localtime(&cam->laststart);
 		strftime(buf2, 255,"%x %X", info);
 
-		printf("Camera \"%s\" - Command: \"%s\", PID: %d, Error count: %d, Disabled? %s, Resetting? %s, Last reset: %s, Last start: %s.\n",
+		CAMERA_LOG(LOG_NOTICE, *cam, cam->pid, "Camera \"%s\" - Command: \"%s\", PID: %d, Error count: %d, Disabled? %s, Probing? %s, Resetting? %s, Last reset: %s, Last start: %s, Last restart late by: %.3f s, Last downtime: %.1f s, Output: %lu line(s) and %lu byte(s), %lu line(s) not logged.",
 			cam->name.c_str(), cam->command.c_str(), cam->pid, cam->errcount,
 			cam->disabled ? "Yes" : "No",
+			cam->probing ? "Yes" : "No",
 			cam->resetting ? "Yes" : "No",
-			buf, buf2);
+			buf, buf2, cam->restartlatency, cam->downtime,
+			cam->outputlines, cam->outputbytes, cam->suppressedlines);
 	}
+
+	LOG(LOG_NOTICE, "Restarts: %lu, late by %.3f s on average and %.3f s at most.",
+		m_Restarts, m_Restarts > 0 ? m_TotalRestartLatency / m_Restarts : 0, m_MaxRestartLatency);
+
+	LOG(LOG_NOTICE, "Log: %lu message(s) sent, %lu dropped because the log could not keep up, %lu lost because it was unavailable.",
+		m_Log.sent, m_Log.dropped.load(), m_Log.failed);
 }
 
-pid_t run_process(string cmdline)
+NARGV* parse_command(const string& cmdline)
 {
-	// Run a process in the background and return its PID.
+	// The argument vector of a command line, or NULL if there is none.
+	// It is kept for as long as camsrvd runs.
 
 	if (cmdline.empty())
 	{
-		fprintf(stderr, "Refusing to run an empty command line.");
-		return -1;
+		fprintf(stderr, "Refusing to run an empty command line.\n");
+		return NULL;
 	}
 
 	// TODO: nargv is plain C and I don't know how to use smart pointers :(
 	NARGV *nargv = nargv_parse(const_cast<char*>(cmdline.c_str()));
 
-	// from here nargv holds memory
-
 	if (nargv->error_code)
 	{
 		fprintf(stderr, "Unable to parse command line \"%s\" (%d) %s\n",
 			cmdline.c_str(), nargv->error_code, nargv->error_message);
 
 		nargv_free(nargv);
-		return -1;
+		return NULL;
 	}
 
 	if (nargv->argc == 0)
 	{
-		fprintf(stderr, "Command line is not empty, but parsed to nothing. WTF?");
+		fprintf(stderr, "Command line is not empty, but parsed to nothing. WTF?\n");
 		nargv_free(nargv);
-		return -1;
+		return NULL;
 	}
 
-	pid_t pid = fork();
+	return nargv;
+}
 
-	if (pid == -1)
-	{
-		posix_fail("Could not fork to start process.", false);
-		nargv_free(nargv);
-		return -1;
-	}
+void prepare_spawn()
+{
+	// Cameras are started with posix_spawn(), which does not copy the
+	// address space of camsrvd the way fork() does, so starting one takes
+	// as long with hundreds of cameras as with one. Whatever the child
+	// needs done before it runs the command is set up here once:
+	//
+	// - The signals camsrvd blocks (see setup_signal_handler()) are not
+	//   blocked in the child, and have their default handling.
+	// - stdin is /dev/null, and stdout and stderr are the output pipe of
+	//   the camera (see prepare_file_actions()). Every other descriptor of
+	//   camsrvd is close-on-exec.
 
-	if (pid == 0)
+	sigset_t mask;
+	sigemptyset(&mask);
+
+	sigset_t defaults;
+	sigemptyset(&defaults);
+	sigaddset(&defaults, SIGTERM);
+	sigaddset(&defaults, SIGCHLD);
+	sigaddset(&defaults, SIGUSR1);
+	sigaddset(&defaults, SIGHUP);
+	sigaddset(&defaults, SIGPIPE);
+
+	short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+
+#ifdef POSIX_SPAWN_USEVFORK
+	flags |= POSIX_SPAWN_USEVFORK;
+#endif
+
+	errno = posix_spawnattr_init(&m_SpawnAttributes);
+	posix_fail("Could not initialize spawn attributes.", true);
+
+	errno = posix_spawnattr_setflags(&m_SpawnAttributes, flags);
+	posix_fail("Could not set spawn flags.", true);
+
+	errno = posix_spawnattr_setsigmask(&m_SpawnAttributes, &mask);
+	posix_fail("Could not set spawn signal mask.", true);
+
+	errno = posix_spawnattr_setsigdefault(&m_SpawnAttributes, &defaults);
+	posix_fail("Could not set spawn signal defaults.", true);
+
+	// For processes without an output pipe of their own
+	prepare_file_actions(m_SpawnActions, -1);
+}
+
+void prepare_file_actions(posix_spawn_file_actions_t& actions, int output)
+{
+	errno = posix_spawn_file_actions_init(&actions);
+	posix_fail("Could not initialize spawn file actions.", true);
+
+	if (output != -1)
 	{
-		/* Child here */
-		if (execv(nargv->argv[0], nargv->argv) == -1)
-			posix_fail("Starting process failed.", true);
+		errno = posix_spawn_file_actions_adddup2(&actions, output, STDOUT_FILENO);
+		posix_fail("Could not add spawn file action.", true);
+
+		errno = posix_spawn_file_actions_adddup2(&actions, output, STDERR_FILENO);
+		posix_fail("Could not add spawn file action.", true);
 	}
 
-	/* Parent here */
-	printf("Started \"%s\" with PID %d.\n", nargv->argv[0], pid);
+	errno = posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+	posix_fail("Could not add spawn file action.", true);
+}
+
+pid_t run_process(const NARGV* args, const posix_spawn_file_actions_t* actions)
+{
+	// Run a process in the background and return its PID.
 
-	nargv_free(nargv);
+	pid_t pid;
+
+	errno = posix_spawn(&pid, args->argv[0], actions, &m_SpawnAttributes, args->argv, environ);
+
+	if (errno != 0)
+	{
+		posix_fail("Starting process failed.", false);
+		return -1;
+	}
 
 	return pid;
 }
@@ -664,7 +1350,7 @@ void posix_fail(string why, bool terminate)
 	if (errno == 0)
 		return;
 
-	fprintf(stderr, "Failure: %s - %s\n", why.c_str(), strerror(errno));
+	LOG(LOG_ERR, "Failure: %s - %s", why.c_str(), strerror(errno));
 
 	if (terminate)
 		exit(1);
@@ -8,14 +8,26 @@
 
 #include <algorithm>
 
+#include <math.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/epoll.h>
 #include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/wait.h>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/property_tree/ini_parser.hpp>
 
 #include "locking.hpp"
+#include "logring.hpp"
+#include "timerwheel.hpp"
 
 extern "C"
 {
@@ -25,42 +37,123 @@ extern "C"
 using namespace std;
 using namespace boost;
 
-#define LOGGER_EXECUTABLE "/usr/bin/logger"
 #define LOGGER_TAG "camsrvd"
-#define LOGGER_PRIORITY "user.notice"
+#define LOGGER_FACILITY LOG_USER
 #define LOCKFILE "/var/run/camsrvd.pid"
 
 #define SENDMAIL_EXECUTABLE "/usr/lib/sendmail -t"
 
+// What an epoll event is about, besides the index of a camera
+#define CAMSRVD_EVENT_SIGNAL UINT64_MAX
+#define CAMSRVD_EVENT_TIMER (UINT64_MAX - 1)
+
+// Set in the tag of the output pipe of a camera, besides its index
+#define CAMSRVD_EVENT_OUTPUT ((uint64_t)1 << 62)
+
+// Events handled per epoll_wait()
+#define CAMSRVD_EVENTS 64
+
+// Bytes read from the output of a camera at a time, and how much its
+// pipe can hold while camsrvd is busy
+#define CAMSRVD_OUTPUT_READ 65536
+#define CAMSRVD_OUTPUT_PIPE (1024 * 1024)
+
+// Descriptors needed per camera (output pipe and process descriptor), and
+// for everything else
+#define CAMSRVD_CAMERA_FILES 3
+#define CAMSRVD_SPARE_FILES 64
+
+// How soon to try again when the system log is not taking messages
+#define CAMSRVD_LOG_RETRY_MS 100
+
+// Resolution of the restart timers
+#define CAMSRVD_TICKS_PER_SECOND 10
+
 typedef struct camsrvdcamera
 {
 	string name;
 	string command;
+	NARGV* args;
 	pid_t pid;
+	int pidfd;
 	int errcount;
 	bool disabled;
+	bool probing;
 	bool resetting;
 	time_t lastreset;
 	time_t laststart;
+	double startedat;
+	double exitedat;
+	double restartdue;
+	double healthydue;
+	double restartlatency;
+	double downtime;
+	int output[2];
+	posix_spawn_file_actions_t actions;
+	string partial;
+	unsigned long outputbytes;
+	unsigned long outputlines;
+	unsigned long suppressedlines;
+	unsigned long windowlines;
+	unsigned long windowsuppressed;
+	double windowstart;
 } camera;
 
+#ifndef CAMSRVD_NO_MAIN
 int main (int argc, const char* argv[]);
+#endif
+
+// For processes without an output pipe of their own, see prepare_spawn()
+extern posix_spawn_file_actions_t m_SpawnActions;
 
 void notify_camera_disabled(const camera disabledtask);
 
 void load_settings(const string& filename);
+NARGV* parse_command(const string& cmdline);
 
 void setup_signal_handler();
-void handle_signal(int signum);
+void unblock_signals();
+
+void open_event_loop();
+void watch_descriptor(int fd, uint64_t tag);
+int pidfd_open(pid_t pid);
+void wait_for_events(int timeout_ms);
+void handle_signals();
+void handle_timer();
+void expire_timers();
+void arm_restart_timer();
+void schedule_camera(camera& cam, double due);
+void camera_timer(camera& cam);
+double restart_delay(const camera& cam);
+
+void start_camera(camera& cam);
+void reap_camera(camera& cam);
+void reap_children();
+void camera_exited(camera& cam, int status);
+void enable_cameras();
+size_t running_cameras();
+
+double monotonic_seconds();
+uint64_t monotonic_tick(double seconds, bool round_up);
 
 void become_daemon();
 
-void redirect_output_to_logger();
-void close_logger();
+void open_log();
+void close_log();
+void open_camera_output(camera& cam);
+void read_camera_output(camera& cam);
+void log_camera_output(camera& cam, const char* line, size_t length, double now);
+void end_output_window(camera& cam, double now);
+size_t output_timer(const camera& cam);
+void LOG(int priority, const char* format, ...);
+void CAMERA_LOG(int priority, const camera& cam, pid_t pid, const char* format, ...);
+void log_message(int priority, const camera* cam, pid_t pid, const char* format, va_list arguments);
 
 void output_statistics();
 
-pid_t run_process(string cmdline);
+void prepare_spawn();
+void prepare_file_actions(posix_spawn_file_actions_t& actions, int output);
+pid_t run_process(const NARGV* args, const posix_spawn_file_actions_t* actions);
 
 void posix_fail(string why, bool terminate);
 #endif
@@ -0,0 +1,578 @@
+/*
+ * catalog - Persistent Catalog of the Recordings of a Camera
+ *
+ * Maintenance used to look at every file of every camera on every run, even
+ * though almost all of them were finished and dealt with days ago. The
+ * catalog remembers name, size, modification time and state of every
+ * recording in a directory, so that a run only has to look at what is new.
+ *
+ * Reconciling a catalog with its directory works like this:
+ *
+ * - If the modification time of the directory is still the one seen on the
+ *   last reconcile, no file was added, removed or renamed since, so only the
+ *   recordings that motion detection has yet to look at (which could still
+ *   be growing) are looked at again.
+ *
+ * - Otherwise, the names in the directory are read and compared with the
+ *   catalog. Only names that are not in the catalog yet are looked at;
+ *   names that are gone are dropped.
+ *
+ * The catalog is kept in a file in the directory itself. It is overwritten
+ * in place rather than replaced, so saving it does not count as a change of
+ * the directory. A checksum catches a file that was only partially written;
+ * such a catalog is simply rebuilt from scratch.
+ *
+ * The file is a fixed header, then one record per recording sorted by name,
+ * then the names (each followed by a null byte). Everything is in the byte
+ * order of the machine that wrote it.
+ *
+ * For the web interface, the catalog is also published as an index in the
+ * CATALOG_INDEX_DIRECTORY of the directory. It is laid out the same way,
+ * but sorted by modification time, and it says when every recording
+ * started, how long it is and how much motion it had. So the web interface
+ * (see camsrv-catalog) can map it into memory and find the recordings of
+ * any period of time by binary search, instead of looking at every file.
+ * It is written under a temporary name and then renamed, so readers always
+ * see a whole one; being in a directory of its own, replacing it does not
+ * count as a change of the directory with the recordings.
+ *
+ * Note that the index is sorted by when recordings were last modified,
+ * which is when they ended, not by when they started: a period finds the
+ * recordings that ended in it. The start comes from the name the grabber
+ * gave the recording (the default "filenametpl"); for other names, it is
+ * worked out from the duration, which is only known once motion detection
+ * has been through the recording. Until then, the start of such a
+ * recording is its end. Only the motion of recordings that maintenance did
+ * not analyse itself comes from their name ("-MOTION-n"); their duration
+ * comes from their timeline.
+ *
+ */
+
+#include "catalog.hpp"
+#include "fileio.hpp"
+#include "timeline.hpp"
+
+#include <algorithm>
+#include <vector>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// The layout of the file must not depend on the compiler.
+static_assert(sizeof(catalogheader) == 40, "catalogheader must be 40 bytes");
+static_assert(sizeof(catalogrecord) == 40, "catalogrecord must be 40 bytes");
+static_assert(sizeof(catalogindexheader) == 32, "catalogindexheader must be 32 bytes");
+static_assert(sizeof(catalogindexrecord) == 40, "catalogindexrecord must be 40 bytes");
+
+static string catalog_path(const string& directory, const string& filename)
+{
+	if (!directory.empty() && directory[directory.size() - 1] == '/')
+		return directory + filename;
+
+	return directory + "/" + filename;
+}
+
+static uint32_t checksum(uint32_t hash, const void* data, size_t size)
+{
+	// FNV-1a
+
+	const unsigned char* p = (const unsigned char*)data;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= p[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static uint32_t recorded_duration(int dirfd, const char* name)
+{
+	// How long a recording that has been through motion detection is, as
+	// noted in its timeline; 0 if unknown.
+
+	const string timeline = string(name) + TIMELINE_EXTENSION;
+
+	int fd = openat(dirfd, timeline.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return 0;
+
+	timelineheader header;
+
+	bool success = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+		memcmp(header.magic, TIMELINE_MAGIC, sizeof(header.magic)) == 0;
+
+	close(fd);
+
+	return success ? header.duration_ms : 0;
+}
+
+static time_t recording_start(const char* name)
+{
+	// When a recording started, if it is named like the grabber names
+	// them by default ("%Y-%m-%d_%H-%M-%S", local time); -1 otherwise.
+
+	struct tm local;
+	memset(&local, 0, sizeof(local));
+	local.tm_isdst = -1;
+
+	if (strptime(name, "%Y-%m-%d_%H-%M-%S", &local) == NULL)
+		return -1;
+
+	return mktime(&local);
+}
+
+static bool by_modification(const catalogindexrecord& a, const catalogindexrecord& b)
+{
+	return a.modified < b.modified;
+}
+
+static void catalog_clear(catalog& cat)
+{
+	cat.entries.clear();
+	cat.scanned.tv_sec = -1;
+	cat.scanned.tv_nsec = 0;
+}
+
+bool catalog_load(catalog& cat, const string& directory)
+{
+	// An empty catalog is returned if there is none, or if it cannot be
+	// used; it then gets rebuilt by the next reconcile.
+
+	cat.directory = directory;
+	cat.loaded = true;
+	cat.statted = 0;
+
+	catalog_clear(cat);
+
+	FILE* file = fopen(catalog_path(directory, CATALOG_FILENAME).c_str(), "rb");
+
+	if (file == NULL)
+		return false;
+
+	catalogheader header;
+	vector<catalogrecord> records;
+	vector<char> names;
+
+	bool success = fread(&header, sizeof(header), 1, file) == 1 &&
+		memcmp(header.magic, CATALOG_MAGIC, sizeof(header.magic)) == 0 &&
+		header.version == CATALOG_VERSION &&
+		header.entry_size == sizeof(catalogrecord);
+
+	if (success)
+	{
+		records.resize(header.count);
+		names.resize(header.names);
+
+		success = (header.count == 0 ||
+			fread(&records[0], sizeof(catalogrecord), header.count, file) == header.count) &&
+			(header.names == 0 || fread(&names[0], 1, header.names, file) == header.names) &&
+			fgetc(file) == EOF;
+	}
+
+	fclose(file);
+
+	if (success)
+	{
+		uint32_t hash = 2166136261u;
+
+		if (!records.empty())
+			hash = checksum(hash, &records[0], records.size() * sizeof(catalogrecord));
+
+		if (!names.empty())
+			hash = checksum(hash, &names[0], names.size());
+
+		success = hash == header.checksum;
+	}
+
+	for (vector<catalogrecord>::iterator record = records.begin(); success && record != records.end(); ++record)
+	{
+		if ((uint64_t)record->name + record->name_length >= names.size() ||
+			names[record->name + record->name_length] != '\0')
+		{
+			success = false;
+			break;
+		}
+
+		catalogentry entry;
+
+		entry.size = record->size;
+		entry.mtime.tv_sec = record->mtime_sec;
+		entry.mtime.tv_nsec = record->mtime_nsec;
+		entry.state = record->state;
+		entry.motion = record->motion;
+		entry.duration_ms = record->duration_ms;
+		entry.flags = record->flags;
+		entry.quality = record->quality;
+		entry.attempts = record->attempts;
+		entry.settings = record->settings;
+		entry.present = true;
+
+		cat.entries.insert(cat.entries.end(),
+			make_pair(string(&names[record->name], record->name_length), entry));
+	}
+
+	if (!success)
+	{
+		catalog_clear(cat);
+		return false;
+	}
+
+	cat.scanned.tv_sec = header.scanned_sec;
+	cat.scanned.tv_nsec = header.scanned_nsec;
+
+	return true;
+}
+
+bool catalog_save(const catalog& cat)
+{
+	catalogheader header;
+	vector<catalogrecord> records;
+	string names;
+
+	records.reserve(cat.entries.size());
+
+	for (map<string, catalogentry>::const_iterator it = cat.entries.begin(); it != cat.entries.end(); ++it)
+	{
+		catalogrecord record;
+		memset(&record, 0, sizeof(record));
+
+		record.size = it->second.size;
+		record.mtime_sec = it->second.mtime.tv_sec;
+		record.mtime_nsec = it->second.mtime.tv_nsec;
+		record.name = names.size();
+		record.name_length = it->first.size();
+		record.state = it->second.state;
+		record.motion = it->second.motion;
+		record.duration_ms = it->second.duration_ms;
+		record.flags = it->second.flags;
+		record.quality = it->second.quality;
+		record.attempts = min(it->second.attempts, 255);
+		record.settings = it->second.settings;
+
+		names.append(it->first);
+		names.push_back('\0');
+
+		records.push_back(record);
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CATALOG_MAGIC, sizeof(header.magic));
+
+	header.version = CATALOG_VERSION;
+	header.entry_size = sizeof(catalogrecord);
+	header.count = records.size();
+	header.names = names.size();
+	header.scanned_sec = cat.scanned.tv_sec;
+	header.scanned_nsec = cat.scanned.tv_nsec;
+	header.checksum = 2166136261u;
+
+	if (!records.empty())
+		header.checksum = checksum(header.checksum, &records[0], records.size() * sizeof(catalogrecord));
+
+	header.checksum = checksum(header.checksum, names.data(), names.size());
+
+	int fd = open(catalog_path(cat.directory, CATALOG_FILENAME).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC,
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+	if (fd < 0)
+		return false;
+
+	const off_t size = sizeof(header) + records.size() * sizeof(catalogrecord) + names.size();
+
+	bool success = fileio_write_all(fd, &header, sizeof(header)) &&
+		(records.empty() || fileio_write_all(fd, &records[0], records.size() * sizeof(catalogrecord))) &&
+		fileio_write_all(fd, names.data(), names.size()) &&
+		ftruncate(fd, size) == 0;
+
+	return close(fd) == 0 && success;
+}
+
+bool catalog_publish(const catalog& cat)
+{
+	const string directory = catalog_path(cat.directory, CATALOG_INDEX_DIRECTORY);
+
+	if (mkdir(directory.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0 && errno != EEXIST)
+		return false;
+
+	catalogindexheader header;
+	vector<catalogindexrecord> records;
+	string names;
+
+	records.reserve(cat.entries.size());
+
+	for (map<string, catalogentry>::const_iterator it = cat.entries.begin(); it != cat.entries.end(); ++it)
+	{
+		catalogindexrecord record;
+		memset(&record, 0, sizeof(record));
+
+		// Recordings are written from start to end, so otherwise they
+		// started however long they are before they were last modified.
+		const time_t named = recording_start(it->first.c_str());
+
+		record.modified = it->second.mtime.tv_sec;
+		record.start = named != -1 ? named : record.modified - it->second.duration_ms / 1000;
+		record.size = it->second.size;
+		record.duration_ms = it->second.duration_ms;
+		record.motion = it->second.motion;
+		record.name = names.size();
+		record.name_length = it->first.size();
+		record.state = it->second.state;
+		record.quality = it->second.quality;
+
+		names.append(it->first);
+		names.push_back('\0');
+
+		records.push_back(record);
+	}
+
+	stable_sort(records.begin(), records.end(), by_modification);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CATALOG_INDEX_MAGIC, sizeof(header.magic));
+
+	header.version = CATALOG_INDEX_VERSION;
+	header.entry_size = sizeof(catalogindexrecord);
+	header.count = records.size();
+	header.names = names.size();
+	header.generated = time(NULL);
+
+	const string filename = catalog_path(directory, CATALOG_INDEX_FILENAME);
+	const string temporary = filename + ".tmp";
+
+	int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+	if (fd < 0)
+		return false;
+
+	bool success = fileio_write_all(fd, &header, sizeof(header)) &&
+		(records.empty() || fileio_write_all(fd, &records[0], records.size() * sizeof(catalogindexrecord))) &&
+		fileio_write_all(fd, names.data(), names.size());
+
+	success = close(fd) == 0 && success;
+
+	if (success)
+		success = rename(temporary.c_str(), filename.c_str()) == 0;
+
+	if (!success)
+		unlink(temporary.c_str());
+
+	return success;
+}
+
+int catalog_reconcile(catalog& cat, bool (*recording)(const char* name),
+	catalogvanished vanished, void* context, string& problem)
+{
+	// Returns 0 on success, -1 if the directory cannot be read, or -2 if
+	// there is a symbolic link in it (its name goes to "problem").
+	// "vanished", if given, is called with "context" for every recording
+	// that is no longer there.
+
+	cat.statted = 0;
+
+	int dirfd = open(cat.directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (dirfd < 0)
+		return -1;
+
+	struct stat st;
+
+	if (fstat(dirfd, &st) != 0)
+	{
+		close(dirfd);
+		return -1;
+	}
+
+	// Changes within the same tick of the clock could go unnoticed, so a
+	// directory modified just now always counts as changed.
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	const bool changed = st.st_mtim.tv_sec != cat.scanned.tv_sec ||
+		st.st_mtim.tv_nsec != cat.scanned.tv_nsec || now.tv_sec - st.st_mtim.tv_sec <= 1;
+
+	if (changed)
+	{
+		int listfd = dup(dirfd);
+		DIR* dir = listfd < 0 ? NULL : fdopendir(listfd);
+
+		if (dir == NULL)
+		{
+			if (listfd >= 0)
+				close(listfd);
+
+			close(dirfd);
+			return -1;
+		}
+
+		for (map<string, catalogentry>::iterator it = cat.entries.begin(); it != cat.entries.end(); ++it)
+			it->second.present = false;
+
+		struct dirent* ent;
+
+		while ((ent = readdir(dir)) != NULL)
+		{
+			if (ent->d_type == DT_DIR || !recording(ent->d_name))
+				continue;
+
+			if (ent->d_type == DT_LNK)
+			{
+				problem = ent->d_name;
+				closedir(dir);
+				close(dirfd);
+				return -2;
+			}
+
+			map<string, catalogentry>::iterator it = cat.entries.find(ent->d_name);
+
+			if (it != cat.entries.end())
+			{
+				it->second.present = true;
+				continue;
+			}
+
+			struct stat file;
+			cat.statted++;
+
+			if (fstatat(dirfd, ent->d_name, &file, AT_SYMLINK_NOFOLLOW) != 0)
+				continue;
+
+			if (S_ISLNK(file.st_mode))
+			{
+				problem = ent->d_name;
+				closedir(dir);
+				close(dirfd);
+				return -2;
+			}
+
+			if (!S_ISREG(file.st_mode))
+				continue;
+
+			catalogentry entry;
+
+			entry.size = file.st_size;
+			entry.mtime = file.st_mtim;
+			entry.state = CATALOG_NEW;
+			entry.motion = -1;
+			entry.duration_ms = 0;
+			entry.flags = 0;
+			entry.quality = 0;
+			entry.attempts = 0;
+			entry.settings = 0;
+			entry.present = true;
+
+			const char* motion = strstr(ent->d_name, "-MOTION");
+
+			if (motion != NULL)
+			{
+				entry.state = CATALOG_PROCESSED;
+
+				if (sscanf(motion, "-MOTION-%d", &entry.motion) != 1)
+					entry.motion = -1;
+
+				entry.duration_ms = recorded_duration(dirfd, ent->d_name);
+			}
+
+			cat.entries.insert(make_pair(string(ent->d_name), entry));
+		}
+
+		closedir(dir);
+
+		for (map<string, catalogentry>::iterator it = cat.entries.begin(); it != cat.entries.end(); )
+		{
+			if (it->second.present)
+			{
+				++it;
+				continue;
+			}
+
+			if (vanished != NULL)
+				vanished(it->first, it->second, context);
+
+			cat.entries.erase(it++);
+		}
+
+		cat.scanned = st.st_mtim;
+	}
+
+	// Recordings motion detection has yet to look at may still be growing.
+	for (map<string, catalogentry>::iterator it = cat.entries.begin(); it != cat.entries.end(); )
+	{
+		if (it->second.state != CATALOG_NEW)
+		{
+			++it;
+			continue;
+		}
+
+		struct stat file;
+		cat.statted++;
+
+		if (fstatat(dirfd, it->first.c_str(), &file, AT_SYMLINK_NOFOLLOW) != 0)
+		{
+			if (vanished != NULL)
+				vanished(it->first, it->second, context);
+
+			cat.entries.erase(it++);
+			continue;
+		}
+
+		it->second.size = file.st_size;
+		it->second.mtime = file.st_mtim;
+		++it;
+	}
+
+	close(dirfd);
+
+	return 0;
+}
+
+void catalog_rename(catalog& cat, const string& from, const string& to, int state)
+{
+	// Renaming does not change size or modification time.
+
+	map<string, catalogentry>::iterator it = cat.entries.find(from);
+
+	if (it == cat.entries.end())
+		return;
+
+	catalogentry entry = it->second;
+	entry.state = state;
+
+	cat.entries.erase(it);
+	cat.entries[to] = entry;
+}
+
+void catalog_describe(catalog& cat, const string& name, int motion, uint32_t duration_ms, int quality)
+{
+	map<string, catalogentry>::iterator it = cat.entries.find(name);
+
+	if (it == cat.entries.end())
+		return;
+
+	it->second.motion = motion;
+	it->second.duration_ms = duration_ms;
+	it->second.quality = quality;
+}
+
+void catalog_remove(catalog& cat, const string& name)
+{
+	cat.entries.erase(name);
+}
+
+void catalog_rescan(catalog& cat)
+{
+	// For when the directory is not what the catalog says, without its
+	// modification time having to show it: the next reconcile reads it.
+
+	cat.scanned.tv_sec = -1;
+	cat.scanned.tv_nsec = 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * catalog - Persistent Catalog of the Recordings of a Camera
+ *
+ */
+
+#ifndef CATALOG_HPP
+#define CATALOG_HPP
+
+#include <map>
+#include <string>
+
+#include <stdint.h>
+#include <time.h>
+
+using namespace std;
+
+#define CATALOG_FILENAME ".catalog"
+#define CATALOG_MAGIC "CAMSRVCT"
+#define CATALOG_VERSION 2
+
+// Published for the web interface, see catalog_publish()
+#define CATALOG_INDEX_DIRECTORY ".camsrv"
+#define CATALOG_INDEX_FILENAME "index"
+#define CATALOG_INDEX_MAGIC "CAMSRVIX"
+#define CATALOG_INDEX_VERSION 1
+
+// States of a recording
+#define CATALOG_NEW 0       // Motion detection has yet to look at it
+#define CATALOG_PROCESSED 1 // Renamed to say how much motion there was
+#define CATALOG_FAILED 2    // Could not be analysed; left alone from then on
+
+// Flags of a recording
+#define CATALOG_COUNTED 0x01 // Its motion is in the heatmap
+#define CATALOG_MISFIT 0x02  // The mask of the camera does not fit it
+
+typedef struct catalogheader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint32_t count;
+	uint32_t names;
+	int64_t scanned_sec;
+	uint32_t scanned_nsec;
+	uint32_t checksum;
+} catalogheader;
+
+typedef struct catalogrecord
+{
+	int64_t size;
+	int64_t mtime_sec;
+	uint32_t mtime_nsec;
+	uint32_t name;
+	uint32_t duration_ms;
+	int32_t motion;
+	uint16_t name_length;
+	uint8_t state;
+	uint8_t flags;
+	uint8_t quality;
+	uint8_t attempts;
+	uint16_t settings;
+} catalogrecord;
+
+typedef struct catalogindexheader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint32_t count;
+	uint32_t names;
+	int64_t generated;
+} catalogindexheader;
+
+typedef struct catalogindexrecord
+{
+	int64_t modified;
+	int64_t start;
+	int64_t size;
+	uint32_t duration_ms;
+	int32_t motion;
+	uint32_t name;
+	uint16_t name_length;
+	uint8_t state;
+	uint8_t quality;
+} catalogindexrecord;
+
+typedef struct catalogentry
+{
+	int64_t size;
+	struct timespec mtime;
+	int state;
+	int motion;
+	uint32_t duration_ms;
+	int flags;
+	int quality;
+	int attempts;      // How often motion detection has failed so far
+	uint16_t settings; // Of the camera when it last failed; see camera_settings()
+	bool present;
+} catalogentry;
+
+typedef struct catalog
+{
+	string directory;
+	struct timespec scanned;
+	map<string, catalogentry> entries;
+	bool loaded;
+	unsigned long statted;
+} catalog;
+
+// Told about every recording that has gone from the directory, before it
+// goes from the catalog too.
+typedef void (*catalogvanished)(const string& name, const catalogentry& entry, void* context);
+
+bool catalog_load(catalog& cat, const string& directory);
+bool catalog_save(const catalog& cat);
+bool catalog_publish(const catalog& cat);
+int catalog_reconcile(catalog& cat, bool (*recording)(const char* name),
+	catalogvanished vanished, void* context, string& problem);
+void catalog_rename(catalog& cat, const string& from, const string& to, int state);
+void catalog_describe(catalog& cat, const string& name, int motion, uint32_t duration_ms, int quality);
+void catalog_remove(catalog& cat, const string& name);
+void catalog_rescan(catalog& cat);
+#endif
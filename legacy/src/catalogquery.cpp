@@ -0,0 +1,362 @@
+/*
+ * camsrv-catalog - Recordings of a Camera as JSON
+ *
+ * Prints the recordings of a camera for a period of time, so that the web
+ * interface does not have to look at every file in the directory of the
+ * camera on every page load. Reads the index that maintenance publishes
+ * next to the recordings (see catalog.cpp) by mapping it into memory and
+ * finding the start and end of the period by binary search, so it takes
+ * about as long for ten days of recordings as for ten minutes.
+ *
+ * The index is sorted by "modified", so the period selects recordings by
+ * when they ended; one that started before "-f" but ended after it is
+ * included, one that started before "-t" but ended after it is not.
+ *
+ * Output is a JSON object:
+ *
+ * {"generated":1700000000,"recordings":[{"name":"...","modified":...,
+ *  "start":...,"duration":300.0,"size":...,"motion":3,"quality":0},...]}
+ *
+ * "duration" and "motion" are null for recordings that motion detection has
+ * yet to look at. "quality" is 0 for recordings analysed as configured, and
+ * higher for ones that were analysed more cheaply to get a run done in time
+ * (see "maxruntime").
+ *
+ * With "-H", prints the heatmap that maintenance keeps instead (see
+ * heatmap.cpp), as seconds with motion for each hour of each day:
+ *
+ * {"days":[{"date":"2024-05-01","hours":[0,12,...]},...]}
+ *
+ */
+
+#include "catalogquery.hpp"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static bool modified_before(const catalogindexrecord& record, time_t value)
+{
+	return record.modified < value;
+}
+
+static bool modified_after(time_t value, const catalogindexrecord& record)
+{
+	return value < record.modified;
+}
+
+int main(int argc, char* const argv[])
+{
+	string directory;
+	time_t from = 0;
+	time_t to = (time_t)INT64_MAX;
+	int minmotion = -1;
+	long limit = -1;
+	bool newest_first = false;
+	bool show_heatmap = false;
+	char opt;
+
+	while ((opt = getopt(argc, argv, "d:f:t:m:l:nH")) != EOF)
+		switch(opt)
+		{
+			case 'd':
+				directory = optarg;
+				break;
+			case 'f':
+				if (!parse_time(optarg, false, from))
+					exit_usage(argv[0]);
+				break;
+			case 't':
+				if (!parse_time(optarg, true, to))
+					exit_usage(argv[0]);
+				break;
+			case 'm':
+				minmotion = atoi(optarg);
+				break;
+			case 'l':
+				limit = atol(optarg);
+				break;
+			case 'n':
+				newest_first = true;
+				break;
+			case 'H':
+				show_heatmap = true;
+				break;
+			case '?':
+			default:
+				exit_usage(argv[0]);
+				break;
+		}
+
+	if (directory.empty())
+		exit_usage(argv[0]);
+
+	if (show_heatmap)
+		return print_heatmap(directory, from, to);
+
+	catalogindex index;
+
+	if (!open_index(directory, index))
+	{
+		fprintf(stderr, "Error: No usable recording index in \"%s\" (%s). Has maintenance run yet?\n",
+			directory.c_str(), errno != 0 ? strerror(errno) : "invalid");
+		return 1;
+	}
+
+	const catalogindexrecord* begin = index.records;
+	const catalogindexrecord* end = index.records + index.header->count;
+
+	const catalogindexrecord* first = lower_bound(begin, end, from, modified_before);
+	const catalogindexrecord* last = upper_bound(first, end, to, modified_after);
+
+	printf("{\"generated\":%lld,\"recordings\":[", (long long)index.header->generated);
+
+	long printed = 0;
+
+	for (ptrdiff_t i = 0; i < last - first && (limit < 0 || printed < limit); i++)
+	{
+		const catalogindexrecord& record = newest_first ? *(last - 1 - i) : *(first + i);
+
+		if (minmotion >= 0 && record.motion < minmotion)
+			continue;
+
+		print_recording(index, record, printed == 0);
+		printed++;
+	}
+
+	printf("]}\n");
+
+	close_index(index);
+
+	return 0;
+}
+
+void exit_usage(const char* argv0)
+{
+	printf("\n");
+	printf("Recordings of a Camera as JSON\n");
+	printf("\n");
+	printf("Usage: %s -d directory [-f from] [-t to] [-m motion] [-l limit] [-n] [-H]\n", argv0);
+	printf("\n");
+	printf("-d directory     Destination directory of the camera.\n");
+	printf("-f from          Only recordings modified (i.e. ended) at or after\n");
+	printf("                 this time.\n");
+	printf("-t to            Only recordings modified (i.e. ended) at or before\n");
+	printf("                 this time.\n");
+	printf("-m motion        Only recordings with at least this much motion.\n");
+	printf("-l limit         At most this many recordings.\n");
+	printf("-n               Newest recordings first.\n");
+	printf("-H               Seconds with motion per hour instead, for the days\n");
+	printf("                 from \"-f\" to \"-t\".\n");
+	printf("\n");
+	printf("Times are seconds since the epoch, or local time as YYYY-MM-DD,\n");
+	printf("YYYY-MM-DD HH:MM or YYYY-MM-DD HH:MM:SS. A date alone for \"-t\"\n");
+	printf("means the end of that day.\n");
+	printf("\n");
+	exit(-EINVAL);
+}
+
+bool parse_time(const char* value, bool end, time_t& result)
+{
+	char* rest = NULL;
+	long long seconds = strtoll(value, &rest, 10);
+
+	if (*value != '\0' && *rest == '\0')
+	{
+		result = seconds;
+		return true;
+	}
+
+	static const char* const formats[] = { "%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d" };
+
+	for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+	{
+		struct tm tm;
+		memset(&tm, 0, sizeof(tm));
+
+		rest = strptime(value, formats[i], &tm);
+
+		if (rest == NULL || *rest != '\0')
+			continue;
+
+		tm.tm_isdst = -1;
+
+		// The whole of the last day
+		if (end && i == 2)
+			tm.tm_mday++;
+
+		result = mktime(&tm);
+
+		if (end && i == 2)
+			result--;
+
+		return result != (time_t)-1;
+	}
+
+	return false;
+}
+
+bool open_index(const string& directory, catalogindex& index)
+{
+	// Maps the index into memory and makes sure it is all there.
+
+	string filename = directory;
+
+	if (filename.empty() || filename[filename.size() - 1] != '/')
+		filename += "/";
+
+	filename += CATALOG_INDEX_DIRECTORY "/" CATALOG_INDEX_FILENAME;
+
+	errno = 0;
+
+	int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(catalogindexheader))
+	{
+		close(fd);
+		return false;
+	}
+
+	index.size = st.st_size;
+	index.mapping = mmap(NULL, index.size, PROT_READ, MAP_SHARED, fd, 0);
+
+	close(fd);
+
+	if (index.mapping == MAP_FAILED)
+		return false;
+
+	const char* base = (const char*)index.mapping;
+
+	index.header = (const catalogindexheader*)base;
+	index.records = (const catalogindexrecord*)(base + sizeof(catalogindexheader));
+	index.names = base + sizeof(catalogindexheader) +
+		(size_t)index.header->count * sizeof(catalogindexrecord);
+
+	if (memcmp(index.header->magic, CATALOG_INDEX_MAGIC, sizeof(index.header->magic)) != 0 ||
+		index.header->version != CATALOG_INDEX_VERSION ||
+		index.header->entry_size != sizeof(catalogindexrecord) ||
+		sizeof(catalogindexheader) + (uint64_t)index.header->count * sizeof(catalogindexrecord) +
+			index.header->names != index.size)
+	{
+		munmap(index.mapping, index.size);
+		return false;
+	}
+
+	return true;
+}
+
+void close_index(catalogindex& index)
+{
+	munmap(index.mapping, index.size);
+}
+
+void print_recording(const catalogindex& index, const catalogindexrecord& record, bool first)
+{
+	if (!first)
+		printf(",");
+
+	printf("{\"name\":");
+
+	if ((uint64_t)record.name + record.name_length < index.header->names)
+		print_json_string(index.names + record.name, record.name_length);
+	else
+		printf("null");
+
+	printf(",\"modified\":%lld,\"start\":%lld", (long long)record.modified, (long long)record.start);
+
+	if (record.duration_ms > 0)
+		printf(",\"duration\":%.3f", record.duration_ms / 1000.0);
+	else
+		printf(",\"duration\":null");
+
+	printf(",\"size\":%lld", (long long)record.size);
+
+	if (record.motion >= 0)
+		printf(",\"motion\":%d", record.motion);
+	else
+		printf(",\"motion\":null");
+
+	printf(",\"quality\":%d}", record.quality);
+}
+
+void print_json_string(const char* value, size_t length)
+{
+	putchar('"');
+
+	for (size_t i = 0; i < length; i++)
+	{
+		unsigned char c = value[i];
+
+		if (c == '"' || c == '\\')
+		{
+			putchar('\\');
+			putchar(c);
+		}
+		else if (c < 0x20)
+		{
+			printf("\\u%04x", c);
+		}
+		else
+		{
+			putchar(c);
+		}
+	}
+
+	putchar('"');
+}
+
+int print_heatmap(const string& directory, time_t from, time_t to)
+{
+	heatmap cube;
+
+	const string filename = directory + "/" CATALOG_INDEX_DIRECTORY "/" HEATMAP_FILENAME;
+
+	errno = 0;
+
+	if (!heatmap_load(cube, filename) && errno != ENOENT)
+	{
+		fprintf(stderr, "Error: No usable heatmap in \"%s\" (%s). Has maintenance run yet?\n",
+			directory.c_str(), errno != 0 ? strerror(errno) : "invalid");
+		return 1;
+	}
+
+	const int64_t first = max(cube.first_day, from > 0 ? heatmap_day(from, NULL) : INT64_MIN);
+	// Without "-t", "to" is INT64_MAX, which localtime_r() cannot convert.
+	const int64_t latest = cube.first_day + (int64_t)(cube.cells.size() / HEATMAP_HOURS) - 1;
+	const int64_t last = to != (time_t)INT64_MAX ? min(latest, heatmap_day(to, NULL)) : latest;
+
+	printf("{\"days\":[");
+
+	for (int64_t day = first; day <= last; day++)
+	{
+		time_t midnight = day * 86400;
+		struct tm date;
+		gmtime_r(&midnight, &date);
+
+		printf("%s{\"date\":\"%04d-%02d-%02d\",\"hours\":[", day != first ? "," : "",
+			date.tm_year + 1900, date.tm_mon + 1, date.tm_mday);
+
+		for (int hour = 0; hour < HEATMAP_HOURS; hour++)
+		{
+			printf("%s%u", hour > 0 ? "," : "",
+				cube.cells[(size_t)(day - cube.first_day) * HEATMAP_HOURS + hour]);
+		}
+
+		printf("]}");
+	}
+
+	printf("]}\n");
+
+	return 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * camsrv-catalog - Recordings of a Camera as JSON
+ *
+ */
+
+#ifndef CATALOGQUERY_HPP
+#define CATALOGQUERY_HPP
+
+#include <string>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "catalog.hpp"
+#include "heatmap.hpp"
+
+using namespace std;
+
+typedef struct catalogindex
+{
+	const catalogindexheader* header;
+	const catalogindexrecord* records;
+	const char* names;
+	void* mapping;
+	size_t size;
+} catalogindex;
+
+int main(int argc, char* const argv[]);
+void exit_usage(const char* argv0);
+bool parse_time(const char* value, bool end, time_t& result);
+bool open_index(const string& directory, catalogindex& index);
+void close_index(catalogindex& index);
+void print_recording(const catalogindex& index, const catalogindexrecord& record, bool first);
+void print_json_string(const char* value, size_t length);
+int print_heatmap(const string& directory, time_t from, time_t to);
+#endif
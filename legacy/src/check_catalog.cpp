@@ -0,0 +1,209 @@
+/*
+ * check_catalog - Check of the Catalog and Heatmap of Maintenance
+ *
+ * The heatmap counts the seconds with motion of every recording once, and
+ * the catalog remembers which recordings it has counted. Both are files of
+ * their own, so either can be lost without the other: a catalog that is
+ * missing or fails its checksum is rebuilt, and recordings can disappear
+ * behind the back of maintenance, with or without their timeline.
+ *
+ * This makes a few recordings with timelines in a temporary directory,
+ * runs maintenance on it the way the daemon and cron runs do, and checks
+ * after every one of those mishaps that the heatmap, in memory and on
+ * disk, still adds up to the seconds with motion that are left. Any
+ * difference makes the check fail.
+ *
+ */
+
+#include "check_catalog.hpp"
+
+extern map<string, catalog> m_Catalogs;
+extern map<string, heatmap> m_Heatmaps;
+extern set<string> m_StaleHeatmaps;
+extern bool m_Verbose;
+extern bool m_Syslog;
+
+int main(int, char* const[])
+{
+	m_Verbose = false;
+	m_Syslog = false;
+
+	char pattern[] = "/tmp/camsrv-check-XXXXXX";
+
+	if (mkdtemp(pattern) == NULL)
+	{
+		printf("Error: Temporary directory could not be created (%s).\n", strerror(errno));
+		return 1;
+	}
+
+	const string directory = pattern;
+
+	camera cam;
+	cam.name = "check";
+	cam.destination = directory;
+
+	string recordings[CHECK_RECORDINGS];
+	unsigned long seconds[CHECK_RECORDINGS];
+	unsigned long expected = 0;
+
+	for (int i = 0; i < CHECK_RECORDINGS; i++)
+	{
+		recordings[i] = make_recording(directory, i, seconds[i]);
+		expected += seconds[i];
+	}
+
+	int failures = 0;
+
+	if (!check_total("first run", cam, expected))
+		failures++;
+
+	restart_maintenance();
+
+	if (!check_total("restart", cam, expected))
+		failures++;
+
+	// A lost catalog is rebuilt, and must not count everything twice.
+	restart_maintenance();
+	unlink((filesystem::path(directory) / CATALOG_FILENAME).string().c_str());
+
+	if (!check_total("rebuilt catalog", cam, expected))
+		failures++;
+
+	// Gone by hand, but its timeline is still there to be taken away
+	unlink((filesystem::path(directory) / recordings[0]).string().c_str());
+	expected -= seconds[0];
+
+	if (!check_total("recording gone", cam, expected))
+		failures++;
+
+	// Gone with its timeline, so the heatmap has to be counted again
+	unlink((filesystem::path(directory) / recordings[1]).string().c_str());
+	unlink(((filesystem::path(directory) / recordings[1]).string() + TIMELINE_EXTENSION).c_str());
+	expected -= seconds[1];
+
+	if (!check_total("recording and timeline gone", cam, expected))
+		failures++;
+
+	system::error_code ignored;
+	filesystem::remove_all(directory, ignored);
+
+	if (failures == 0)
+		printf("The heatmap added up after every step.\n");
+
+	return failures == 0 ? 0 : 1;
+}
+
+string make_recording(const string& directory, int index, unsigned long& seconds)
+{
+	// A recording that motion detection is done with, ending a few
+	// minutes after the one before it, with motion in some of its seconds.
+
+	const time_t recorded = CHECK_RECORDED + index * CHECK_SECONDS;
+
+	vector<timelineentry> timeline(CHECK_SECONDS);
+	seconds = 0;
+
+	for (size_t second = 0; second < timeline.size(); second++)
+	{
+		timeline[second].changes = 0;
+		timeline[second].frames = 25;
+		timeline[second].flags = 0;
+		timeline[second].reserved = 0;
+
+		if (second % (index + 2) == 0)
+		{
+			timeline[second].changes = 1000;
+			timeline[second].flags = TIMELINE_ACTIVE | TIMELINE_MOTION;
+			seconds++;
+		}
+	}
+
+	timelineheader header;
+	timeline_header(header, timeline);
+
+	header.motion = index + 1;
+	header.duration_ms = CHECK_SECONDS * 1000;
+	header.analysed = CHECK_SECONDS * 25;
+	header.recorded = recorded;
+
+	struct tm local;
+	const time_t start = recorded - CHECK_SECONDS;
+	localtime_r(&start, &local);
+
+	char name[64];
+	strftime(name, sizeof(name), "%Y-%m-%d_%H-%M-%S", &local);
+
+	const string filename = string(name) + "-MOTION-" + to_string(index + 1) + ".mp4";
+	const string path = (filesystem::path(directory) / filename).string();
+
+	FILE* video = fopen(path.c_str(), "wb");
+
+	if (video != NULL)
+	{
+		fputs("not really a video", video);
+		fclose(video);
+	}
+
+	timeline_write(path + TIMELINE_EXTENSION, header, timeline);
+
+	return filename;
+}
+
+unsigned long heatmap_total(const string& directory)
+{
+	// Seconds with motion in the heatmap that was saved last
+
+	heatmap cube;
+
+	if (!heatmap_load(cube, (filesystem::path(directory) / CATALOG_INDEX_DIRECTORY / HEATMAP_FILENAME).string()))
+		return 0;
+
+	unsigned long total = 0;
+
+	for (size_t cell = 0; cell < cube.cells.size(); cell++)
+		total += cube.cells[cell];
+
+	return total;
+}
+
+void restart_maintenance()
+{
+	// Forgets everything in memory, like a new cron run would start out.
+
+	m_Catalogs.clear();
+	m_Heatmaps.clear();
+	m_StaleHeatmaps.clear();
+}
+
+bool check_total(const char* step, const camera& cam, unsigned long expected)
+{
+	int status;
+	catalog* cat = camera_catalog(cam, status);
+
+	if (cat == NULL)
+	{
+		printf("FAIL: Catalog of \"%s\" could not be brought up to date (%s).\n",
+			cam.destination.c_str(), step);
+		return false;
+	}
+
+	publish_catalog(*cat);
+	save_catalogs();
+
+	unsigned long total = 0;
+	const heatmap& cube = m_Heatmaps[cam.destination];
+
+	for (size_t cell = 0; cell < cube.cells.size(); cell++)
+		total += cube.cells[cell];
+
+	const unsigned long saved = heatmap_total(cam.destination);
+
+	if (total != expected || saved != expected)
+	{
+		printf("FAIL: The heatmap has %lu second(s) with motion (%lu saved) after the %s, instead of %lu.\n",
+			total, saved, step, expected);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,34 @@
+/*
+ * check_catalog - Check of the Catalog and Heatmap of Maintenance
+ *
+ */
+
+#ifndef CHECK_CATALOG_HPP
+#define CHECK_CATALOG_HPP
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <boost/filesystem.hpp>
+
+#include "maintenance.hpp"
+
+// Recordings made for the check, and how long each of them is
+#define CHECK_RECORDINGS 4
+#define CHECK_SECONDS 300
+
+// When the first of them ended: 2024-05-01 12:00:00 UTC
+#define CHECK_RECORDED 1714564800
+
+using namespace std;
+using namespace boost;
+
+int main(int argc, char* const argv[]);
+string make_recording(const string& directory, int index, unsigned long& seconds);
+unsigned long heatmap_total(const string& directory);
+void restart_maintenance();
+bool check_total(const char* step, const camera& cam, unsigned long expected);
+#endif
@@ -0,0 +1,353 @@
+/*
+ * check_motion - Check of the Motion Kernels against OpenCV
+ *
+ * motion_changes() has a scalar, an SSE2 and an AVX2 kernel, and picks the
+ * fastest one the CPU can run, so a machine only ever uses one of them.
+ * This runs every kernel the CPU can run on synthetic frames and compares
+ * the counts with motion_changes_reference(), the chain of OpenCV calls the
+ * kernels replaced.
+ *
+ * The frames are made to catch what the vector loops and their scalar
+ * tails could get wrong: widths just below, at and above multiples of 16
+ * and 32, single rows and columns, differences right around the threshold,
+ * motion on the edges (where erosion ignores the border), masks with
+ * values other than 0 and 255, and frames that are cut out of larger ones
+ * at their edges, like the ROI of a camera is cut out of every frame.
+ *
+ * detect_motion() also throws away frames whose changes are spread too
+ * evenly, by the standard deviation motion_stddev() works out from the
+ * count alone. That used to be meanStdDev() of the eroded frame, so it is
+ * checked against that as well, for the count of every kernel, together
+ * with the decision it makes for a range of "motionmaxdeviation" values.
+ * Like in detect_motion(), the whole frame the ROI was cut out of counts,
+ * and everything outside the ROI as unchanged.
+ *
+ * Frames are made from a seed only, so a failure can be reproduced with
+ * "-s". Any difference makes the check fail.
+ *
+ */
+
+#include "check_motion.hpp"
+
+static const int m_Widths[] = { 1, 2, 3, 7, 15, 16, 17, 31, 32, 33, 47, 63, 64, 65, 97, 641, 1921 };
+static const int m_Heights[] = { 1, 2, 3, 5, 17 };
+
+static const char* const m_Patterns[] = { "noise", "threshold", "blocks", "full" };
+static const char* const m_Masks[] = { "no mask", "speckled mask", "window mask" };
+static const char* const m_Placements[] = { "top left", "inside", "bottom right" };
+
+// Values of "motionmaxdeviation" to compare the decisions for
+static const int m_Deviations[] = { 0, 1, 5, 10, 20, 50, 100, 127 };
+
+int main(int argc, char* const argv[])
+{
+	vector<string> kernels;
+	uint64_t seed = 1;
+	char opt;
+
+	while ((opt = getopt(argc, argv, "k:s:")) != EOF)
+		switch(opt)
+		{
+			case 'k':
+				kernels.push_back(optarg);
+				break;
+			case 's':
+				seed = strtoull(optarg, NULL, 10);
+				break;
+			case '?':
+			default:
+				exit_usage(argv[0]);
+				break;
+		}
+
+	if (kernels.empty())
+	{
+		for (int i = 0; motion_kernel_available(i) != NULL; i++)
+			kernels.push_back(motion_kernel_available(i));
+	}
+
+	for (vector<string>::iterator kernel = kernels.begin(); kernel != kernels.end(); ++kernel)
+	{
+		if (!motion_use_kernel(kernel->c_str()))
+		{
+			printf("Error: This CPU cannot run the %s kernel.\n", kernel->c_str());
+			return 1;
+		}
+	}
+
+	RNG rng(seed);
+	checkframes frames;
+	vector<uchar> scratch;
+	unsigned long cases = 0;
+	unsigned long failures = 0;
+
+	for (size_t w = 0; w < sizeof(m_Widths) / sizeof(m_Widths[0]); w++)
+	for (size_t h = 0; h < sizeof(m_Heights) / sizeof(m_Heights[0]); h++)
+	for (int pattern = 0; pattern < CHECK_PATTERNS; pattern++)
+	for (int mask = 0; mask < CHECK_MASKS; mask++)
+	for (int placement = 0; placement < CHECK_PLACEMENTS; placement++)
+	{
+		checkcase test;
+
+		test.width = m_Widths[w];
+		test.height = m_Heights[h];
+		test.pattern = pattern;
+		test.mask = mask;
+		test.placement = placement;
+
+		make_frames(test, rng, frames);
+
+		int expected;
+		const double expected_stddev = reference_stddev(test, frames, expected);
+		const int pixels = frames.storage[0].rows * frames.storage[0].cols;
+
+		for (vector<string>::iterator kernel = kernels.begin(); kernel != kernels.end(); ++kernel)
+		{
+			motion_use_kernel(kernel->c_str());
+
+			const int changes = motion_changes(frames.frames[0], frames.frames[1],
+				frames.frames[2], frames.mask, scratch);
+
+			cases++;
+
+			const double stddev = motion_stddev(changes, pixels);
+
+			if (changes != expected)
+			{
+				printf("FAIL: The %s kernel counts %d change(s), OpenCV %d (%s).\n",
+					kernel->c_str(), changes, expected, describe_case(test).c_str());
+				failures++;
+			}
+			else if (!deviations_agree(stddev, expected_stddev))
+			{
+				printf("FAIL: With the %s kernel, the standard deviation is %.9f, OpenCV %.9f (%s).\n",
+					kernel->c_str(), stddev, expected_stddev, describe_case(test).c_str());
+				failures++;
+			}
+		}
+	}
+
+	printf("Checked %lu case(s) on the", cases);
+
+	for (vector<string>::iterator kernel = kernels.begin(); kernel != kernels.end(); ++kernel)
+		printf("%s %s", kernel != kernels.begin() ? "," : "", kernel->c_str());
+
+	printf(" kernel(s); %lu did not match OpenCV.\n", failures);
+
+	return failures == 0 ? 0 : 1;
+}
+
+void exit_usage(const char* argv0)
+{
+	printf("\n");
+	printf("Check of the Motion Kernels against OpenCV\n");
+	printf("\n");
+	printf("Usage: %s [-k kernel]... [-s seed]\n", argv0);
+	printf("\n");
+	printf("-k kernel        Check only this kernel (scalar, SSE2 or AVX2). Default is\n");
+	printf("                 every kernel this CPU can run.\n");
+	printf("-s seed          Make different frames (default 1).\n");
+	printf("\n");
+	exit(-EINVAL);
+}
+
+void make_frames(const checkcase& test, RNG& rng, checkframes& frames)
+{
+	// The frames and the mask are cut out of larger images with random
+	// content, so a kernel that reads past the end of a row would see
+	// something else than the reference.
+
+	const Rect rect = placement_rect(test);
+
+	for (int i = 0; i < 4; i++)
+	{
+		frames.storage[i].create(test.height + 2 * CHECK_MARGIN, test.width + 2 * CHECK_MARGIN, CV_8UC1);
+		fill_random(rng, frames.storage[i]);
+	}
+
+	for (int i = 0; i < 3; i++)
+		frames.frames[i] = frames.storage[i](rect);
+
+	fill_pattern(test, rng, frames.frames[0], frames.frames[1], frames.frames[2]);
+
+	if (test.mask == CHECK_UNMASKED)
+	{
+		frames.mask.release();
+		return;
+	}
+
+	frames.mask = frames.storage[3](rect);
+	fill_mask(test, rng, frames.mask);
+}
+
+void fill_pattern(const checkcase& test, RNG& rng, Mat& prev, Mat& current, Mat& next)
+{
+	switch (test.pattern)
+	{
+		case CHECK_NOISE:
+			fill_random(rng, prev);
+			fill_random(rng, current);
+			fill_random(rng, next);
+			break;
+
+		case CHECK_THRESHOLD:
+			// |prev - next| and |next - current| are both within a few of
+			// the threshold, and the bitwise AND of them decides.
+			for (int y = 0; y < prev.rows; y++)
+			{
+				uchar* p = prev.ptr(y);
+				uchar* c = current.ptr(y);
+				uchar* n = next.ptr(y);
+
+				for (int x = 0; x < prev.cols; x++)
+				{
+					const int base = rng.uniform(0, 256);
+					const int d1 = MOTION_THRESHOLD + rng.uniform(-3, 4);
+					const int d2 = MOTION_THRESHOLD + rng.uniform(-3, 4);
+
+					p[x] = (uchar)base;
+					n[x] = (uchar)(base + d1 <= 255 ? base + d1 : base - d1);
+					c[x] = (uchar)(n[x] + d2 <= 255 ? n[x] + d2 : n[x] - d2);
+				}
+			}
+			break;
+
+		case CHECK_BLOCKS:
+		{
+			// A still picture with boxes that light up in the next frame;
+			// every other box is on an edge.
+			fill_random(rng, prev);
+			prev.copyTo(current);
+			prev.copyTo(next);
+
+			for (int i = 0; i < 6; i++)
+			{
+				const int width = rng.uniform(1, test.width + 1);
+				const int height = rng.uniform(1, test.height + 1);
+
+				int x = rng.uniform(0, test.width - width + 1);
+				int y = rng.uniform(0, test.height - height + 1);
+
+				if (i % 2 == 1)
+				{
+					x = rng.uniform(0, 2) == 0 ? 0 : test.width - width;
+					y = rng.uniform(0, 2) == 0 ? 0 : test.height - height;
+				}
+
+				const Rect box(x, y, width, height);
+
+				// Dark enough before and after to differ by more than the
+				// threshold
+				next(box).setTo(Scalar(255));
+				prev(box).setTo(Scalar(rng.uniform(0, 128)));
+				current(box).setTo(Scalar(rng.uniform(0, 128)));
+			}
+			break;
+		}
+
+		case CHECK_FULL:
+			prev.setTo(Scalar(0));
+			current.setTo(Scalar(0));
+			next.setTo(Scalar(255));
+			break;
+	}
+}
+
+void fill_mask(const checkcase& test, RNG& rng, Mat& mask)
+{
+	switch (test.mask)
+	{
+		case CHECK_SPECKLED:
+			// motion_changes() only looks at zero or not, and so does
+			// copyTo() in the reference.
+			for (int y = 0; y < mask.rows; y++)
+			{
+				uchar* m = mask.ptr(y);
+
+				for (int x = 0; x < mask.cols; x++)
+				{
+					const int value = rng.uniform(0, 256);
+					m[x] = (uchar)(value < 128 ? 0 : value);
+				}
+			}
+			break;
+
+		case CHECK_WINDOW:
+			mask.setTo(Scalar(0));
+			mask(Rect(test.width / 3, test.height / 3, max(1, test.width / 2),
+				max(1, test.height / 2))).setTo(Scalar(255));
+			break;
+	}
+}
+
+double reference_stddev(const checkcase& test, const checkframes& frames, int& changes)
+{
+	// What the OpenCV chain counts, and the standard deviation of the
+	// whole frame with its result in the ROI
+
+	Mat motion;
+	motion_reference_frame(frames.frames[0], frames.frames[1], frames.frames[2], frames.mask, motion);
+
+	changes = countNonZero(motion == 255);
+
+	Mat whole = Mat::zeros(frames.storage[0].size(), CV_8UC1);
+	Mat roi = whole(placement_rect(test));
+	motion.copyTo(roi);
+
+	Scalar mean, stddev;
+	meanStdDev(whole, mean, stddev);
+
+	return stddev[0];
+}
+
+bool deviations_agree(double stddev, double expected)
+{
+	// Apart from rounding, and that must not change whether a frame is
+	// thrown away.
+
+	if (fabs(stddev - expected) > CHECK_TOLERANCE)
+		return false;
+
+	for (size_t i = 0; i < sizeof(m_Deviations) / sizeof(m_Deviations[0]); i++)
+	{
+		if ((stddev > m_Deviations[i]) != (expected > m_Deviations[i]))
+			return false;
+	}
+
+	return true;
+}
+
+void fill_random(RNG& rng, Mat& image)
+{
+	for (int y = 0; y < image.rows; y++)
+	{
+		uchar* row = image.ptr(y);
+
+		for (int x = 0; x < image.cols; x++)
+			row[x] = (uchar)rng.uniform(0, 256);
+	}
+}
+
+Rect placement_rect(const checkcase& test)
+{
+	switch (test.placement)
+	{
+		case CHECK_TOP_LEFT:
+			return Rect(0, 0, test.width, test.height);
+		case CHECK_BOTTOM_RIGHT:
+			return Rect(2 * CHECK_MARGIN, 2 * CHECK_MARGIN, test.width, test.height);
+	}
+
+	// Odd, so that rows do not start aligned
+	return Rect(CHECK_MARGIN - 2, CHECK_MARGIN, test.width, test.height);
+}
+
+string describe_case(const checkcase& test)
+{
+	char description[128];
+
+	snprintf(description, sizeof(description), "%dx%d, %s, %s, %s", test.width, test.height,
+		m_Patterns[test.pattern], m_Masks[test.mask], m_Placements[test.placement]);
+
+	return description;
+}
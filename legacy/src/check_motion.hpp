@@ -0,0 +1,76 @@
+/*
+ * check_motion - Check of the Motion Kernels against OpenCV
+ *
+ */
+
+#ifndef CHECK_MOTION_HPP
+#define CHECK_MOTION_HPP
+
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "motionkernel.hpp"
+
+// Pixels around every frame, which it is cut out of, so that rows are not
+// contiguous and do not start aligned
+#define CHECK_MARGIN 5
+
+// How far motion_stddev() may be from meanStdDev() for rounding
+#define CHECK_TOLERANCE 1e-9
+
+// What the three frames look like
+#define CHECK_NOISE 0     // Random everywhere
+#define CHECK_THRESHOLD 1 // Differences right around MOTION_THRESHOLD
+#define CHECK_BLOCKS 2    // Boxes of motion, some of them on the edges
+#define CHECK_FULL 3      // Motion everywhere, so only the border erodes
+#define CHECK_PATTERNS 4
+
+// What the mask looks like
+#define CHECK_UNMASKED 0
+#define CHECK_SPECKLED 1 // Random, with values other than 255 as well
+#define CHECK_WINDOW 2   // Like the mask of a camera cut to its ROI
+#define CHECK_MASKS 3
+
+// Where the frame is cut out of the larger one
+#define CHECK_TOP_LEFT 0
+#define CHECK_INSIDE 1
+#define CHECK_BOTTOM_RIGHT 2
+#define CHECK_PLACEMENTS 3
+
+using namespace std;
+using namespace cv;
+
+typedef struct checkcase
+{
+	int width;
+	int height;
+	int pattern;
+	int mask;
+	int placement;
+} checkcase;
+
+typedef struct checkframes
+{
+	Mat storage[4];
+	Mat frames[3];
+	Mat mask;
+} checkframes;
+
+int main(int argc, char* const argv[]);
+void exit_usage(const char* argv0);
+void make_frames(const checkcase& test, RNG& rng, checkframes& frames);
+void fill_pattern(const checkcase& test, RNG& rng, Mat& prev, Mat& current, Mat& next);
+void fill_mask(const checkcase& test, RNG& rng, Mat& mask);
+double reference_stddev(const checkcase& test, const checkframes& frames, int& changes);
+bool deviations_agree(double stddev, double expected);
+void fill_random(RNG& rng, Mat& image);
+Rect placement_rect(const checkcase& test);
+string describe_case(const checkcase& test);
+#endif
@@ -0,0 +1,39 @@
+/*
+ * fileio - Helpers for Writing the Files of Maintenance
+ *
+ * The catalog, its index, the heatmap and the timelines are all written
+ * with plain file descriptors, because they are replaced by renaming or
+ * overwritten in place, which streams do not help with.
+ *
+ */
+
+#include "fileio.hpp"
+
+#include <errno.h>
+#include <unistd.h>
+
+bool fileio_write_all(int fd, const void* data, size_t size)
+{
+	// write() may write less than it was given, e.g. when interrupted by
+	// a signal; returns false on any other error.
+
+	const char* p = (const char*)data;
+
+	while (size > 0)
+	{
+		ssize_t written = write(fd, p, size);
+
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		p += written;
+		size -= written;
+	}
+
+	return true;
+}
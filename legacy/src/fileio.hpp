@@ -0,0 +1,12 @@
+/*
+ * fileio - Helpers for Writing the Files of Maintenance
+ *
+ */
+
+#ifndef FILEIO_HPP
+#define FILEIO_HPP
+
+#include <stddef.h>
+
+bool fileio_write_all(int fd, const void* data, size_t size);
+#endif
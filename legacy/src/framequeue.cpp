@@ -0,0 +1,147 @@
+/*
+ * framequeue - Bounded Single-Producer/Single-Consumer Frame Queue
+ *
+ * Hands analysis frames from the decoding thread to the analysing thread.
+ * Both sides only ever touch their own counter ("written" for the decoder,
+ * "read" for the analysis), so there are no locks. Slots are never handed
+ * out twice at the same time: the decoder only writes into slots that the
+ * analysis has released, and the analysis only looks at slots the decoder
+ * has committed.
+ *
+ * The analysis keeps the previous, current, and next frame in the queue
+ * while it works on them and only releases the oldest one afterwards, so
+ * frames are never copied out of the queue.
+ *
+ * Waiting is done by yielding and then sleeping briefly. Every time one side
+ * has to wait for the other, that counts as one stall, which tells whether
+ * decoding (empty stalls) or analysis (full stalls) is the slower stage.
+ *
+ */
+
+#include "framequeue.hpp"
+
+#include <assert.h>
+
+#include <chrono>
+#include <thread>
+
+static void framequeue_backoff(int& spins)
+{
+	if (++spins < 64)
+		std::this_thread::yield();
+	else
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+}
+
+bool framequeue_reset(framequeue& queue, size_t capacity)
+{
+	// Prepares the queue for the next file. Returns true if the slots had
+	// to be recreated, i.e. they no longer have any memory of their own.
+
+	bool recreated = false;
+
+	if (queue.slots.size() != capacity)
+	{
+		queue.slots.clear();
+		queue.slots.resize(capacity);
+		queue.positions.assign(capacity, 0);
+		recreated = true;
+	}
+
+	queue.written = 0;
+	queue.read = 0;
+	queue.finished = false;
+	queue.closed = false;
+	queue.full_stalls = 0;
+	queue.empty_stalls = 0;
+
+	return recreated;
+}
+
+Mat* framequeue_reserve(framequeue& queue)
+{
+	// Decoder side: waits for a free slot to decode into. Returns NULL if
+	// the analysis has gone away in the meantime.
+
+	const unsigned long written = queue.written.load(std::memory_order_relaxed);
+	const size_t capacity = queue.slots.size();
+
+	int spins = 0;
+
+	while (written - queue.read.load(std::memory_order_acquire) >= capacity)
+	{
+		if (queue.closed.load(std::memory_order_acquire))
+			return NULL;
+
+		if (spins == 0)
+			queue.full_stalls++;
+
+		framequeue_backoff(spins);
+	}
+
+	return &queue.slots[written % capacity];
+}
+
+void framequeue_commit(framequeue& queue, double pos_msec)
+{
+	// Decoder side: hands the reserved slot over to the analysis.
+
+	const unsigned long written = queue.written.load(std::memory_order_relaxed);
+
+	queue.positions[written % queue.slots.size()] = pos_msec;
+	queue.written.store(written + 1, std::memory_order_release);
+}
+
+void framequeue_finish(framequeue& queue)
+{
+	// Decoder side: there will be no more frames.
+
+	queue.finished.store(true, std::memory_order_release);
+}
+
+bool framequeue_wait(framequeue& queue, unsigned long index)
+{
+	// Analysis side: waits until frame "index" (counted from the start of
+	// the file) has been decoded. Returns false if it never will be.
+
+	assert(index < queue.read.load(std::memory_order_relaxed) + queue.slots.size());
+
+	int spins = 0;
+
+	while (queue.written.load(std::memory_order_acquire) <= index)
+	{
+		if (queue.finished.load(std::memory_order_acquire))
+			return queue.written.load(std::memory_order_acquire) > index;
+
+		if (spins == 0)
+			queue.empty_stalls++;
+
+		framequeue_backoff(spins);
+	}
+
+	return true;
+}
+
+Mat& framequeue_at(framequeue& queue, unsigned long index)
+{
+	return queue.slots[index % queue.slots.size()];
+}
+
+double framequeue_position(const framequeue& queue, unsigned long index)
+{
+	return queue.positions[index % queue.positions.size()];
+}
+
+void framequeue_release(framequeue& queue)
+{
+	// Analysis side: the oldest frame is no longer needed.
+
+	queue.read.store(queue.read.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void framequeue_close(framequeue& queue)
+{
+	// Analysis side: stop the decoder even if it has more frames.
+
+	queue.closed.store(true, std::memory_order_release);
+}
@@ -0,0 +1,38 @@
+/*
+ * framequeue - Bounded Single-Producer/Single-Consumer Frame Queue
+ *
+ */
+
+#ifndef FRAMEQUEUE_HPP
+#define FRAMEQUEUE_HPP
+
+#include <atomic>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+using namespace cv;
+
+typedef struct framequeue
+{
+	vector<Mat> slots;
+	vector<double> positions;
+	std::atomic<unsigned long> written;
+	std::atomic<unsigned long> read;
+	std::atomic<bool> finished;
+	std::atomic<bool> closed;
+	unsigned long full_stalls;
+	unsigned long empty_stalls;
+} framequeue;
+
+bool framequeue_reset(framequeue& queue, size_t capacity);
+Mat* framequeue_reserve(framequeue& queue);
+void framequeue_commit(framequeue& queue, double pos_msec);
+void framequeue_finish(framequeue& queue);
+bool framequeue_wait(framequeue& queue, unsigned long index);
+Mat& framequeue_at(framequeue& queue, unsigned long index);
+double framequeue_position(const framequeue& queue, unsigned long index);
+void framequeue_release(framequeue& queue);
+void framequeue_close(framequeue& queue);
+#endif
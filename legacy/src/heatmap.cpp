@@ -0,0 +1,190 @@
+/*
+ * heatmap - Seconds of Motion per Hour of a Camera
+ *
+ * The heatmap of the web interface shows how much motion there was in every
+ * hour of every day. Working that out from the names of all recordings on
+ * every page load gets slow with many cameras and long archives, so
+ * maintenance keeps it up to date instead: whenever motion detection is
+ * done with a recording, the seconds with motion in its timeline are added
+ * to the hours they fell into, and whenever a recording is deleted, they are
+ * taken away again.
+ *
+ * The file is a fixed header and then HEATMAP_HOURS counters per day, from
+ * the first day with any motion on. Days are local calendar days, counted
+ * from 1970-01-01. A year of it is about 34 KiB. It is written under a
+ * temporary name and then renamed, so readers always see a whole one.
+ *
+ */
+
+#include "heatmap.hpp"
+#include "fileio.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// The layout of the file must not depend on the compiler.
+static_assert(sizeof(heatmapheader) == 32, "heatmapheader must be 32 bytes");
+
+int64_t heatmap_day(time_t t, int* hour)
+{
+	// The local calendar day of a point in time, as days since 1970-01-01
+
+	struct tm local;
+
+	if (localtime_r(&t, &local) == NULL)
+	{
+		// Out of range; UTC is as good a guess as any.
+		if (hour != NULL)
+			*hour = 0;
+
+		return t / 86400;
+	}
+
+	if (hour != NULL)
+		*hour = local.tm_hour;
+
+	struct tm date;
+	memset(&date, 0, sizeof(date));
+
+	date.tm_year = local.tm_year;
+	date.tm_mon = local.tm_mon;
+	date.tm_mday = local.tm_mday;
+
+	return timegm(&date) / 86400;
+}
+
+bool heatmap_load(heatmap& cube, const string& filename)
+{
+	// An empty heatmap is returned if there is none, or if it cannot be
+	// used.
+
+	cube.filename = filename;
+	cube.first_day = 0;
+	cube.cells.clear();
+	cube.loaded = true;
+
+	FILE* file = fopen(filename.c_str(), "rb");
+
+	if (file == NULL)
+		return false;
+
+	heatmapheader header;
+
+	bool success = fread(&header, sizeof(header), 1, file) == 1 &&
+		memcmp(header.magic, HEATMAP_MAGIC, sizeof(header.magic)) == 0 &&
+		header.version == HEATMAP_VERSION &&
+		header.hours == HEATMAP_HOURS;
+
+	if (success)
+	{
+		cube.cells.resize((size_t)header.days * HEATMAP_HOURS);
+
+		success = cube.cells.empty() ||
+			fread(&cube.cells[0], sizeof(uint32_t), cube.cells.size(), file) == cube.cells.size();
+	}
+
+	fclose(file);
+
+	if (!success)
+	{
+		cube.cells.clear();
+		return false;
+	}
+
+	cube.first_day = header.first_day;
+
+	return true;
+}
+
+bool heatmap_save(const heatmap& cube)
+{
+	heatmapheader header;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, HEATMAP_MAGIC, sizeof(header.magic));
+
+	header.version = HEATMAP_VERSION;
+	header.hours = HEATMAP_HOURS;
+	header.first_day = cube.first_day;
+	header.days = cube.cells.size() / HEATMAP_HOURS;
+
+	const string temporary = cube.filename + ".tmp";
+
+	int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+	if (fd < 0)
+		return false;
+
+	bool success = fileio_write_all(fd, &header, sizeof(header)) &&
+		(cube.cells.empty() || fileio_write_all(fd, &cube.cells[0], cube.cells.size() * sizeof(uint32_t)));
+
+	success = close(fd) == 0 && success;
+
+	if (success)
+		success = rename(temporary.c_str(), cube.filename.c_str()) == 0;
+
+	if (!success)
+		unlink(temporary.c_str());
+
+	return success;
+}
+
+void heatmap_apply(heatmap& cube, time_t start, const vector<timelineentry>& timeline, bool add)
+{
+	// Adds (or takes away) the seconds with motion of a recording that
+	// started at "start".
+
+	for (size_t second = 0; second < timeline.size(); second++)
+	{
+		if (!(timeline[second].flags & TIMELINE_MOTION))
+			continue;
+
+		int hour;
+		int64_t day = heatmap_day(start + second, &hour);
+
+		if (cube.cells.empty())
+			cube.first_day = day;
+
+		if (day < cube.first_day)
+		{
+			if (!add)
+				continue;
+
+			cube.cells.insert(cube.cells.begin(), (size_t)(cube.first_day - day) * HEATMAP_HOURS, 0);
+			cube.first_day = day;
+		}
+
+		const size_t cell = (size_t)(day - cube.first_day) * HEATMAP_HOURS + hour;
+
+		if (cell >= cube.cells.size())
+		{
+			if (!add)
+				continue;
+
+			cube.cells.resize((cell / HEATMAP_HOURS + 1) * HEATMAP_HOURS, 0);
+		}
+
+		if (add)
+			cube.cells[cell]++;
+		else if (cube.cells[cell] > 0)
+			cube.cells[cell]--;
+	}
+
+	if (add)
+		return;
+
+	// Days that are all gone do not need to be kept.
+	size_t empty = 0;
+
+	while (empty < cube.cells.size() && cube.cells[empty] == 0)
+		empty++;
+
+	const size_t days = empty / HEATMAP_HOURS;
+
+	cube.cells.erase(cube.cells.begin(), cube.cells.begin() + days * HEATMAP_HOURS);
+	cube.first_day += days;
+}
@@ -0,0 +1,46 @@
+/*
+ * heatmap - Seconds of Motion per Hour of a Camera
+ *
+ */
+
+#ifndef HEATMAP_HPP
+#define HEATMAP_HPP
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <time.h>
+
+#include "timeline.hpp"
+
+using namespace std;
+
+#define HEATMAP_FILENAME "heatmap"
+#define HEATMAP_MAGIC "CAMSRVHM"
+#define HEATMAP_VERSION 1
+#define HEATMAP_HOURS 24
+
+typedef struct heatmapheader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t hours;
+	int64_t first_day;
+	uint32_t days;
+	uint32_t reserved;
+} heatmapheader;
+
+typedef struct heatmap
+{
+	string filename;
+	int64_t first_day;
+	vector<uint32_t> cells;
+	bool loaded;
+} heatmap;
+
+bool heatmap_load(heatmap& cube, const string& filename);
+bool heatmap_save(const heatmap& cube);
+void heatmap_apply(heatmap& cube, time_t start, const vector<timelineentry>& timeline, bool add);
+int64_t heatmap_day(time_t t, int* hour);
+#endif
@@ -15,7 +15,7 @@ int check_if_running_and_lock(const string& lockfile)
 	if (lockfile.empty())
 		return -2;
 
-	int fd = open(lockfile.c_str(), O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	int fd = open(lockfile.c_str(), O_RDWR|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
 
 	if (fd < 0)
 		return -1;
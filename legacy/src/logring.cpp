@@ -0,0 +1,325 @@
+/*
+ * logring - Log Messages Queued in Memory for the System Log
+ *
+ * camsrvd used to write its messages to a pipe read by a logger process,
+ * one unbuffered write per line. Now they go into a ring of fixed slots in
+ * memory first, and from there to the system log in batches, one datagram
+ * per message and up to LOGRING_BATCH of them per sendmmsg(). The journal
+ * gets them in its native format, with the camera and the PID of its
+ * command as fields of their own (CAMERA and CAMERA_PID); without a
+ * journal, they go to /dev/log as plain syslog messages.
+ *
+ * Logging must never hold up the supervisor. Sending does not wait, and
+ * whatever the log does not take stays in the ring for the next try. If the
+ * ring is full, new messages are dropped and counted, and the next message
+ * that gets through says how many were lost.
+ *
+ * Any thread may add messages; each slot has a sequence number that says
+ * whether it is free or holds a message, so adding takes no lock. Only one
+ * thread may send them.
+ *
+ */
+
+#include "logring.hpp"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+static_assert((LOGRING_SLOTS & (LOGRING_SLOTS - 1)) == 0, "LOGRING_SLOTS must be a power of two");
+
+static int logring_connect(const char* path)
+{
+	int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+	if (fd == -1)
+		return -1;
+
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+	if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static bool logring_reconnect(logring& ring)
+{
+	if (ring.fd != -1)
+		close(ring.fd);
+
+	ring.journal = true;
+	ring.fd = logring_connect(LOGRING_JOURNAL_SOCKET);
+
+	if (ring.fd != -1)
+		return true;
+
+	ring.journal = false;
+	ring.fd = logring_connect(LOGRING_SYSLOG_SOCKET);
+
+	return ring.fd != -1;
+}
+
+static size_t logring_format(const logring& ring, int priority, const char* camera, pid_t pid,
+	time_t logged, const char* message, char* datagram)
+{
+	// One message as a datagram for the journal or for syslog
+
+	const size_t length = strlen(message);
+	int used;
+
+	if (!ring.journal)
+	{
+		char timestamp[32];
+		struct tm local;
+
+		localtime_r(&logged, &local);
+		strftime(timestamp, sizeof(timestamp), "%b %e %H:%M:%S", &local);
+
+		used = snprintf(datagram, LOGRING_DATAGRAM, "<%d>%s %s[%d]: %s",
+			ring.facility | priority, timestamp, ring.tag.c_str(), (int)getpid(), message);
+
+		return min((size_t)used, (size_t)LOGRING_DATAGRAM - 1);
+	}
+
+	used = snprintf(datagram, LOGRING_DATAGRAM, "PRIORITY=%d\nSYSLOG_FACILITY=%d\nSYSLOG_IDENTIFIER=%s\n",
+		priority, ring.facility >> 3, ring.tag.c_str());
+
+	if (camera[0] != '\0')
+		used += snprintf(datagram + used, LOGRING_DATAGRAM - used, "CAMERA=%s\n", camera);
+
+	if (pid > 0)
+		used += snprintf(datagram + used, LOGRING_DATAGRAM - used, "CAMERA_PID=%d\n", (int)pid);
+
+	// The message itself may contain anything, so it goes in as a field
+	// name, a newline, its length (64 bit little endian) and then itself.
+	memcpy(datagram + used, "MESSAGE\n", 8);
+	used += 8;
+
+	for (int i = 0; i < 8; i++)
+		datagram[used++] = (char)((uint64_t)length >> (8 * i));
+
+	memcpy(datagram + used, message, length);
+	used += length;
+	datagram[used++] = '\n';
+
+	return used;
+}
+
+bool logring_open(logring& ring, const string& tag, int facility)
+{
+	ring.tag = tag;
+	ring.facility = facility;
+	ring.fd = -1;
+	ring.head = 0;
+	ring.tail = 0;
+	ring.dropped = 0;
+	ring.reported = 0;
+	ring.sent = 0;
+	ring.failed = 0;
+
+	for (size_t i = 0; i < LOGRING_SLOTS; i++)
+		ring.slots[i].sequence.store(i, memory_order_relaxed);
+
+	ring.open = true;
+
+	return logring_reconnect(ring);
+}
+
+void logring_close(logring& ring)
+{
+	// Whatever is left is sent, waiting for the log if need be.
+
+	if (!ring.open)
+		return;
+
+	logring_flush(ring, true);
+
+	if (ring.fd != -1)
+		close(ring.fd);
+
+	ring.fd = -1;
+	ring.open = false;
+}
+
+bool logring_push(logring& ring, int priority, const char* camera, pid_t pid,
+	const char* format, va_list arguments)
+{
+	size_t position = ring.head.load(memory_order_relaxed);
+	logentry* entry;
+
+	for (;;)
+	{
+		entry = &ring.slots[position & (LOGRING_SLOTS - 1)];
+
+		const size_t sequence = entry->sequence.load(memory_order_acquire);
+		const ptrdiff_t difference = (ptrdiff_t)sequence - (ptrdiff_t)position;
+
+		if (difference == 0)
+		{
+			if (ring.head.compare_exchange_weak(position, position + 1, memory_order_relaxed))
+				break; // for
+		}
+		else if (difference < 0)
+		{
+			// Full; the message from a whole lap ago has not been sent yet.
+			ring.dropped.fetch_add(1, memory_order_relaxed);
+			return false;
+		}
+		else
+		{
+			position = ring.head.load(memory_order_relaxed);
+		}
+	}
+
+	entry->priority = priority;
+	entry->pid = pid;
+	entry->logged = time(NULL);
+
+	snprintf(entry->camera, sizeof(entry->camera), "%s", camera != NULL ? camera : "");
+	vsnprintf(entry->message, sizeof(entry->message), format, arguments);
+
+	entry->sequence.store(position + 1, memory_order_release);
+
+	return true;
+}
+
+bool logring_pending(const logring& ring)
+{
+	const logentry& entry = ring.slots[ring.tail & (LOGRING_SLOTS - 1)];
+
+	return entry.sequence.load(memory_order_acquire) == ring.tail + 1;
+}
+
+bool logring_flush(logring& ring, bool wait)
+{
+	// Sends as much as the log takes right now (or all of it, if "wait").
+	// True if nothing is left.
+
+	struct mmsghdr messages[LOGRING_BATCH];
+	struct iovec parts[LOGRING_BATCH];
+
+	bool retried = false;
+
+	while (ring.open)
+	{
+		size_t count = 0;
+
+		const unsigned long dropped = ring.dropped.load(memory_order_relaxed);
+
+		if (dropped != ring.reported)
+		{
+			char notice[128];
+
+			snprintf(notice, sizeof(notice), "%lu log message(s) were dropped because the log could not keep up.",
+				dropped - ring.reported);
+
+			parts[count].iov_len = logring_format(ring, LOG_WARNING, "", 0, time(NULL), notice,
+				ring.datagrams[count]);
+			count++;
+		}
+
+		const size_t notices = count;
+
+		for (size_t position = ring.tail; count < LOGRING_BATCH; position++)
+		{
+			const logentry& entry = ring.slots[position & (LOGRING_SLOTS - 1)];
+
+			if (entry.sequence.load(memory_order_acquire) != position + 1)
+				break; // for
+
+			parts[count].iov_len = logring_format(ring, entry.priority, entry.camera, entry.pid,
+				entry.logged, entry.message, ring.datagrams[count]);
+			count++;
+		}
+
+		if (count == 0)
+			return true;
+
+		for (size_t i = 0; i < count; i++)
+		{
+			parts[i].iov_base = ring.datagrams[i];
+
+			memset(&messages[i], 0, sizeof(messages[i]));
+			messages[i].msg_hdr.msg_iov = &parts[i];
+			messages[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int sent = ring.fd != -1 ? sendmmsg(ring.fd, messages, count, wait ? 0 : MSG_DONTWAIT) : -1;
+
+		if (sent == -1 && errno == EINTR)
+			continue; // while
+
+		if (sent == -1 && errno == EAGAIN)
+			return false;
+
+		if (sent == -1 && !retried)
+		{
+			// The log may have been restarted.
+			retried = true;
+			logring_reconnect(ring);
+			continue; // while
+		}
+
+		if (sent == -1)
+		{
+			// Nowhere to send them, so they are lost.
+			ring.failed += count - notices;
+			sent = count;
+		}
+		else
+		{
+			ring.sent += sent;
+		}
+
+		int released = sent;
+
+		if (notices > 0 && sent > 0)
+		{
+			ring.reported = dropped;
+			released--;
+		}
+
+		for (int i = 0; i < released; i++)
+		{
+			ring.slots[ring.tail & (LOGRING_SLOTS - 1)].sequence.store(ring.tail + LOGRING_SLOTS,
+				memory_order_release);
+			ring.tail++;
+		}
+
+		if ((size_t)sent < count && !wait)
+			return false;
+	}
+
+	return true;
+}
+
+void logring_discard(logring& ring)
+{
+	// Forgets about the messages that are waiting, e.g. in a child process
+	// that has a copy of them which its parent will send.
+
+	while (logring_pending(ring))
+	{
+		ring.slots[ring.tail & (LOGRING_SLOTS - 1)].sequence.store(ring.tail + LOGRING_SLOTS,
+			memory_order_release);
+		ring.tail++;
+	}
+
+	ring.reported = ring.dropped.load(memory_order_relaxed);
+}
@@ -0,0 +1,65 @@
+/*
+ * logring - Log Messages Queued in Memory for the System Log
+ *
+ */
+
+#ifndef LOGRING_HPP
+#define LOGRING_HPP
+
+#include <atomic>
+#include <string>
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+using namespace std;
+
+#define LOGRING_JOURNAL_SOCKET "/run/systemd/journal/socket"
+#define LOGRING_SYSLOG_SOCKET "/dev/log"
+
+// Must be a power of two
+#define LOGRING_SLOTS 1024
+#define LOGRING_MESSAGE 1024
+#define LOGRING_FIELD 64
+
+// Messages sent per sendmmsg()
+#define LOGRING_BATCH 32
+#define LOGRING_DATAGRAM (LOGRING_MESSAGE + 4 * LOGRING_FIELD + 64)
+
+typedef struct logentry
+{
+	atomic<size_t> sequence;
+	int priority;
+	pid_t pid;
+	time_t logged;
+	char camera[LOGRING_FIELD];
+	char message[LOGRING_MESSAGE];
+} logentry;
+
+typedef struct logring
+{
+	string tag;
+	int facility;
+	int fd;
+	bool open;
+	bool journal;
+	atomic<size_t> head;
+	size_t tail;
+	atomic<unsigned long> dropped;
+	unsigned long reported;
+	unsigned long sent;
+	unsigned long failed;
+	logentry slots[LOGRING_SLOTS];
+	char datagrams[LOGRING_BATCH][LOGRING_DATAGRAM];
+} logring;
+
+bool logring_open(logring& ring, const string& tag, int facility);
+void logring_close(logring& ring);
+bool logring_push(logring& ring, int priority, const char* camera, pid_t pid,
+	const char* format, va_list arguments);
+bool logring_flush(logring& ring, bool wait);
+bool logring_pending(const logring& ring);
+void logring_discard(logring& ring);
+#endif
@@ -0,0 +1,299 @@
+/*
+ * lumadecoder - Luma-Only Video Decoding for Motion Detection
+ *
+ * VideoCapture always hands out BGR frames, which means the decoder's YUV
+ * output gets converted to BGR, and then motion detection converted it back
+ * to grayscale. The detector only ever needs the brightness of each pixel,
+ * and that is exactly the Y plane the decoder has produced in the first
+ * place, so here the Y plane is wrapped in a Mat without converting or even
+ * copying anything.
+ *
+ * Decoded frames are reference counted by libavcodec, so the last few
+ * retrieved frames are kept referenced here to keep their Y planes alive
+ * while the caller still looks at them.
+ *
+ * Only odd pixel formats (packed YUV, RGB, more than 8 bits) are converted
+ * to grayscale with swscale.
+ *
+ * Files that are still being recorded can be followed: reaching the end of
+ * the file then only means that there is nothing new yet, and the next grab
+ * picks up whatever the grabber has appended in the meantime.
+ *
+ */
+
+#include "lumadecoder.hpp"
+
+#include <string.h>
+
+static bool luma_is_first_plane(enum AVPixelFormat pix_fmt)
+{
+	// True for all planar and semi-planar 8 bit YUV formats (and gray),
+	// where the Y plane can be used as-is.
+
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(pix_fmt);
+
+	if (desc == NULL || desc->nb_components < 1)
+		return false;
+
+	if (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM))
+		return false;
+
+	return desc->comp[0].plane == 0 && desc->comp[0].depth == 8 &&
+		desc->comp[0].step == 1 && desc->comp[0].offset == 0;
+}
+
+bool lumadecoder_open(lumadecoder& dec, const string& filename, int threads)
+{
+	// threads = 0 lets libavcodec decide how many threads to use.
+
+	memset(dec.frames, 0, sizeof(dec.frames));
+
+	dec.format = NULL;
+	dec.codec = NULL;
+	dec.packet = NULL;
+	dec.decoded = NULL;
+	dec.scaler = NULL;
+	dec.stream = -1;
+	dec.slot = 0;
+	dec.direct = true;
+	dec.flushing = false;
+	dec.follow = false;
+	dec.starved = false;
+	dec.pos_msec = 0;
+	dec.fps = 0;
+	dec.width = 0;
+	dec.height = 0;
+
+	if (avformat_open_input(&dec.format, filename.c_str(), NULL, NULL) < 0)
+		return false;
+
+	if (avformat_find_stream_info(dec.format, NULL) < 0)
+	{
+		lumadecoder_close(dec);
+		return false;
+	}
+
+#if LIBAVFORMAT_VERSION_MAJOR < 59
+	AVCodec* decoder = NULL;
+#else
+	const AVCodec* decoder = NULL;
+#endif
+
+	dec.stream = av_find_best_stream(dec.format, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
+
+	if (dec.stream < 0 || decoder == NULL)
+	{
+		lumadecoder_close(dec);
+		return false;
+	}
+
+	dec.codec = avcodec_alloc_context3(decoder);
+
+	if (dec.codec == NULL ||
+		avcodec_parameters_to_context(dec.codec, dec.format->streams[dec.stream]->codecpar) < 0)
+	{
+		lumadecoder_close(dec);
+		return false;
+	}
+
+	dec.codec->thread_count = threads;
+
+	if (avcodec_open2(dec.codec, decoder, NULL) < 0)
+	{
+		lumadecoder_close(dec);
+		return false;
+	}
+
+	dec.packet = av_packet_alloc();
+	dec.decoded = av_frame_alloc();
+
+	bool allocated = dec.packet != NULL && dec.decoded != NULL;
+
+	for (int i = 0; i < LUMADECODER_FRAMES; i++)
+	{
+		dec.frames[i] = av_frame_alloc();
+		allocated = allocated && dec.frames[i] != NULL;
+	}
+
+	if (!allocated)
+	{
+		lumadecoder_close(dec);
+		return false;
+	}
+
+	dec.width = dec.codec->width;
+	dec.height = dec.codec->height;
+
+	AVRational rate = av_guess_frame_rate(dec.format, dec.format->streams[dec.stream], NULL);
+
+	if (rate.num > 0 && rate.den > 0)
+		dec.fps = av_q2d(rate);
+
+	return true;
+}
+
+void lumadecoder_skip_nonref(lumadecoder& dec)
+{
+	// Frames no other frame refers to (usually B-frames) are not decoded
+	// at all. For when only some of the frames will be looked at anyway.
+
+	dec.codec->skip_frame = AVDISCARD_NONREF;
+}
+
+void lumadecoder_follow(lumadecoder& dec, bool follow)
+{
+	// While following, the end of the file is not the end of the video.
+	// Once the file is complete, stop following to get the last frames
+	// out of the decoder.
+
+	dec.follow = follow;
+	dec.starved = false;
+}
+
+bool lumadecoder_seek(lumadecoder& dec, double msec)
+{
+	// Moves to the last keyframe at or before "msec", so that getting there
+	// does not take decoding everything in front of it. The frames between
+	// that keyframe and "msec" are still handed out.
+
+	AVStream* stream = dec.format->streams[dec.stream];
+	AVRational microseconds = { 1, 1000000 };
+
+	int64_t target = av_rescale_q((int64_t)(msec * 1000), microseconds, stream->time_base);
+
+	if (stream->start_time != AV_NOPTS_VALUE)
+		target += stream->start_time;
+
+	if (av_seek_frame(dec.format, dec.stream, target, AVSEEK_FLAG_BACKWARD) < 0)
+		return false;
+
+	avcodec_flush_buffers(dec.codec);
+	dec.flushing = false;
+
+	return true;
+}
+
+bool lumadecoder_grab(lumadecoder& dec)
+{
+	// Decode the next frame without handing it out yet. Returns false at
+	// the end of the file or on a decoding error. When following a file,
+	// "starved" tells that there may be more frames later on.
+
+	AVStream* stream = dec.format->streams[dec.stream];
+
+	dec.starved = false;
+
+	for (;;)
+	{
+		int ret = avcodec_receive_frame(dec.codec, dec.decoded);
+
+		if (ret == 0)
+		{
+			int64_t pts = dec.decoded->best_effort_timestamp;
+
+			if (pts == AV_NOPTS_VALUE)
+				pts = dec.decoded->pts;
+
+			if (pts != AV_NOPTS_VALUE)
+			{
+				if (stream->start_time != AV_NOPTS_VALUE)
+					pts -= stream->start_time;
+
+				dec.pos_msec = pts * av_q2d(stream->time_base) * 1000.0;
+			}
+
+			return true;
+		}
+
+		if (ret != AVERROR(EAGAIN) || dec.flushing)
+			return false;
+
+		// The decoder wants more input.
+
+		ret = av_read_frame(dec.format, dec.packet);
+
+		if (ret == AVERROR_EOF && dec.follow)
+		{
+			// Nothing more has been written yet. Forget about having seen
+			// the end of the file, so that the next read tries again.
+			dec.format->pb->eof_reached = 0;
+			dec.starved = true;
+			return false;
+		}
+
+		if (ret < 0)
+		{
+			// End of file (or a read error); drain what the decoder holds.
+			avcodec_send_packet(dec.codec, NULL);
+			dec.flushing = true;
+			continue;
+		}
+
+		if (dec.packet->stream_index == dec.stream)
+			avcodec_send_packet(dec.codec, dec.packet); // Corrupt packets are simply skipped
+
+		av_packet_unref(dec.packet);
+	}
+}
+
+bool lumadecoder_retrieve(lumadecoder& dec, Mat& luma)
+{
+	// Hand out the Y plane of the frame decoded by the last grab. The Mat
+	// stays valid until LUMADECODER_FRAMES more frames have been retrieved.
+
+	AVFrame* frame = dec.frames[dec.slot];
+
+	av_frame_unref(frame);
+	av_frame_move_ref(frame, dec.decoded);
+
+	if (frame->data[0] == NULL)
+		return false;
+
+	dec.direct = luma_is_first_plane((enum AVPixelFormat)frame->format);
+
+	if (dec.direct)
+	{
+		luma = Mat(frame->height, frame->width, CV_8UC1, frame->data[0], frame->linesize[0]);
+	}
+	else
+	{
+		dec.scaler = sws_getCachedContext(dec.scaler,
+			frame->width, frame->height, (enum AVPixelFormat)frame->format,
+			frame->width, frame->height, AV_PIX_FMT_GRAY8,
+			SWS_POINT, NULL, NULL, NULL);
+
+		if (dec.scaler == NULL)
+			return false;
+
+		Mat& gray = dec.converted[dec.slot];
+		gray.create(frame->height, frame->width, CV_8UC1);
+
+		uint8_t* dst[4] = { gray.data, NULL, NULL, NULL };
+		int dst_linesize[4] = { (int)gray.step, 0, 0, 0 };
+
+		sws_scale(dec.scaler, frame->data, frame->linesize, 0, frame->height, dst, dst_linesize);
+
+		luma = gray;
+	}
+
+	dec.slot = (dec.slot + 1) % LUMADECODER_FRAMES;
+
+	return true;
+}
+
+void lumadecoder_close(lumadecoder& dec)
+{
+	for (int i = 0; i < LUMADECODER_FRAMES; i++)
+	{
+		av_frame_free(&dec.frames[i]);
+		dec.converted[i].release();
+	}
+
+	av_frame_free(&dec.decoded);
+	av_packet_free(&dec.packet);
+	avcodec_free_context(&dec.codec);
+	avformat_close_input(&dec.format);
+
+	sws_freeContext(dec.scaler);
+	dec.scaler = NULL;
+}
@@ -0,0 +1,55 @@
+/*
+ * lumadecoder - Luma-Only Video Decoding for Motion Detection
+ *
+ */
+
+#ifndef LUMADECODER_HPP
+#define LUMADECODER_HPP
+
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+extern "C"
+{
+	#include <libavcodec/avcodec.h>
+	#include <libavformat/avformat.h>
+	#include <libavutil/pixdesc.h>
+	#include <libswscale/swscale.h>
+}
+
+using namespace std;
+using namespace cv;
+
+// How many retrieved frames stay valid at the same time (prev, current, next)
+#define LUMADECODER_FRAMES 3
+
+typedef struct lumadecoder
+{
+	AVFormatContext* format;
+	AVCodecContext* codec;
+	AVPacket* packet;
+	AVFrame* decoded;
+	AVFrame* frames[LUMADECODER_FRAMES];
+	Mat converted[LUMADECODER_FRAMES];
+	SwsContext* scaler;
+	int stream;
+	int slot;
+	bool direct;
+	bool flushing;
+	bool follow;
+	bool starved;
+	double pos_msec;
+	double fps;
+	int width;
+	int height;
+} lumadecoder;
+
+bool lumadecoder_open(lumadecoder& dec, const string& filename, int threads);
+void lumadecoder_skip_nonref(lumadecoder& dec);
+void lumadecoder_follow(lumadecoder& dec, bool follow);
+bool lumadecoder_seek(lumadecoder& dec, double msec);
+bool lumadecoder_grab(lumadecoder& dec);
+bool lumadecoder_retrieve(lumadecoder& dec, Mat& luma);
+void lumadecoder_close(lumadecoder& dec);
+#endif
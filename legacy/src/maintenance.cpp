@@ -16,11 +16,33 @@
 #include "maintenance.hpp"
 
 vector<camera>	m_Cameras;
+map<string, catalog> m_Catalogs;
+map<string, heatmap> m_Heatmaps;
+set<string>		m_StaleHeatmaps;
 bool			m_Delete;
 bool			m_Motion;
 bool			m_Verbose;
 bool			m_Syslog;
-
+bool			m_Tail;
+bool			m_Daemon;
+int				m_Workers;
+int				m_PipelineDepth;
+int				m_TailInterval;
+int				m_SweepInterval;
+int				m_MotionOrder;
+int				m_MaxRuntime;
+double			m_Started;
+double			m_MaxDiskUsage;
+uintmax_t		m_MinFreeBytes;
+
+volatile sig_atomic_t m_Terminate;
+
+std::mutex		m_LogLock;
+std::mutex		m_CatalogLock;
+
+unlinkqueue		m_Unlinks;
+
+#ifndef MAINTENANCE_NO_MAIN
 int main (int argc, char* const argv[])
 {
 	string configfile;
@@ -28,8 +50,13 @@ int main (int argc, char* const argv[])
 	char opt;
 
 	m_Verbose = false;
+	m_Tail = false;
+	m_Daemon = false;
+	m_Started = monotonic_seconds();
+
+	int maxruntime = -1;
 
-	while ((opt = getopt(argc, argv, "c:sv")) != EOF)
+	while ((opt = getopt(argc, argv, "c:dstvT:")) != EOF)
 		switch(opt)
 		{
 			case 's':
@@ -38,22 +65,35 @@ int main (int argc, char* const argv[])
 			case 'c':
 				configfile = optarg;
 				break;
+			case 'd':
+				m_Daemon = true;
+				break;
+			case 't':
+				m_Tail = true;
+				break;
 			case 'v':
 				m_Verbose = true;
 				break;
+			case 'T':
+				maxruntime = atoi(optarg);
+				break;
 			case '?':
 			default:
 				exit_usage(argv[0]);
 				break;
 		}
 
+	if (m_Tail && m_Daemon)
+		exit_usage(argv[0]);
+
 	if (m_Syslog)
 	{
 		openlog(SYSLOG_IDENT, LOG_CONS, LOG_LOCAL0);
 		atexit(closelog);
 	}
 
-	int lock_status = check_if_running_and_lock(LOCKFILE);
+	// Following recordings runs alongside the regular maintenance runs.
+	int lock_status = check_if_running_and_lock(m_Tail ? LOCKFILE_TAIL : LOCKFILE);
 
 	switch (lock_status)
 	{
@@ -78,8 +118,35 @@ int main (int argc, char* const argv[])
 
 	load_settings(configfile);
 
+	if (maxruntime >= 0)
+		m_MaxRuntime = maxruntime;
+
+	if (m_Tail)
+	{
+		signal(SIGTERM, handle_signal);
+		signal(SIGINT, handle_signal);
+
+		do_tail();
+
+		return 0;
+	}
+
+	if (m_Daemon)
+	{
+		signal(SIGTERM, handle_signal);
+		signal(SIGINT, handle_signal);
+
+		do_daemon();
+
+		return 0;
+	}
+
 	LOG(LOG_NOTICE, "Maintenance is starting.");
 
+	// Old recordings are deleted in the background, so that motion
+	// detection does not have to wait for it.
+	unlinkqueue_open(m_Unlinks);
+
 	if (m_Delete)
 		do_delete();
 	else if (m_Verbose)
@@ -90,6 +157,9 @@ int main (int argc, char* const argv[])
 	else if (m_Verbose)
 		LOG(LOG_DEBUG, "Motion detection is turned off.");
 
+	unlinkqueue_close(m_Unlinks);
+	report_deletes();
+
 	LOG(LOG_NOTICE, "Maintenance has completed.");
 
 	return 0;
@@ -100,14 +170,20 @@ void exit_usage(const char* argv0)
 	printf("\n");
 	printf("Maintenance Program for Camera Recordings\n");
 	printf("\n");
-	printf("Usage: %s -c configfile [-s] [-v]\n", argv0);
+	printf("Usage: %s -c configfile [-d | -t] [-s] [-v] [-T seconds]\n", argv0);
 	printf("\n");
 	printf("-c configfile    Full path to camsrv.ini configuration file.\n");
+	printf("-d               Keep running and detect motion in recordings as soon\n");
+	printf("                 as they are finished, instead of from a cron job.\n");
 	printf("-s               Send output to syslog instead of stdout.\n");
+	printf("-t               Detect motion in recordings while they are being\n");
+	printf("                 written. Keeps running until terminated.\n");
 	printf("-v               Make output a little bit more verbose.\n");
+	printf("-T seconds       Like \"maxruntime\", which it overrides.\n");
 	printf("\n");
 	exit(-EINVAL);
 }
+#endif
 
 void do_delete()
 {
@@ -115,6 +191,7 @@ void do_delete()
 
 	uint processed = 0;
 	uintmax_t totalbytes = 0;
+	double elapsed = 0;
 
 	for (vector<camera>::iterator cam = m_Cameras.begin() ; cam != m_Cameras.end(); ++cam)
 	{
@@ -141,68 +218,449 @@ void do_delete()
 			LOG(LOG_DEBUG, "Cutoff is %s.", buff);
 		}
 
-		filesystem::directory_iterator dir(cam->destination), end;
+		int status;
+		catalog* cat = camera_catalog(*cam, status);
+
+		if (cat == NULL)
+		{
+			LOG(LOG_WARNING, "Skipping delete for camera \"%s\".", cam->name.c_str());
+			continue;
+		}
+
+		// The catalog knows when every recording was last modified, so
+		// only the ones that go away have to be touched.
+		set<string> expired;
+
+		for (map<string, catalogentry>::iterator it = cat->entries.begin(); it != cat->entries.end(); ++it)
+		{
+			if (it->second.mtime.tv_sec < cutoff)
+				expired.insert(expired.end(), it->first);
+		}
+
+		static const char* const sidecars[] = { TIMELINE_EXTENSION, TAIL_EXTENSION, NULL };
+
+		retentionresult result;
+		status = retention_delete(cam->destination, expired, cutoff, sidecars, &m_Unlinks,
+			uncount_motion, (void*)&cam->destination, result);
+
+		for (vector<string>::iterator name = result.deleted.begin(); name != result.deleted.end(); ++name)
+		{
+			catalog_remove(*cat, *name);
+
+			LOG(LOG_INFO, "Deleting old video file \"%s\".",
+				(filesystem::path(cam->destination) / *name).string().c_str());
+		}
+
+		if (status == -1)
+		{
+			LOG(LOG_WARNING, "Could not read directory \"%s\" (%s).",
+				cam->destination.c_str(), strerror(errno));
+		}
+		else if (status == -2)
+		{
+			LOG(LOG_WARNING, "Encountered a symbolic link (\"%s\"). Aborting delete.",
+				(filesystem::path(cam->destination) / result.problem).string().c_str());
+		}
+
+		if (result.failed > 0)
+		{
+			LOG(LOG_WARNING, "Could not delete %lu old video file(s) of camera \"%s\".",
+				result.failed, cam->name.c_str());
+		}
+
+		if (m_Verbose)
+		{
+			LOG(LOG_DEBUG, "Queued %zu file(s) of camera \"%s\" in %.2f second(s) (%.1f files/s), along with %lu file(s) next to them; %lu were modified since.",
+				result.deleted.size(), cam->name.c_str(), result.elapsed,
+				result.elapsed > 0 ? result.deleted.size() / result.elapsed : 0,
+				result.sidecars, result.kept);
+		}
+
+		processed += result.deleted.size();
+		totalbytes += result.bytes;
+		elapsed += result.elapsed;
+	}
+
+	if (m_MaxDiskUsage > 0 || m_MinFreeBytes > 0)
+	{
+		uint budget_processed = 0;
+		uintmax_t budget_bytes = 0;
+
+		enforce_disk_budget(budget_processed, budget_bytes);
+
+		processed += budget_processed;
+		totalbytes += budget_bytes;
+	}
+
+	save_catalogs();
+
+	LOG(LOG_NOTICE, "Delete has completed and handed %d file(s) (%.1f files/s) over to be deleted in the background, which will free %ju byte(s).",
+		processed, elapsed > 0 ? processed / elapsed : 0, totalbytes);
+}
+
+void enforce_disk_budget(uint& processed, uintmax_t& totalbytes)
+{
+	// Age alone does not keep the disk from filling up, e.g. when a camera
+	// starts sending twice as much as before. So for every file system that
+	// holds recordings, the oldest recordings of all cameras on it are
+	// deleted until "maxdiskusage" and "minfreebytes" are met again.
+	//
+	// How old a recording is counts divided by the "retentionweight" of its
+	// camera, so a camera with twice the weight keeps its recordings for
+	// about twice as long. Recordings that are younger than the
+	// "retentionmindays" of their camera are never deleted for space.
+
+	map<dev_t, vector<camera*> > filesystems;
+	set<string> seen;
+
+	for (vector<camera>::iterator cam = m_Cameras.begin(); cam != m_Cameras.end(); ++cam)
+	{
+		struct stat st;
+
+		// Cameras sharing a directory share its recordings; the first
+		// one decides about them.
+		if (!seen.insert(cam->destination).second)
+			continue;
+
+		if (stat(cam->destination.c_str(), &st) == 0)
+			filesystems[st.st_dev].push_back(&*cam);
+	}
+
+	const time_t now = time(NULL);
+
+	for (map<dev_t, vector<camera*> >::iterator fs = filesystems.begin(); fs != filesystems.end(); ++fs)
+	{
+		const string& destination = fs->second.front()->destination;
+		struct statvfs vfs;
+
+		if (statvfs(destination.c_str(), &vfs) != 0)
+		{
+			LOG(LOG_WARNING, "Could not determine free space of \"%s\" (%s).",
+				destination.c_str(), strerror(errno));
+			continue;
+		}
+
+		const uintmax_t total = (uintmax_t)vfs.f_blocks * vfs.f_frsize;
+		const uintmax_t available = (uintmax_t)vfs.f_bavail * vfs.f_frsize;
+		const uintmax_t used = total - (uintmax_t)vfs.f_bfree * vfs.f_frsize;
+
+		uintmax_t needed = 0;
+
+		if (m_MinFreeBytes > available)
+			needed = m_MinFreeBytes - available;
+
+		if (m_MaxDiskUsage > 0)
+		{
+			const uintmax_t allowed = (uintmax_t)(total * (m_MaxDiskUsage / 100.0));
+
+			if (used > allowed)
+				needed = max(needed, used - allowed);
+		}
+
+		// Some space on it is yet to be freed in the background.
+		needed -= min(needed, unlinkqueue_pending_bytes(m_Unlinks, fs->first));
+
+		if (needed == 0)
+			continue;
+
+		// All recordings that may go, as a heap with the one to delete
+		// first on top. Building it is linear; every pop is logarithmic.
+		vector<budgetcandidate> candidates;
 
-		while (dir != end)
+		for (vector<camera*>::iterator cam = fs->second.begin(); cam != fs->second.end(); ++cam)
 		{
-			filesystem::path cur_path = dir->path();
+			map<string, catalog>::iterator cat = m_Catalogs.find((*cam)->destination);
+
+			if (cat == m_Catalogs.end())
+				continue;
 
-			if (filesystem::is_symlink(dir->path()))
+			const time_t floor = now - 86400 * (time_t)(*cam)->retentionmindays;
+
+			for (map<string, catalogentry>::iterator it = cat->second.entries.begin(); it != cat->second.entries.end(); ++it)
 			{
-				LOG(LOG_WARNING, "Encountered a symbolic link (\"%s\"). Aborting delete.",
-					cur_path.string().c_str());
-				break;
+				const time_t modified = it->second.mtime.tv_sec;
+
+				if (modified >= floor || now - modified < MOTION_MIN_AGE)
+					continue;
+
+				budgetcandidate candidate;
+
+				candidate.age = (now - modified) / (*cam)->retentionweight;
+				candidate.cam = *cam;
+				candidate.name = &it->first;
+				candidate.size = it->second.size;
+
+				candidates.push_back(candidate);
 			}
+		}
+
+		make_heap(candidates.begin(), candidates.end(), younger_candidate);
+
+		map<camera*, set<string> > expired;
+		uintmax_t planned = 0;
+
+		while (planned < needed && !candidates.empty())
+		{
+			pop_heap(candidates.begin(), candidates.end(), younger_candidate);
+
+			const budgetcandidate& oldest = candidates.back();
+
+			expired[oldest.cam].insert(*oldest.name);
+			planned += oldest.size;
+
+			candidates.pop_back();
+		}
+
+		LOG(LOG_NOTICE, "File system of \"%s\" needs %ju more byte(s) of free space; deleting %zu camera(s)' oldest recordings.",
+			destination.c_str(), needed, expired.size());
+
+		if (planned < needed)
+		{
+			LOG(LOG_WARNING, "Not enough recordings may be deleted to free enough space on the file system of \"%s\"; check retentionmindays.",
+				destination.c_str());
+		}
+
+		static const char* const sidecars[] = { TIMELINE_EXTENSION, TAIL_EXTENSION, NULL };
+
+		for (map<camera*, set<string> >::iterator it = expired.begin(); it != expired.end(); ++it)
+		{
+			catalog& cat = m_Catalogs[it->first->destination];
 
-			time_t modification_time = filesystem::last_write_time(dir->path());
+			retentionresult result;
+			int status = retention_delete(it->first->destination, it->second,
+				now - 86400 * (time_t)it->first->retentionmindays, sidecars, &m_Unlinks,
+				uncount_motion, (void*)&it->first->destination, result);
 
-			if (modification_time < cutoff)
+			for (vector<string>::iterator name = result.deleted.begin(); name != result.deleted.end(); ++name)
 			{
-				++processed;
-				totalbytes += filesystem::file_size(dir->path());
-				filesystem::remove(dir->path());
+				catalog_remove(cat, *name);
 
-				LOG(LOG_INFO, "Deleted old video file \"%s\".", cur_path.string().c_str());
+				LOG(LOG_INFO, "Deleting video file \"%s\" to free space.",
+					(filesystem::path(it->first->destination) / *name).string().c_str());
+			}
 
-				if (m_Verbose)
-					LOG(LOG_DEBUG, "modification_time %d, cutoff %d", modification_time, cutoff);
+			if (status == -2)
+			{
+				LOG(LOG_WARNING, "Encountered a symbolic link (\"%s\"). Aborting delete.",
+					(filesystem::path(it->first->destination) / result.problem).string().c_str());
 			}
 
-			++dir;
+			processed += result.deleted.size();
+			totalbytes += result.bytes;
 		}
 	}
+}
 
-	LOG(LOG_NOTICE, "Delete has completed and deleted %d file(s), freeing %ju byte(s).",
-		processed, totalbytes);
+bool younger_candidate(const budgetcandidate& a, const budgetcandidate& b)
+{
+	return a.age < b.age;
 }
 
 void do_motion()
 {
 	LOG(LOG_NOTICE, "Motion detection is starting.");
 
-	const time_t overall_start = time(NULL);
+	const double overall_start = monotonic_seconds();
+
+	motionqueue queue;
+
+	collect_motion_jobs(queue.jobs);
+
+	queue.next = 0;
+	queue.cancel = false;
+
+	int workers = min(m_Workers, (int)queue.jobs.size());
+
+	// With "maxruntime", the workers need to know how much is left to do
+	// from any point in the queue on; see plan_motion_quality().
+	queue.deadline = m_MaxRuntime > 0 ? m_Started + m_MaxRuntime : 0;
+	queue.workers = max(workers, 1);
+	queue.remaining.assign(queue.jobs.size() + 1, 0);
+
+	for (size_t i = queue.jobs.size(); i > 0; i--)
+		queue.remaining[i - 1] = queue.remaining[i] + queue.jobs[i - 1].size;
+
+	for (int level = 0; level < MOTION_QUALITY_LEVELS; level++)
+	{
+		queue.spent[level] = 0;
+		queue.analysed[level] = 0;
+	}
+
+	LOG(LOG_NOTICE, "Motion detection will now process %zu video file(s) using %d worker(s).",
+		queue.jobs.size(), workers);
+
+	// Every worker decodes and analyses whole files on its own, so keep
+	// OpenCV from spawning its own threads on top of ours.
+	if (workers > 1)
+		setNumThreads(1);
+
+	vector<std::thread> pool;
+
+	for (int i = 0; i < workers; i++)
+		pool.push_back(std::thread(motion_worker, std::ref(queue)));
+
+	// Workers finish files in any order, but results are committed here
+	// strictly in the order of the queue; see collect_motion_jobs().
 
-	// To automatically sort input files by mtime without reinventing the wheel
-	multimap<time_t, pair<filesystem::path, camera> > files;
+	uint processed = 0;
+	unsigned long total_frames = 0;
+	unsigned long total_analysed = 0;
+	unsigned long total_full_stalls = 0;
+	unsigned long total_empty_stalls = 0;
+	double total_duration = 0;
+	uint quarantined = 0;
+	uint failed = 0;
+	uint misfits = 0;
+	uint postponed = 0;
+	uint degraded = 0;
+
+	for (vector<motionjob>::iterator job = queue.jobs.begin(); job != queue.jobs.end(); ++job)
+	{
+		{
+			std::unique_lock<std::mutex> guard(queue.lock);
+
+			while (!job->done)
+				queue.completed.wait(guard);
+		}
+
+		if (m_Verbose)
+			cout << job->result.trace << flush;
+
+		if (job->quality < 0)
+		{
+			// Out of time; the next run gets to it.
+			++postponed;
+			continue;
+		}
+
+		if (job->quality > 0)
+			++degraded;
+
+		if (job->motion == -2)
+		{
+			misfit_motion(*job);
+			++misfits;
+			continue;
+		}
+
+		if (job->motion == -1)
+		{
+			// The rest of the queue does not have to suffer for it.
+			if (quarantine_motion(*job))
+				++quarantined;
+			else
+				++failed;
+
+			continue;
+		}
+
+		if (!commit_motion(*job))
+		{
+			int status;
+			camera_catalog(job->cam, status);
+			continue;
+		}
+
+		++processed;
+		total_frames += job->result.frames;
+		total_analysed += job->result.analysed;
+		total_full_stalls += job->result.full_stalls;
+		total_empty_stalls += job->result.empty_stalls;
+		total_duration += job->result.duration;
+	}
+
+	queue.cancel = true;
+
+	for (vector<std::thread>::iterator worker = pool.begin(); worker != pool.end(); ++worker)
+		worker->join();
+
+	queue.jobs.clear();
+
+	save_catalogs();
+
+	const double overall_elapsed = monotonic_seconds() - overall_start;
+	const double rate_divisor = overall_elapsed > 0 ? overall_elapsed : 1;
+
+	LOG(LOG_NOTICE, "Motion detection has completed in %.1f second(s). Processed %u file(s) (%.2f files/s) and %lu frame(s) (%.1f frames/s), of which %lu were analysed (%.1f frame(s) per second of video).",
+		overall_elapsed, processed, processed / rate_divisor,
+		total_frames, total_frames / rate_divisor,
+		total_analysed, total_duration > 0 ? total_analysed / total_duration : 0);
+
+	if (degraded > 0)
+	{
+		LOG(LOG_NOTICE, "Analysed %u file(s) more cheaply than configured to finish within %d second(s).",
+			degraded, m_MaxRuntime);
+	}
+
+	if (postponed > 0)
+	{
+		LOG(LOG_WARNING, "Ran out of time (maxruntime is %d second(s)); %u file(s) are left for the next run.",
+			m_MaxRuntime, postponed);
+	}
+
+	if (failed > 0)
+	{
+		LOG(LOG_WARNING, "Motion detection failed for %u file(s), which will be tried again by the next run.",
+			failed);
+	}
+
+	if (quarantined > 0)
+	{
+		LOG(LOG_WARNING, "Motion detection failed for %u file(s) %d time(s) in a row; they will not be tried again unless the settings of their camera change.",
+			quarantined, MOTION_ATTEMPTS);
+	}
+
+	if (misfits > 0)
+	{
+		LOG(LOG_ERR, "The mask did not fit %u file(s); they will be tried again once the mask of their camera is fixed.",
+			misfits);
+	}
+
+	if (m_PipelineDepth > 0)
+	{
+		LOG(LOG_NOTICE, "Analysis waited for the decoder %lu time(s); the decoder waited for analysis %lu time(s).",
+			total_empty_stalls, total_full_stalls);
+	}
+}
+
+void collect_motion_jobs(vector<motionjob>& jobs)
+{
+	// Adds every recording that is ready for motion detection, with the
+	// cameras taking turns by their "motionpriority"; see motionschedule.cpp.
+
+	motionschedule schedule;
+	motionschedule_init(schedule, m_MotionOrder);
+
+	vector<motionjob> ready;
 
 	for (vector<camera>::iterator cam = m_Cameras.begin() ; cam != m_Cameras.end(); ++cam)
 	{
-		filesystem::recursive_directory_iterator dir(cam->destination), end;
+		int status;
+		catalog* cat = camera_catalog(*cam, status);
 
-		while (dir != end)
+		if (cat == NULL)
 		{
-			filesystem::path cur_path = dir->path();
-			dir++;
+			if (status == -2)
+				abort();
+
+			continue;
+		}
 
-			if (filesystem::is_symlink(cur_path))
+		for (map<string, catalogentry>::iterator it = cat->entries.begin(); it != cat->entries.end(); ++it)
+		{
+			if (retry_motion(it->second, *cam))
 			{
-				LOG(LOG_WARNING, "Encountered a symbolic link (\"%s\").", cur_path.string().c_str());
-				abort();
+				LOG(LOG_NOTICE, "Settings of camera \"%s\" have changed; motion detection will try video file \"%s\" again.",
+					cam->name.c_str(), it->first.c_str());
 			}
 
-			time_t modification_time = filesystem::last_write_time(cur_path);
+			if (it->second.state != CATALOG_NEW || (it->second.flags & CATALOG_MISFIT))
+				continue;
+
+			filesystem::path cur_path = filesystem::path(cam->destination) / it->first;
+			time_t modification_time = it->second.mtime.tv_sec;
 
-			if (time(NULL) - modification_time < 60)
+			if (time(NULL) - modification_time < MOTION_MIN_AGE)
 			{
 				if (m_Verbose)
 				{
@@ -212,13 +670,11 @@ void do_motion()
 				continue;
 			}
 
-			size_t string_pos = cur_path.string().find("-MOTION");
-
-			if (string_pos != string::npos)
+			if (is_being_followed(cur_path))
 			{
 				if (m_Verbose)
 				{
-					LOG(LOG_DEBUG, "Not processing \"%s\" because it was processed before.",
+					LOG(LOG_DEBUG, "Not processing \"%s\" because it is being followed.",
 						cur_path.string().c_str());
 				}
 				continue;
@@ -230,93 +686,1265 @@ void do_motion()
 					cur_path.string().c_str());
 			}
 
-			files.insert(pair<time_t, pair<filesystem::path, camera> >(modification_time,
-				pair<filesystem::path, camera>(cur_path, *cam)));
+			motionschedule_push(schedule, motionschedule_lane(schedule, cam->name, cam->motionpriority),
+				modification_time, ready.size());
+
+			ready.push_back(new_motion_job(cur_path, *cam, modification_time));
+			ready.back().size = it->second.size;
 		}
 	}
 
-	LOG(LOG_NOTICE, "Motion detection will now process %d video file(s).", files.size());
+	jobs.reserve(jobs.size() + ready.size());
 
-	for (multimap<time_t, pair<filesystem::path, camera> >::iterator it = files.begin(); it != files.end(); ++it)
-	{
-		const time_t detection_start = time(NULL);
+	size_t next;
+
+	while (motionschedule_pop(schedule, next))
+		jobs.push_back(ready[next]);
+}
 
-		const filesystem::path path = (it->second).first;
-		const camera cam = (it->second).second;
+motionjob new_motion_job(const filesystem::path& path, const camera& cam, time_t modified)
+{
+	motionjob job;
+
+	job.path = path;
+	job.cam = cam;
+	job.modified = modified;
+	job.size = 0;
+	job.quality = 0;
+	job.motion = -1;
+	job.result.frames = 0;
+	job.result.analysed = 0;
+	job.result.duration = 0;
+	job.result.allocations = 0;
+	job.result.full_stalls = 0;
+	job.result.empty_stalls = 0;
+	job.elapsed = 0;
+	job.done = false;
+
+	return job;
+}
 
-		if (m_Verbose)
-			LOG(LOG_DEBUG, "Processing video file \"%s\".", path.string().c_str());
+bool commit_motion(const motionjob& job)
+{
+	// Renames a video file to say how much motion it had and puts the
+	// details next to it. Returns false if the file could not be renamed,
+	// e.g. because it was deleted in the meantime; the result is dropped
+	// then, and the catalog is made to look at the directory again.
 
-		int motion_detected = video_motion_detection(path.string(), cam);
+	filesystem::path new_path = motion_path(job.path, job.motion);
+	catalog& cat = m_Catalogs[job.cam.destination];
 
-		if (motion_detected == -1)
-		{
-			LOG(LOG_WARNING, "Motion detection failed for video file (\"%s\").",
-				path.string().c_str());
+	system::error_code error;
+	filesystem::rename(job.path, new_path, error);
 
-			return;
-		}
+	if (error)
+	{
+		LOG(LOG_WARNING, "Could not rename video file \"%s\" (%s); its motion detection result is dropped.",
+			job.path.string().c_str(), error.message().c_str());
 
-		char* filename_buffer = NULL;
+		catalog_rescan(cat);
+		return false;
+	}
 
-		asprintf(&filename_buffer, "%s-MOTION-%d%s",
-			path.stem().string().c_str(),
-			motion_detected,
-			path.extension().string().c_str());
+	write_timeline(new_path, job.motion, job.result);
 
-		filesystem::path new_path =
-			path.parent_path() / filesystem::path(filename_buffer);
+	catalog_rename(cat, job.path.filename().string(), new_path.filename().string(), CATALOG_PROCESSED);
+	catalog_describe(cat, new_path.filename().string(), job.motion,
+		(uint32_t)lround(job.result.duration * 1000), job.quality);
 
-		free(filename_buffer);
+	map<string, catalogentry>::iterator entry = cat.entries.find(new_path.filename().string());
 
-		filesystem::rename(path, new_path);
+	if (entry != cat.entries.end() && !(entry->second.flags & CATALOG_COUNTED))
+	{
+		timelineheader header;
+		system::error_code ignored;
 
-		const time_t detection_end = time(NULL);
+		header.duration_ms = entry->second.duration_ms;
+		header.recorded = filesystem::last_write_time(new_path, ignored);
 
-		LOG(LOG_INFO, "Motion detection result for video file \"%s\" was %d. Determined in %d second(s).",
-			path.string().c_str(), motion_detected, (detection_end - detection_start));
+		apply_motion(m_Heatmaps[job.cam.destination], header, job.result.timeline, true);
+		entry->second.flags |= CATALOG_COUNTED;
 	}
 
-	files.clear();
+	// Left behind by a follower that did not get to finish this file
+	system::error_code ignored;
+	filesystem::remove(tail_state_path(job.path), ignored);
+
+	LOG(LOG_INFO, "Motion detection result for video file \"%s\" was %d. Determined in %.1f second(s), analysing %.1f frame(s) per second of video.",
+		job.path.string().c_str(), job.motion, job.elapsed,
+		job.result.duration > 0 ? job.result.analysed / job.result.duration : 0);
 
-	const time_t overall_end = time(NULL);
+	if (m_Verbose && m_PipelineDepth > 0)
+	{
+		LOG(LOG_DEBUG, "Analysis of video file \"%s\" waited for the decoder %lu time(s); the decoder waited for analysis %lu time(s).",
+			job.path.string().c_str(), job.result.empty_stalls, job.result.full_stalls);
+	}
 
-	LOG(LOG_NOTICE, "Motion detection has completed in %d second(s).",
-		(overall_end - overall_start));
+#ifdef ALLOCATION_COUNTER
+	LOG(LOG_DEBUG, "Analysing video file \"%s\" made %lu heap allocation(s) once warmed up.",
+		job.path.string().c_str(), job.result.allocations);
+#endif
+
+	return true;
 }
 
-void load_settings(const string& filename)
+bool quarantine_motion(const motionjob& job)
 {
-	if (!filesystem::exists(filename))
+	// A file that cannot be analysed would otherwise be tried again by
+	// every run, and fail again. After MOTION_ATTEMPTS tries, it stays
+	// where it is, so that it is still deleted like any other recording,
+	// but it is left alone until the settings of its camera change; see
+	// retry_motion(). Returns true if it is left alone from now on.
+
+	catalog& cat = m_Catalogs[job.cam.destination];
+	const string name = job.path.filename().string();
+
+	map<string, catalogentry>::iterator entry = cat.entries.find(name);
+
+	if (entry == cat.entries.end())
+		return false;
+
+	entry->second.attempts++;
+	entry->second.settings = job.cam.settings;
+
+	if (entry->second.attempts < MOTION_ATTEMPTS)
 	{
-		LOG(LOG_CRIT, "Configuration file \"%s\" not found.\n", filename.c_str());
-		exit(1);
+		LOG(LOG_WARNING, "Motion detection failed for video file \"%s\" (attempt %d of %d).",
+			job.path.string().c_str(), entry->second.attempts, MOTION_ATTEMPTS);
+		return false;
 	}
 
-	property_tree::ptree pt;
+	catalog_rename(cat, name, name, CATALOG_FAILED);
 
-	try
+	system::error_code ignored;
+	filesystem::remove(tail_state_path(job.path), ignored);
+
+	LOG(LOG_WARNING, "Motion detection failed for video file \"%s\" %d time(s). It will not be tried again.",
+		job.path.string().c_str(), entry->second.attempts);
+
+	return true;
+}
+
+void misfit_motion(const motionjob& job)
+{
+	// The file is fine, the camera is not; it is tried again once the
+	// mask has been fixed, see retry_motion().
+
+	catalog& cat = m_Catalogs[job.cam.destination];
+
+	map<string, catalogentry>::iterator entry = cat.entries.find(job.path.filename().string());
+
+	if (entry == cat.entries.end())
+		return;
+
+	entry->second.flags |= CATALOG_MISFIT;
+	entry->second.settings = job.cam.settings;
+}
+
+bool retry_motion(catalogentry& entry, const camera& cam)
+{
+	// Forgets how motion detection went with a recording if it was with
+	// other settings than the camera has now. Returns true if the
+	// recording had been given up on.
+
+	if (entry.settings == cam.settings || (entry.state != CATALOG_FAILED &&
+		entry.attempts == 0 && !(entry.flags & CATALOG_MISFIT)))
 	{
-		property_tree::ini_parser::read_ini(filename, pt);
+		return false;
 	}
-	catch (const property_tree::ini_parser::ini_parser_error &e)
+
+	const bool given_up = entry.state == CATALOG_FAILED || (entry.flags & CATALOG_MISFIT);
+
+	if (entry.state == CATALOG_FAILED)
+		entry.state = CATALOG_NEW;
+
+	entry.flags &= ~CATALOG_MISFIT;
+	entry.attempts = 0;
+	entry.settings = cam.settings;
+
+	return given_up;
+}
+
+void motion_worker(motionqueue& queue)
+{
+	// The frame ring and all scratch memory belong to the worker and are
+	// reused for every file it processes.
+
+	motiondetector detector;
+
+	detector.buffered = Size();
+	detector.copies = false;
+
+	while (!queue.cancel)
 	{
-		LOG(LOG_CRIT, "Configuration file \"%s\" parse error on line %ld (%s)\n",
-			e.filename().c_str(), e.line(), e.message().c_str());
-		exit(1);
-	}
+		const size_t index = queue.next++;
+
+		if (index >= queue.jobs.size())
+			return;
+
+		motionjob& job = queue.jobs[index];
+
+		job.quality = plan_motion_quality(queue, index);
+
+		if (job.quality < 0)
+		{
+			{
+				std::lock_guard<std::mutex> guard(queue.lock);
+				job.done = true;
+			}
+
+			queue.completed.notify_all();
+			continue;
+		}
+
+		if (job.quality > 0)
+			degrade_camera(job.cam, job.quality);
+
+		if (m_Verbose)
+		{
+			LOG(LOG_DEBUG, "Processing video file \"%s\" at quality level %d.",
+				job.path.string().c_str(), job.quality);
+		}
+
+		const double detection_start = monotonic_seconds();
+
+		job.motion = video_motion_detection(job.path.string(), job.cam, detector, job.result, true);
+		job.elapsed = monotonic_seconds() - detection_start;
+
+		{
+			std::lock_guard<std::mutex> guard(queue.lock);
+			job.done = true;
+
+			if (job.motion >= 0 && job.size > 0)
+			{
+				queue.spent[job.quality] += job.elapsed;
+				queue.analysed[job.quality] += job.size;
+			}
+		}
+
+		queue.completed.notify_all();
+	}
+}
+
+int plan_motion_quality(motionqueue& queue, size_t index)
+{
+	// How cheaply to analyse the file at "index" of the queue so that the
+	// run is done by its deadline, or -1 to leave it for the next run as
+	// the time is up.
+	//
+	// How long a file takes is about proportional to its size (all files
+	// of a camera have the same resolution and frame rate, and cameras
+	// with more pixels need more bytes for them), so what the workers have
+	// done so far says how many seconds per byte each level takes. Levels
+	// not tried yet are guessed from the ones that were.
+
+	static const double guess[MOTION_QUALITY_LEVELS] = { 1.0, 0.6, 0.35 };
+
+	if (queue.deadline <= 0)
+		return 0;
+
+	const double left = queue.deadline - monotonic_seconds();
+
+	if (left <= 0)
+		return -1;
+
+	std::lock_guard<std::mutex> guard(queue.lock);
+
+	double full = 0;
+
+	for (int level = 0; level < MOTION_QUALITY_LEVELS && full <= 0; level++)
+	{
+		if (queue.analysed[level] > 0)
+			full = queue.spent[level] / queue.analysed[level] / guess[level];
+	}
+
+	// Nothing to go by yet
+	if (full <= 0)
+		return 0;
+
+	for (int level = 0; level < MOTION_QUALITY_LEVELS; level++)
+	{
+		const double rate = queue.analysed[level] > 0 ?
+			queue.spent[level] / queue.analysed[level] : full * guess[level];
+
+		if (queue.remaining[index] * rate / queue.workers <= left)
+			return level;
+	}
+
+	return MOTION_QUALITY_LEVELS - 1;
+}
+
+void degrade_camera(camera& cam, int quality)
+{
+	// Changes the settings of a (copy of a) camera for one of the cheaper
+	// quality levels; see MOTION_QUALITY_LEVELS. Halving the frame rate is
+	// left to open_motion_scan(), which knows the frame rate of the video.
+
+	cam.motionquality = quality;
+
+	if (quality >= 2 && cam.motionanalysisscale < 8)
+	{
+		cam.motionanalysisscale *= 2;
+		prepare_camera(cam, cam.mask);
+	}
+}
+
+void do_daemon()
+{
+	// Does what the cron job would do, but keeps running. Recordings are
+	// queued for motion detection the moment the grabber closes them, by
+	// a pool of workers that stays around; old recordings are deleted and
+	// anything that was missed is picked up every "sweepinterval" seconds.
+
+	LOG(LOG_NOTICE, "Maintenance is running as a daemon for %zu camera(s).", m_Cameras.size());
+
+	int notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	if (notify < 0)
+	{
+		LOG(LOG_CRIT, "Could not set up inotify (%s).", strerror(errno));
+		exit(1);
+	}
+
+	map<int, camera*> watches;
+
+	for (vector<camera>::iterator cam = m_Cameras.begin(); cam != m_Cameras.end(); ++cam)
+	{
+		int wd = inotify_add_watch(notify, cam->destination.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+
+		if (wd < 0)
+		{
+			LOG(LOG_CRIT, "Could not watch directory \"%s\" of camera \"%s\" (%s).",
+				cam->destination.c_str(), cam->name.c_str(), strerror(errno));
+			exit(1);
+		}
+
+		// Cameras sharing a directory share a watch; the first one wins.
+		watches.insert(make_pair(wd, &*cam));
+	}
+
+	daemonqueue queue;
+	queue.stop = false;
+	queue.tickets = 0;
+	motionschedule_init(queue.order, m_MotionOrder);
+
+	unlinkqueue_open(m_Unlinks);
+
+	vector<std::thread> pool;
+
+	if (m_Motion)
+	{
+		if (m_Workers > 1)
+			setNumThreads(1);
+
+		for (int i = 0; i < m_Workers; i++)
+			pool.push_back(std::thread(daemon_worker, std::ref(queue)));
+	}
+
+	time_t next_sweep = 0;
+
+	// Events are variable length, but always aligned like this.
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	while (!m_Terminate)
+	{
+		if (time(NULL) >= next_sweep)
+		{
+			sweep(queue);
+			next_sweep = time(NULL) + m_SweepInterval;
+		}
+
+		struct pollfd pfd;
+		pfd.fd = notify;
+		pfd.events = POLLIN;
+
+		int timeout = max(0, (int)(next_sweep - time(NULL))) * 1000;
+
+		// Signals interrupt this, so termination is noticed right away.
+		if (poll(&pfd, 1, timeout) <= 0)
+			continue;
+
+		ssize_t length;
+
+		while ((length = read(notify, buffer, sizeof(buffer))) > 0)
+		{
+			for (char* p = buffer; p < buffer + length; )
+			{
+				const struct inotify_event* event = (const struct inotify_event*)p;
+				p += sizeof(struct inotify_event) + event->len;
+
+				if (event->mask & IN_Q_OVERFLOW)
+				{
+					LOG(LOG_WARNING, "Missed some finished recordings; looking for them now.");
+					next_sweep = 0;
+					continue;
+				}
+
+				map<int, camera*>::iterator watch = watches.find(event->wd);
+
+				if (watch == watches.end() || event->len == 0 || (event->mask & IN_ISDIR) ||
+					!is_recording_name(event->name) || strstr(event->name, "-MOTION") != NULL)
+				{
+					continue;
+				}
+
+				filesystem::path path = filesystem::path(watch->second->destination) / event->name;
+
+				if (m_Motion && !is_being_followed(path))
+					enqueue_motion_job(queue, new_motion_job(path, *watch->second, time(NULL)));
+			}
+		}
+	}
+
+	LOG(LOG_NOTICE, "Daemon is stopping.");
+
+	{
+		std::lock_guard<std::mutex> guard(queue.lock);
+		queue.stop = true;
+	}
+
+	queue.available.notify_all();
+
+	// Files that were still queued are picked up by the next sweep.
+	for (vector<std::thread>::iterator worker = pool.begin(); worker != pool.end(); ++worker)
+		worker->join();
+
+	close(notify);
+
+	unlinkqueue_close(m_Unlinks);
+	report_deletes();
+
+	std::lock_guard<std::mutex> guard(m_CatalogLock);
+	save_catalogs();
+}
+
+void sweep(daemonqueue& queue)
+{
+	// What a cron job run would do, except that motion detection is left
+	// to the workers of the daemon.
+
+	std::lock_guard<std::mutex> guard(m_CatalogLock);
+
+	// How the previous sweep went
+	report_deletes();
+
+	if (m_Delete)
+		do_delete();
+
+	if (m_Motion)
+	{
+		vector<motionjob> jobs;
+		collect_motion_jobs(jobs);
+
+		for (vector<motionjob>::iterator job = jobs.begin(); job != jobs.end(); ++job)
+			enqueue_motion_job(queue, *job);
+
+		save_catalogs();
+	}
+}
+
+void report_deletes()
+{
+	// Logs what the background deletes have done since the last time.
+
+	static unsigned long reported_completed = 0, reported_failed = 0;
+	static uintmax_t reported_freed = 0;
+
+	unsigned long completed, failed;
+	uintmax_t freed;
+
+	unlinkqueue_stats(m_Unlinks, completed, failed, freed);
+
+	if (completed > reported_completed)
+	{
+		LOG(LOG_NOTICE, "Deleted %lu file(s) in the background, freeing %ju byte(s).",
+			completed - reported_completed, freed - reported_freed);
+	}
+
+	if (failed > reported_failed)
+	{
+		LOG(LOG_WARNING, "Could not delete %lu file(s) in the background.",
+			failed - reported_failed);
+	}
+
+	reported_completed = completed;
+	reported_failed = failed;
+	reported_freed = freed;
+}
+
+void enqueue_motion_job(daemonqueue& queue, const motionjob& job)
+{
+	{
+		std::lock_guard<std::mutex> guard(queue.lock);
+
+		// A file that is closed more than once, or that is found by a sweep
+		// while it is already waiting, is only processed once.
+		if (!queue.queued.insert(job.path.string()).second)
+			return;
+
+		if (m_Verbose)
+			LOG(LOG_DEBUG, "Queueing \"%s\" for processing.", job.path.string().c_str());
+
+		const size_t ticket = queue.tickets++;
+
+		queue.pending[ticket] = job;
+		motionschedule_push(queue.order, motionschedule_lane(queue.order, job.cam.name, job.cam.motionpriority),
+			job.modified, ticket);
+	}
+
+	queue.available.notify_one();
+}
+
+void daemon_worker(daemonqueue& queue)
+{
+	// Like motion_worker(), except that it waits for work instead of
+	// returning, and commits its results itself.
+
+	motiondetector detector;
+
+	detector.buffered = Size();
+	detector.copies = false;
+
+	for (;;)
+	{
+		motionjob job;
+
+		{
+			std::unique_lock<std::mutex> guard(queue.lock);
+
+			size_t ticket;
+
+			while (!queue.stop && !motionschedule_pop(queue.order, ticket))
+				queue.available.wait(guard);
+
+			if (queue.stop)
+				return;
+
+			job = queue.pending[ticket];
+			queue.pending.erase(ticket);
+		}
+
+		const double detection_start = monotonic_seconds();
+
+		job.motion = video_motion_detection(job.path.string(), job.cam, detector, job.result, true);
+		job.elapsed = monotonic_seconds() - detection_start;
+
+		if (m_Verbose)
+		{
+			std::lock_guard<std::mutex> guard(m_LogLock);
+			cout << job.result.trace << flush;
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(m_CatalogLock);
+
+			// So the web interface has it right away
+			int status;
+			catalog* cat = camera_catalog(job.cam, status);
+
+			if (job.motion == -2)
+				misfit_motion(job);
+			else if (job.motion == -1)
+				quarantine_motion(job);
+			else if (!commit_motion(job))
+				cat = camera_catalog(job.cam, status);
+
+			if (cat != NULL)
+				publish_catalog(*cat);
+		}
+
+		std::lock_guard<std::mutex> guard(queue.lock);
+		queue.queued.erase(job.path.string());
+	}
+}
+
+void do_tail()
+{
+	LOG(LOG_NOTICE, "Following recordings of %zu camera(s) while they are being written.",
+		m_Cameras.size());
+
+	// Every camera gets a thread of its own, because every camera has a
+	// segment that is being written all the time.
+
+	vector<std::thread> followers;
+
+	for (vector<camera>::iterator cam = m_Cameras.begin(); cam != m_Cameras.end(); ++cam)
+		followers.push_back(std::thread(tail_camera, *cam));
+
+	for (vector<std::thread>::iterator follower = followers.begin(); follower != followers.end(); ++follower)
+		follower->join();
+
+	LOG(LOG_NOTICE, "Stopped following recordings.");
+}
+
+void tail_camera(camera cam)
+{
+	// Follows the newest segment of a camera. Every few seconds, whatever
+	// the grabber has appended is analysed, and the state of the detector
+	// is saved next to the segment. Once the grabber has moved on to the
+	// next segment, or has stopped writing, the result is committed just
+	// like do_motion() does.
+	//
+	// Except for the catalog and the heatmap: followers run in a process
+	// of their own, next to cron runs or the daemon, and two processes
+	// saving those would undo or double each other's changes. So they
+	// only learn about a followed segment when the other process next
+	// reconciles its directory (the next cron run, or the next sweep of
+	// the daemon), and count its timeline then; until then, the web
+	// interface lists it without its motion.
+
+	motiondetector detector;
+
+	detector.buffered = Size();
+	detector.copies = false;
+
+	motionscan scan;
+	motionresult result;
+	filesystem::path segment;
+	bool following = false;
+
+	struct timespec seen;
+	seen.tv_sec = -1;
+	seen.tv_nsec = 0;
+
+	filesystem::path newest;
+
+	while (!m_Terminate)
+	{
+		// The newest segment can only change when something in the
+		// directory does, so mostly, there is nothing to look for.
+		if (directory_changed(cam.destination, seen))
+			newest = newest_recording(cam);
+
+		if (following)
+		{
+			system::error_code error;
+			time_t modified = filesystem::last_write_time(segment, error);
+
+			bool finished = scan_motion(scan);
+
+			if (error || newest != segment || time(NULL) - modified >= MOTION_MIN_AGE)
+			{
+				// The grabber is done with it; whatever it has written by
+				// now is all there is.
+				lumadecoder_follow(scan.capture, false);
+
+				while (!finished)
+					finished = scan_motion(scan);
+			}
+
+			if (finished)
+			{
+				int motion = close_motion_scan(scan);
+				following = false;
+
+				if (m_Verbose)
+				{
+					std::lock_guard<std::mutex> guard(m_LogLock);
+					cout << result.trace << flush;
+				}
+
+				if (error)
+				{
+					LOG(LOG_WARNING, "Video file \"%s\" went away while it was being followed.",
+						segment.string().c_str());
+				}
+				else
+				{
+					filesystem::path new_path = motion_path(segment, motion);
+
+					system::error_code renamed;
+					filesystem::rename(segment, new_path, renamed);
+
+					if (renamed)
+					{
+						LOG(LOG_WARNING, "Could not rename video file \"%s\" (%s) after following it.",
+							segment.string().c_str(), renamed.message().c_str());
+					}
+					else
+					{
+						write_timeline(new_path, motion, result);
+
+						LOG(LOG_INFO, "Motion detection result for video file \"%s\" was %d. Followed while it was being written.",
+							segment.string().c_str(), motion);
+					}
+				}
+
+				system::error_code ignored;
+				filesystem::remove(tail_state_path(segment), ignored);
+			}
+			else
+			{
+				save_tail_state(segment, scan);
+			}
+		}
+
+		if (!following && !newest.empty() && newest != segment)
+		{
+			system::error_code error;
+			time_t modified = filesystem::last_write_time(newest, error);
+
+			if (!error && time(NULL) - modified < MOTION_MIN_AGE)
+			{
+				motioncheckpoint saved;
+				bool resume = load_tail_state(newest, saved);
+
+				// A segment that has only just been started may not have
+				// enough in it to be opened; just try again next time.
+				int status = open_motion_scan(scan, newest.string(), cam, detector, result,
+					true, resume ? &saved : NULL);
+
+				if (status == -2)
+				{
+					LOG(LOG_ERR, "Mask of camera \"%s\" does not match the size of video file \"%s\".",
+						cam.name.c_str(), newest.string().c_str());
+					segment = newest;
+				}
+				else if (status == 0)
+				{
+					if (m_Verbose)
+					{
+						LOG(LOG_DEBUG, "Following video file \"%s\"%s.", newest.string().c_str(),
+							resume ? " from where it was left off" : "");
+					}
+
+					segment = newest;
+					following = true;
+
+					save_tail_state(segment, scan);
+				}
+			}
+		}
+
+		sleep(m_TailInterval);
+	}
+
+	if (following)
+	{
+		// Pick up from here the next time.
+		save_tail_state(segment, scan);
+		close_motion_scan(scan);
+	}
+}
+
+bool directory_changed(const string& directory, struct timespec& seen)
+{
+	// Compares the modification time of a directory with the one seen
+	// before. Changes within the same tick of the clock could go unnoticed,
+	// so a directory modified just now always counts as changed.
+
+	struct stat st;
+
+	if (stat(directory.c_str(), &st) != 0)
+		return true;
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	bool changed = st.st_mtim.tv_sec != seen.tv_sec || st.st_mtim.tv_nsec != seen.tv_nsec ||
+		now.tv_sec - st.st_mtim.tv_sec <= 1;
+
+	seen = st.st_mtim;
+
+	return changed;
+}
+
+filesystem::path newest_recording(const camera& cam)
+{
+	// The most recently modified video file of a camera that has not had
+	// motion detection yet.
+
+	filesystem::path newest;
+	time_t newest_time = 0;
+
+	system::error_code error;
+	filesystem::directory_iterator dir(cam.destination, error), end;
+
+	for (; !error && dir != end; dir.increment(error))
+	{
+		const filesystem::path& cur_path = dir->path();
+
+		if (is_sidecar(cur_path) || cur_path.string().find("-MOTION") != string::npos)
+			continue;
+
+		system::error_code ignored;
+		time_t modification_time = filesystem::last_write_time(cur_path, ignored);
+
+		if (!ignored && modification_time >= newest_time)
+		{
+			newest = cur_path;
+			newest_time = modification_time;
+		}
+	}
+
+	return newest;
+}
+
+bool is_sidecar(const filesystem::path& path)
+{
+	return !is_recording_name(path.filename().string().c_str());
+}
+
+bool is_recording_name(const char* name)
+{
+	// Everything in a destination directory except for the files that
+	// maintenance keeps next to the videos
+
+	if (name[0] == '.')
+		return false;
+
+	const char* extension = strrchr(name, '.');
+
+	return extension == NULL || (strcmp(extension, TAIL_EXTENSION) != 0 &&
+		strcmp(extension, TIMELINE_EXTENSION) != 0 && strcmp(extension, ".tmp") != 0);
+}
+
+catalog* camera_catalog(const camera& cam, int& status)
+{
+	// The catalog of the recordings of a camera, brought up to date with
+	// what is in its destination directory; see catalog.cpp.
+
+	catalog& cat = m_Catalogs[cam.destination];
+
+	if (!cat.loaded && !catalog_load(cat, cam.destination))
+	{
+		LOG(LOG_NOTICE, "Catalog of \"%s\" is missing or unusable and will be rebuilt.",
+			cam.destination.c_str());
+
+		// The rebuilt catalog does not know which recordings the heatmap
+		// has counted already, so it is counted again from scratch.
+		m_StaleHeatmaps.insert(cam.destination);
+	}
+
+	string problem;
+	status = catalog_reconcile(cat, is_recording_name, forget_motion, (void*)&cam.destination, problem);
+
+	if (status == -1)
+	{
+		LOG(LOG_WARNING, "Could not read directory \"%s\" (%s).",
+			cam.destination.c_str(), strerror(errno));
+		return NULL;
+	}
+
+	if (status == -2)
+	{
+		LOG(LOG_WARNING, "Encountered a symbolic link (\"%s\").",
+			(filesystem::path(cam.destination) / problem).string().c_str());
+		return NULL;
+	}
+
+	if (m_Verbose)
+	{
+		LOG(LOG_DEBUG, "Catalog of \"%s\" has %zu recording(s); %lu file(s) had to be looked at.",
+			cam.destination.c_str(), cat.entries.size(), cat.statted);
+	}
+
+	count_motion(cam.destination, cat);
+
+	return &cat;
+}
+
+void publish_catalog(catalog& cat)
+{
+	// For the web interface; see catalog.cpp.
+
+	if (!catalog_publish(cat))
+	{
+		LOG(LOG_WARNING, "Could not publish catalog of \"%s\" (%s).",
+			cat.directory.c_str(), strerror(errno));
+		return;
+	}
+
+	// A recording that went without its timeline left the heatmap out of
+	// date; better to count it all again than to save it that way.
+	if (m_StaleHeatmaps.count(cat.directory) > 0)
+		count_motion(cat.directory, cat);
+
+	// Goes next to the index, so the directory has been made by now.
+	map<string, heatmap>::iterator cube = m_Heatmaps.find(cat.directory);
+
+	if (cube != m_Heatmaps.end() && !heatmap_save(cube->second))
+	{
+		LOG(LOG_WARNING, "Could not save heatmap of \"%s\" (%s).",
+			cat.directory.c_str(), strerror(errno));
+	}
+}
+
+void save_catalogs()
+{
+	for (map<string, catalog>::iterator it = m_Catalogs.begin(); it != m_Catalogs.end(); ++it)
+	{
+		if (!catalog_save(it->second))
+		{
+			LOG(LOG_WARNING, "Could not save catalog of \"%s\" (%s).",
+				it->first.c_str(), strerror(errno));
+		}
+
+		publish_catalog(it->second);
+	}
+}
+
+heatmap& camera_heatmap(const string& directory)
+{
+	// The heatmap of a camera, loaded if need be. One that cannot be
+	// loaded is rebuilt by count_motion().
+
+	heatmap& cube = m_Heatmaps[directory];
+
+	if (cube.loaded)
+		return cube;
+
+	const string filename = (filesystem::path(directory) / CATALOG_INDEX_DIRECTORY / HEATMAP_FILENAME).string();
+
+	if (!heatmap_load(cube, filename))
+	{
+		LOG(LOG_NOTICE, "Heatmap of \"%s\" is missing or unusable and will be rebuilt.",
+			directory.c_str());
+
+		m_StaleHeatmaps.insert(directory);
+	}
+
+	return cube;
+}
+
+void count_motion(const string& directory, catalog& cat)
+{
+	// Adds the recordings that motion detection is done with, but that are
+	// not in the heatmap yet. Normally, commit_motion() has seen to that
+	// already, so this only reads timelines when starting over.
+
+	heatmap& cube = camera_heatmap(directory);
+
+	if (m_StaleHeatmaps.erase(directory) > 0)
+	{
+		cube.first_day = 0;
+		cube.cells.clear();
+
+		for (map<string, catalogentry>::iterator it = cat.entries.begin(); it != cat.entries.end(); ++it)
+			it->second.flags &= ~CATALOG_COUNTED;
+	}
+
+	unsigned long counted = 0;
+
+	for (map<string, catalogentry>::iterator it = cat.entries.begin(); it != cat.entries.end(); ++it)
+	{
+		if (it->second.state != CATALOG_PROCESSED || (it->second.flags & CATALOG_COUNTED))
+			continue;
+
+		const filesystem::path video = filesystem::path(directory) / it->first;
+
+		timelineheader header;
+		vector<timelineentry> timeline;
+
+		// Without a timeline, there is nothing to count.
+		if (timeline_read(video.string() + TIMELINE_EXTENSION, header, timeline))
+			apply_motion(cube, header, timeline, true);
+
+		it->second.flags |= CATALOG_COUNTED;
+		counted++;
+	}
+
+	if (m_Verbose && counted > 0)
+	{
+		LOG(LOG_DEBUG, "Added %lu recording(s) to the heatmap of \"%s\".",
+			counted, directory.c_str());
+	}
+}
+
+void apply_motion(heatmap& cube, const timelineheader& header,
+	const vector<timelineentry>& timeline, bool add)
+{
+	// A recording is modified for the last time when it ends, which is
+	// what write_timeline() puts down as the time it was recorded.
+
+	if (header.recorded <= 0)
+		return;
+
+	heatmap_apply(cube, header.recorded - header.duration_ms / 1000, timeline, add);
+}
+
+void uncount_motion(const string& name, void* context)
+{
+	// Called by retention_delete() for every recording that goes, while its
+	// timeline is still there.
+
+	const string& directory = *(const string*)context;
+
+	map<string, catalogentry>::iterator entry = m_Catalogs[directory].entries.find(name);
+
+	if (entry == m_Catalogs[directory].entries.end() || !(entry->second.flags & CATALOG_COUNTED))
+		return;
+
+	if (!subtract_motion(directory, name))
+		m_StaleHeatmaps.insert(directory);
+
+	entry->second.flags &= ~CATALOG_COUNTED;
+}
+
+void forget_motion(const string& name, const catalogentry& entry, void* context)
+{
+	// Called by catalog_reconcile() for every recording that went some
+	// other way than through retention_delete(), e.g. by hand.
+
+	const string& directory = *(const string*)context;
+
+	if (!(entry.flags & CATALOG_COUNTED))
+		return;
+
+	if (!subtract_motion(directory, name))
+	{
+		if (m_StaleHeatmaps.insert(directory).second)
+		{
+			LOG(LOG_NOTICE, "Heatmap of \"%s\" is out of date and will be rebuilt.",
+				directory.c_str());
+		}
+	}
+}
+
+bool subtract_motion(const string& directory, const string& name)
+{
+	// Takes a recording out of the heatmap again. Without its timeline,
+	// that cannot be done, and the heatmap has to be rebuilt.
+
+	timelineheader header;
+	vector<timelineentry> timeline;
+
+	const string filename = (filesystem::path(directory) / name).string() + TIMELINE_EXTENSION;
+
+	if (!timeline_read(filename, header, timeline))
+		return false;
+
+	apply_motion(camera_heatmap(directory), header, timeline, false);
+
+	return true;
+}
+
+bool is_being_followed(const filesystem::path& video)
+{
+	// A follower saves its state every few seconds, so if it has not done
+	// so in a while, it has gone away and the file is up for grabs.
+
+	system::error_code error;
+	time_t saved = filesystem::last_write_time(tail_state_path(video), error);
+
+	return !error && time(NULL) - saved < MOTION_MIN_AGE;
+}
+
+filesystem::path tail_state_path(const filesystem::path& video)
+{
+	return filesystem::path(video.string() + TAIL_EXTENSION);
+}
+
+bool load_tail_state(const filesystem::path& video, motioncheckpoint& saved)
+{
+	property_tree::ptree pt;
+
+	try
+	{
+		property_tree::ini_parser::read_ini(tail_state_path(video).string(), pt);
+
+		saved.state.position = pt.get<double>("tail.position");
+		saved.state.motion = pt.get<int>("tail.motion");
+		saved.state.last_motion_at = pt.get<int>("tail.lastmotionat");
+		saved.state.sequence = pt.get<int>("tail.sequence");
+	}
+	catch (const property_tree::ptree_error&)
+	{
+		return false;
+	}
+
+	// The seconds analysed so far, as changes, frames and flags in
+	// hexadecimal, 14 digits each. Older state files do not have them.
+
+	const string timeline = pt.get<string>("tail.timeline", "");
+
+	saved.timeline.clear();
+	saved.timeline.reserve(timeline.size() / 14);
+
+	for (size_t i = 0; i + 14 <= timeline.size(); i += 14)
+	{
+		unsigned int changes, frames, flags;
+
+		if (sscanf(timeline.c_str() + i, "%8x%4x%2x", &changes, &frames, &flags) != 3)
+			break;
+
+		timelineentry entry;
+		memset(&entry, 0, sizeof(entry));
+
+		entry.changes = changes;
+		entry.frames = frames;
+		entry.flags = flags;
+
+		saved.timeline.push_back(entry);
+	}
+
+	return true;
+}
+
+void save_tail_state(const filesystem::path& video, const motionscan& scan)
+{
+	// Written under a temporary name and then renamed, so that a run that
+	// is killed halfway through leaves the previous state rather than one
+	// with a cut off timeline.
+
+	property_tree::ptree pt;
+
+	pt.put("tail.position", scan.state.position);
+	pt.put("tail.motion", scan.state.motion);
+	pt.put("tail.lastmotionat", scan.state.last_motion_at);
+	pt.put("tail.sequence", scan.state.sequence);
+
+	string timeline(scan.timeline.size() * 14, '0');
+	char digits[15];
+
+	for (size_t i = 0; i < scan.timeline.size(); i++)
+	{
+		snprintf(digits, sizeof(digits), "%08x%04x%02x", scan.timeline[i].changes,
+			scan.timeline[i].frames, scan.timeline[i].flags);
+		timeline.replace(i * 14, 14, digits, 14);
+	}
+
+	pt.put("tail.timeline", timeline);
+
+	const string filename = tail_state_path(video).string();
+	const string temporary = filename + ".tmp";
+
+	try
+	{
+		property_tree::ini_parser::write_ini(temporary, pt);
+	}
+	catch (const property_tree::ptree_error &e)
+	{
+		LOG(LOG_WARNING, "Could not save how far motion detection got with video file \"%s\" (%s).",
+			video.string().c_str(), e.what());
+
+		unlink(temporary.c_str());
+		return;
+	}
+
+	if (rename(temporary.c_str(), filename.c_str()) != 0)
+	{
+		LOG(LOG_WARNING, "Could not save how far motion detection got with video file \"%s\" (%s).",
+			video.string().c_str(), strerror(errno));
+
+		unlink(temporary.c_str());
+	}
+}
+
+filesystem::path motion_path(const filesystem::path& video, int motion)
+{
+	// Where a video file goes once motion detection has found "motion"
+	// instances of motion in it.
+
+	char* filename_buffer = NULL;
+
+	asprintf(&filename_buffer, "%s-MOTION-%d%s",
+		video.stem().string().c_str(),
+		motion,
+		video.extension().string().c_str());
+
+	filesystem::path new_path =
+		video.parent_path() / filesystem::path(filename_buffer);
+
+	free(filename_buffer);
+
+	return new_path;
+}
+
+void write_timeline(const filesystem::path& video, int motion, const motionresult& result)
+{
+	// Puts the per-second results next to the (renamed) video file; see
+	// timeline.cpp.
+
+	timelineheader header;
+	timeline_header(header, result.timeline);
+
+	header.motion = motion;
+	header.duration_ms = (uint32_t)lround(result.duration * 1000);
+	header.analysed = result.analysed;
+
+	system::error_code ignored;
+	header.recorded = filesystem::last_write_time(video, ignored);
+
+	const string filename = video.string() + TIMELINE_EXTENSION;
+
+	if (!timeline_write(filename, header, result.timeline))
+	{
+		LOG(LOG_WARNING, "Could not write motion timeline \"%s\" (%s).",
+			filename.c_str(), strerror(errno));
+	}
+}
+
+void handle_signal(int signum)
+{
+	if (signum == SIGTERM || signum == SIGINT)
+		m_Terminate = true;
+}
+
+void load_settings(const string& filename)
+{
+	if (!filesystem::exists(filename))
+	{
+		LOG(LOG_CRIT, "Configuration file \"%s\" not found.\n", filename.c_str());
+		exit(1);
+	}
+
+	property_tree::ptree pt;
+
+	try
+	{
+		property_tree::ini_parser::read_ini(filename, pt);
+	}
+	catch (const property_tree::ini_parser::ini_parser_error &e)
+	{
+		LOG(LOG_CRIT, "Configuration file \"%s\" parse error on line %ld (%s)\n",
+			e.filename().c_str(), e.line(), e.message().c_str());
+		exit(1);
+	}
+
+	string cameras, motionorder;
+
+	try
+	{
+		m_Delete = pt.get<bool>("maintenance.delete");
+		m_Motion = pt.get<bool>("maintenance.motion");
+		m_Workers = pt.get<int>("maintenance.workers", 0);
+		m_PipelineDepth = pt.get<int>("maintenance.pipelinedepth", 8);
+		m_TailInterval = pt.get<int>("maintenance.tailinterval", 2);
+		m_SweepInterval = pt.get<int>("maintenance.sweepinterval", 900);
+		m_MaxRuntime = pt.get<int>("maintenance.maxruntime", 0);
+		motionorder = pt.get<string>("maintenance.motionorder", "oldest");
+		m_MaxDiskUsage = pt.get<double>("maintenance.maxdiskusage", 0);
+		m_MinFreeBytes = parse_size(trim_copy(pt.get<string>("maintenance.minfreebytes", "")));
+		cameras = pt.get<string>("maintenance.cameras");
+	}
+	catch (const property_tree::ptree_error &e)
+	{
+		LOG(LOG_CRIT, "Configuration is invalid! Reason: %s\n", e.what());
+		exit(1);
+	}
+
+	if (m_Workers <= 0)
+		m_Workers = max(1u, std::thread::hardware_concurrency());
 
-	string cameras;
+	if (m_PipelineDepth < 0)
+		m_PipelineDepth = 0;
 
-	try
+	if (m_TailInterval <= 0)
+		m_TailInterval = 1;
+
+	if (m_SweepInterval <= 0)
+		m_SweepInterval = 60;
+
+	if (!motionschedule_parse_order(trim_copy(motionorder), m_MotionOrder))
 	{
-		m_Delete = pt.get<bool>("maintenance.delete");
-		m_Motion = pt.get<bool>("maintenance.motion");
-		cameras = pt.get<string>("maintenance.cameras");
+		LOG(LOG_CRIT, "Configuration is invalid! Reason: motionorder must be oldest or newest.\n");
+		exit(1);
 	}
-	catch (const property_tree::ptree_error &e)
+
+	if (m_MaxDiskUsage < 0 || m_MaxDiskUsage >= 100 || m_MinFreeBytes == (uintmax_t)-1)
 	{
-		LOG(LOG_CRIT, "Configuration is invalid! Reason: %s\n", e.what());
+		LOG(LOG_CRIT, "Configuration is invalid! Reason: maxdiskusage must be between 0 and 100 and minfreebytes must be a size like 500G.\n");
 		exit(1);
 	}
 
@@ -334,15 +1962,23 @@ void load_settings(const string& filename)
 	for (vector<string>::iterator el = cameras_split.begin() ; el != cameras_split.end(); ++el)
 	{
 		int deleteafterdays, motionsensitivity, motionmaxdeviation, motioncontinuation;
+		int motioncontinuationms, motionanalysisscale, retentionmindays;
+		double motionanalysisfps, retentionweight, motionpriority;
 		string motionmaskbitmap, destination;
 		Mat motionmask;
 
 		try
 		{
 			deleteafterdays = pt.get<int>(*el + ".deleteafterdays");
+			retentionweight = pt.get<double>(*el + ".retentionweight", 1);
+			retentionmindays = pt.get<int>(*el + ".retentionmindays", 0);
+			motionpriority = pt.get<double>(*el + ".motionpriority", 1);
 			motionsensitivity = pt.get<int>(*el + ".motionsensitivity");
 			motionmaxdeviation = pt.get<int>(*el + ".motionmaxdeviation");
-			motioncontinuation = pt.get<int>(*el + ".motioncontinuation");
+			motioncontinuation = pt.get<int>(*el + ".motioncontinuation", -1);
+			motioncontinuationms = pt.get<int>(*el + ".motioncontinuationms", -1);
+			motionanalysisscale = pt.get<int>(*el + ".motionanalysisscale", 1);
+			motionanalysisfps = pt.get<double>(*el + ".motionanalysisfps", 0);
 			motionmaskbitmap = pt.get<string>(*el + ".motionmaskbitmap");
 			destination = pt.get<string>(*el + ".destination");
 		}
@@ -355,6 +1991,35 @@ void load_settings(const string& filename)
 		trim(motionmaskbitmap);
 		trim(destination);
 
+		if (retentionweight <= 0 || retentionmindays < 0)
+		{
+			LOG(LOG_CRIT, "Configuration is invalid! Reason: camera \"%s\" retentionweight must be positive and retentionmindays must not be negative.\n",
+				(*el).c_str());
+			exit(1);
+		}
+
+		if (motionpriority <= 0)
+		{
+			LOG(LOG_CRIT, "Configuration is invalid! Reason: camera \"%s\" motionpriority must be positive.\n",
+				(*el).c_str());
+			exit(1);
+		}
+
+		if (motioncontinuation < 0 && motioncontinuationms < 0)
+		{
+			LOG(LOG_CRIT, "Configuration is invalid! Reason: camera \"%s\" is missing motioncontinuationms.\n",
+				(*el).c_str());
+			exit(1);
+		}
+
+		if (motionanalysisscale != 1 && motionanalysisscale != 2 &&
+			motionanalysisscale != 4 && motionanalysisscale != 8)
+		{
+			LOG(LOG_CRIT, "Configuration is invalid! Reason: camera \"%s\" motionanalysisscale must be 1, 2, 4 or 8.\n",
+				(*el).c_str());
+			exit(1);
+		}
+
 		if (!motionmaskbitmap.empty())
 		{
 			if (!filesystem::exists(motionmaskbitmap))
@@ -391,75 +2056,376 @@ void load_settings(const string& filename)
 		camera cam;
 
 		cam.deleteafterdays = deleteafterdays;
+		cam.retentionweight = retentionweight;
+		cam.retentionmindays = retentionmindays;
+		cam.motionpriority = motionpriority;
+		cam.motionquality = 0;
 		cam.motionsensitivity = motionsensitivity;
 		cam.motionmaxdeviation = motionmaxdeviation;
 		cam.motioncontinuation = motioncontinuation;
+		cam.motioncontinuationms = motioncontinuationms;
+		cam.motionanalysisscale = motionanalysisscale;
+		cam.motionanalysisfps = motionanalysisfps;
 		cam.name = *el;
 		cam.destination = destination;
-		cam.mask = motionmask;
+
+		if (!prepare_camera(cam, motionmask))
+		{
+			LOG(LOG_WARNING, "Mask file \"%s\" excludes everything; camera \"%s\" will never have motion.",
+				motionmaskbitmap.c_str(), (*el).c_str());
+		}
+
+		cam.settings = camera_settings(cam);
 
 		m_Cameras.push_back(cam);
 	}
 }
 
-int video_motion_detection(const string& videofile, const camera& cam)
+uintmax_t parse_size(const string& value)
+{
+	// A number of bytes, optionally followed by K, M, G or T (powers of
+	// 1024). Nothing at all is 0. Returns (uintmax_t)-1 if it is not one.
+
+	if (value.empty())
+		return 0;
+
+	char* end = NULL;
+	errno = 0;
+
+	uintmax_t size = strtoumax(value.c_str(), &end, 10);
+
+	if (errno != 0 || end == value.c_str() || value[0] == '-')
+		return (uintmax_t)-1;
+
+	int shift = 0;
+
+	switch (toupper(*end))
+	{
+		case 'T': shift = 40; end++; break;
+		case 'G': shift = 30; end++; break;
+		case 'M': shift = 20; end++; break;
+		case 'K': shift = 10; end++; break;
+	}
+
+	if (*end != '\0' || (shift > 0 && size > (UINTMAX_MAX >> shift)))
+		return (uintmax_t)-1;
+
+	return size << shift;
+}
+
+bool prepare_camera(camera& cam, const Mat& motionmask)
+{
+	// Works out what to analyse from the black and white mask (if any)
+	// and the motion detection settings of a camera. Returns false if the
+	// mask excludes everything.
+
+	bool success = true;
+
+	cam.mask = motionmask;
+	cam.roi = Rect();
+	cam.analysismask.release();
+
+	if (!motionmask.empty())
+	{
+		// Nothing outside the bounding box of the white area can ever
+		// have motion, so only that part of every frame is analysed.
+		Rect roi = boundingRect(motionmask);
+
+		if (roi.empty())
+		{
+			success = false;
+			roi = Rect(0, 0, motionmask.cols, motionmask.rows);
+		}
+
+		// Eroding looks at the pixels above and to the left, so keep
+		// one masked row and column there to get identical results.
+		if (roi.x > 0)
+		{
+			roi.x--;
+			roi.width++;
+		}
+
+		if (roi.y > 0)
+		{
+			roi.y--;
+			roi.height++;
+		}
+
+		Mat levels[MOTION_PYRAMID_LEVELS];
+		shrink_for_analysis(motionmask(roi), cam.analysismask, cam.motionanalysisscale, levels);
+		cam.analysismask = cam.analysismask > 128;
+
+		cam.roi = roi;
+	}
+
+	// Shrinking the frame shrinks the number of changed pixels, too.
+	cam.analysissensitivity = (int)lround(cam.motionsensitivity /
+		(double)(cam.motionanalysisscale * cam.motionanalysisscale));
+
+	return success;
+}
+
+uint16_t camera_settings(const camera& cam)
+{
+	// A fingerprint of the mask and the motion detection settings of a
+	// camera, so that the catalog can tell whether a recording failed
+	// with the settings the camera has now. 0 is left for "unknown".
+
+	uint32_t hash = 2166136261u; // FNV-1a
+
+	const int values[] = { cam.motionsensitivity, cam.motionmaxdeviation, cam.motioncontinuation,
+		cam.motioncontinuationms, cam.motionanalysisscale, (int)lround(cam.motionanalysisfps * 1000),
+		cam.mask.cols, cam.mask.rows };
+
+	for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+	{
+		hash ^= (uint32_t)values[i];
+		hash *= 16777619u;
+	}
+
+	for (int y = 0; y < cam.mask.rows; y++)
+	{
+		const uchar* row = cam.mask.ptr(y);
+
+		for (int x = 0; x < cam.mask.cols; x++)
+		{
+			hash ^= row[x];
+			hash *= 16777619u;
+		}
+	}
+
+	const uint16_t settings = (uint16_t)(hash ^ (hash >> 16));
+
+	return settings != 0 ? settings : 1;
+}
+
+int video_motion_detection(const string& videofile, const camera& cam,
+	motiondetector& detector, motionresult& result, bool checkpoint)
 {
-	VideoCapture capture = VideoCapture(videofile);
+	// The decoder hands out the Y plane of every frame, which is all the
+	// detector needs; see lumadecoder.cpp. With several workers, each one
+	// decodes on a single thread.
+	//
+	// With "checkpoint", how far it got is saved every so often next to
+	// the file, and a run that was interrupted is picked up from there.
+	//
+	// Returns how many times there was motion, -1 if the file could not
+	// be read, and -2 if the mask of the camera does not fit it.
+
+	motionscan scan;
+	motioncheckpoint saved;
+
+	const bool resume = checkpoint && load_tail_state(videofile, saved);
+
+	switch (open_motion_scan(scan, videofile, cam, detector, result, false, resume ? &saved : NULL))
+	{
+		case -1:
+			LOG(LOG_ERR, "Video file \"%s\" could not be read.", videofile.c_str());
+			return -1;
+		case -2:
+			LOG(LOG_ERR, "Mask of camera \"%s\" does not match the size of video file \"%s\".",
+				cam.name.c_str(), videofile.c_str());
+			return -2;
+	}
 
-	if (!capture.isOpened())
+	if (resume && m_Verbose)
 	{
-		LOG(LOG_ERR, "Video file \"%s\" could not be read.", videofile.c_str());
+		LOG(LOG_DEBUG, "Resuming motion detection of video file \"%s\" at %.1f second(s).",
+			videofile.c_str(), saved.state.position / 1000);
+	}
+
+	scan.checkpoint = checkpoint;
+	scan.checkpointed = monotonic_seconds();
+
+	while (!scan_motion(scan))
+		;
+
+	return close_motion_scan(scan);
+}
+
+int open_motion_scan(motionscan& scan, const string& videofile, const camera& cam,
+	motiondetector& detector, motionresult& result, bool follow, const motioncheckpoint* resume)
+{
+	// Gets a video file ready for scan_motion(). Returns -1 if the file
+	// cannot be read and -2 if the mask does not fit, 0 otherwise. Files
+	// that are followed are decoded on the calling thread, and a scan can
+	// pick up from the state of an earlier one.
+
+	lumadecoder& capture = scan.capture;
+
+	if (!lumadecoder_open(capture, videofile, m_Workers > 1 ? 1 : 0))
 		return -1;
+
+	lumadecoder_follow(capture, follow);
+
+	scan.videofile = videofile;
+	scan.detector = &detector;
+	scan.result = &result;
+
+	// Verbose output is collected per file and printed once the result is
+	// committed, otherwise the output of parallel workers would interleave.
+	scan.trace.str("");
+
+	// With "motionanalysisfps" set below the frame rate of the video, only
+	// the frames closest to that rate are analysed. The others still have
+	// to be decoded, but codecs with B-frames can skip those entirely.
+
+	const double fps = capture.fps > 0 ? capture.fps : 25;
+
+	framesampler& sampler = scan.sampler;
+
+	sampler.interval = 0;
+	sampler.tolerance = 500.0 / fps;
+	sampler.next_due = 0;
+	sampler.skip_until = resume != NULL ? resume->state.position : -1;
+
+	double analysis_fps = cam.motionanalysisfps > 0 && cam.motionanalysisfps < fps ?
+		cam.motionanalysisfps : 0;
+
+	// See degrade_camera()
+	if (cam.motionquality >= 1)
+		analysis_fps = (analysis_fps > 0 ? analysis_fps : fps) / 2;
+
+	if (analysis_fps > 0)
+	{
+		sampler.interval = 1000.0 / analysis_fps;
+
+		if (analysis_fps * 2 <= fps)
+			lumadecoder_skip_nonref(capture);
+	}
+
+	const double analysed_fps = sampler.interval > 0 ? analysis_fps : fps;
+
+	// How many analysed frames in a row must have changes to be motion
+	const double continuation_ms = cam.motioncontinuationms >= 0 ?
+		cam.motioncontinuationms : cam.motioncontinuation * 1000.0 / fps;
+
+	scan.continuation = max(1, (int)lround(continuation_ms * analysed_fps / 1000.0));
+
+	const Size frame_size(capture.width, capture.height);
+
+	if (!cam.mask.empty() && cam.mask.size() != frame_size)
+	{
+		lumadecoder_close(capture);
+		return -2;
+	}
+
+	// Rather than decoding everything an earlier scan has already been
+	// through, start at the keyframe before where it stopped. Files that
+	// are still being written are not seeked in.
+	if (resume != NULL && !follow && resume->state.position > 0)
+		lumadecoder_seek(capture, resume->state.position);
+
+	const int depth = follow ? 0 : m_PipelineDepth;
+
+	prepare_detector(detector, cam, frame_size, depth);
+
+	result.frames = 0;
+	result.analysed = 0;
+	result.duration = 0;
+	result.allocations = 0;
+	result.full_stalls = 0;
+	result.empty_stalls = 0;
+
+	// pixels, the size of the whole frame at the analysis scale.
+	scan.pixels = analysis_size(frame_size, cam.motionanalysisscale).area();
+
+	if (resume != NULL)
+	{
+		scan.state = resume->state;
+	}
+	else
+	{
+		scan.state.position = 0;
+		scan.state.motion = 0;
+		scan.state.last_motion_at = 0;
+		scan.state.sequence = 0;
 	}
 
-	Mat prev_frame, current_frame, next_frame;
+	scan.window = 0;
+	scan.filled = false;
+	scan.released = false;
+	scan.steady = false;
+	scan.allocations = 0;
+	scan.checkpoint = false;
+	scan.checkpointed = 0;
+
+	// Roughly one entry per second of video
+	scan.timeline.clear();
+
+	if (capture.format->duration > 0)
+		scan.timeline.reserve(capture.format->duration / AV_TIME_BASE + 1);
+
+	if (resume != NULL)
+		scan.timeline.insert(scan.timeline.end(), resume->timeline.begin(), resume->timeline.end());
+
+	// With "pipelinedepth" set, a second thread decodes up to that many
+	// frames ahead while this one analyses. Otherwise, frames are decoded
+	// here whenever the analysis needs the next one.
+
+	framesource& source = scan.source;
 
-	capture >> prev_frame;
-	cvtColor(prev_frame, prev_frame, COLOR_RGB2GRAY);
-	try_apply_mask(prev_frame, cam.mask);
+	source.capture = &capture;
+	source.cam = &cam;
+	source.sampler = &sampler;
+	source.detector = &detector;
+	source.result = &result;
+	source.pipelined = depth > 0;
 
-	capture >> current_frame;
-	cvtColor(current_frame, current_frame, COLOR_RGB2GRAY);
-	try_apply_mask(current_frame, cam.mask);
+	if (source.pipelined)
+		scan.decoder = std::thread(decode_frames, source);
 
-	capture >> next_frame;
-	cvtColor(next_frame, next_frame, COLOR_RGB2GRAY);
-	try_apply_mask(next_frame, cam.mask);
+	return 0;
+}
+
+bool scan_motion(motionscan& scan)
+{
+	// Analyses frames for as long as there are any. Returns true at the end
+	// of the video, or false if a followed file has no new frames yet.
 
-	// d1 and d2 for calculating the differences
-	// number_of_changes, the amount of changes in the result matrix.
+	framequeue& queue = scan.detector->queue;
+	const camera& cam = *scan.source.cam;
+	motionstate& state = scan.state;
+	ostringstream& trace = scan.trace;
 
-	Mat erode_kernel = getStructuringElement(MORPH_RECT, Size(2,2));
+	if (!scan.filled)
+	{
+		if (!wait_for_frame(scan.source, MOTION_RING - 1))
+			return !scan.capture.starved;
 
-	int return_value = 0;
-	int last_motion_at = 0;
-	int number_of_sequence = 0;
+		scan.filled = true;
+	}
 
-	Mat d1, d2, motion;
+	// The queue holds the previous, current, and next frame, starting at
+	// frame number "window". Moving on by one frame releases the oldest.
 
-	while (capture.grab())
+	for (;;)
 	{
-		prev_frame.release();
-		prev_frame = current_frame;
-		current_frame = next_frame;
+		if (!scan.released)
+		{
+			framequeue_release(queue);
+			scan.window++;
+			scan.released = true;
+		}
 
-		capture.retrieve(next_frame);
-		cvtColor(next_frame, next_frame, COLOR_RGB2GRAY);
-		try_apply_mask(next_frame, cam.mask);
+		// Every so often, so that an interrupted run can pick up from the
+		// last frame analysed; see video_motion_detection().
+		if (scan.checkpoint && monotonic_seconds() - scan.checkpointed >= MOTION_CHECKPOINT_INTERVAL)
+		{
+			save_tail_state(scan.videofile, scan);
+			scan.checkpointed = monotonic_seconds();
+		}
 
-		// Calculate the difference between the images and then do a bitwise AND.
-		// Apply threshold and erode so that low differences, e.g. contrast change
-		// due to sunlight or falling rain, are ignored.
+		if (!wait_for_frame(scan.source, scan.window + 2))
+			return !scan.capture.starved;
 
-		absdiff(prev_frame, next_frame, d1);
-		absdiff(next_frame, current_frame, d2);
-		bitwise_and(d1, d2, motion);
+		scan.released = false;
 
-		d1.release();
-		d2.release();
+		const Mat& prev_frame = framequeue_at(queue, scan.window);
+		const Mat& current_frame = framequeue_at(queue, scan.window + 1);
+		const Mat& next_frame = framequeue_at(queue, scan.window + 2);
 
-		threshold(motion, motion, 35, 255, THRESH_BINARY);
-		erode(motion, motion, erode_kernel);
+		state.position = framequeue_position(queue, scan.window + 2);
 
 		/*
 		 * The verbose output here will be something like
@@ -476,7 +2442,7 @@ int video_motion_detection(const string& videofile, const camera& cam)
 		 *
 		 * If the 'C' number is greater than the "motionsensitivity"
 		 * setting, the program will start counting the frame sequence
-		 * ("motioncontinuation" setting) and you will get an 'S' with
+		 * ("motioncontinuationms" setting) and you will get an 'S' with
 		 * two numbers; the first is the current number of frames that
 		 * had had enough changed pixels. The second is how many frames
 		 * with enough changes in pixels must occur in total before
@@ -504,74 +2470,119 @@ int video_motion_detection(const string& videofile, const camera& cam)
 		 * motion detection settings made in the "camsrv.ini" file.
 		 */
 
-		int number_of_changes =
-			detect_motion(motion, cam.motionmaxdeviation);
+		// Buffers may still grow while the first frames go through; after
+		// that, analysing a frame must not allocate anything. See the file
+		// alloccounter.cpp.
+
+		const unsigned long allocated = allocation_count();
+
+		int number_of_changes = detect_motion(prev_frame, current_frame, next_frame,
+			cam, scan.pixels, scan.detector->scratch);
+
+		if (scan.steady)
+			scan.allocations += allocation_count() - allocated;
+
+		scan.steady = true;
+
+		if (m_Verbose) trace << 'C' << number_of_changes << ',';
+
+		timelineentry& second = timeline_at(scan.timeline, (size_t)(state.position / 1000));
 
-		motion.release();
+		second.changes = max(second.changes, (uint32_t)number_of_changes);
 
-		if (m_Verbose) cout << 'C' << number_of_changes << ',' << flush;
+		if (second.frames < UINT16_MAX)
+			second.frames++;
 
 		// If there are not enough changes over a large enough number of
 		// frames, do not consider it to be motion. Otherwise, consider
 		// it to be motiom and act on it.
 
-		if(number_of_changes < cam.motionsensitivity)
+		if(number_of_changes < cam.analysissensitivity)
 		{
-			if (number_of_sequence != 0)
+			if (state.sequence != 0)
 			{
-				if (m_Verbose) cout << "A," << flush;
-				number_of_sequence = 0;
+				if (m_Verbose) trace << "A,";
+				state.sequence = 0;
 			}
 
 			continue;
 		}
 
-		number_of_sequence++;
+		state.sequence++;
+		second.flags |= TIMELINE_ACTIVE;
 
-		if (m_Verbose) cout << 'S' << number_of_sequence << '/' << cam.motioncontinuation << ',' << flush;
+		if (m_Verbose) trace << 'S' << state.sequence << '/' << scan.continuation << ',';
 
-		if(number_of_sequence >= cam.motioncontinuation)
+		if(state.sequence >= scan.continuation)
 		{
-			int pos = capture.get(CAP_PROP_POS_MSEC) / 1000;
+			int pos = state.position / 1000;
 
-			if (pos > last_motion_at)
+			if (pos > state.last_motion_at)
 			{
-				return_value++;
-				last_motion_at = pos;
+				state.motion++;
+				state.last_motion_at = pos;
+				second.flags |= TIMELINE_MOTION;
 
-				if (m_Verbose) cout << endl << "--- MOTION AT " << pos << "s --- " << endl;
+				if (m_Verbose) trace << endl << "--- MOTION AT " << pos << "s --- " << endl;
 			}
 		}
 	}
+}
+
+int close_motion_scan(motionscan& scan)
+{
+	// Stops the scan and returns how many times there was motion.
+
+	finish_frames(scan.source, scan.decoder);
+
+	motionresult& result = *scan.result;
+	framequeue& queue = scan.detector->queue;
+
+	result.duration = scan.capture.pos_msec / 1000.0;
+	result.allocations += scan.allocations;
+	result.full_stalls = queue.full_stalls;
+	result.empty_stalls = queue.empty_stalls;
+	result.timeline.swap(scan.timeline);
+
+	if (m_Verbose)
+	{
+		scan.trace << endl;
+		result.trace = scan.trace.str();
+	}
 
-	if (m_Verbose) cout << endl;
+	lumadecoder_close(scan.capture);
 
-	prev_frame.release();
-	current_frame.release();
-	next_frame.release();
-	capture.release();
+	if (!scan.filled)
+	{
+		LOG(LOG_WARNING, "Video file \"%s\" is too short for motion detection.", scan.videofile.c_str());
+		return 0;
+	}
 
-	return return_value;
+	return scan.state.motion;
 }
 
-inline int detect_motion(const Mat& frame, int maxdeviation)
+inline int detect_motion(const Mat& prev, const Mat& current, const Mat& next,
+	const camera& cam, int pixels, vector<uchar>& scratch)
 {
-	// Check if there is motion, count the number of changes and return.
+	// Calculate the difference between the images and then do a bitwise AND.
+	// Apply threshold and erode so that low differences, e.g. contrast change
+	// due to sunlight or falling rain, are ignored. The mask is applied along
+	// the way. See motionkernel.cpp for how this is done in a single sweep.
 
-	// calculate the standard deviation
-	Scalar mean, stddev;
-	meanStdDev(frame, mean, stddev);
+	int number_of_changes = motion_changes(prev, current, next, cam.analysismask, scratch);
 
 	// If the activity is spread all throughout the image, then it must
 	// must not be genuine motion, but instead something like sun glare,
-	// branches moving in the wind, or heavy snowfall.
-	if(stddev[0] > maxdeviation)
+	// branches moving in the wind, or heavy snowfall. Everything outside
+	// of the analysed area counts as unchanged.
+	if (motion_stddev(number_of_changes, pixels) > cam.motionmaxdeviation)
 		return 0;
 
-	return countNonZero(frame == 255);
+	return number_of_changes;
 
-	/* The old code below is slower than using OpenCV's built-in way
-	 * by about four seconds in verbose mode.
+	/* This used to be meanStdDev() followed by countNonZero(frame == 255),
+	 * and before that, the code below, which was even slower by about four
+	 * seconds in verbose mode.
 	 *
 	 * It also produces slightly different results (number_of_changes
 	 * is a little smaller), since it is wrongly incrementing by 2,
@@ -598,28 +2609,212 @@ inline int detect_motion(const Mat& frame, int maxdeviation)
 	 */
 }
 
-inline void try_apply_mask(Mat& matrix, Mat mask)
+void prepare_detector(motiondetector& detector, const camera& cam, Size frame, int depth)
 {
-	// Compare with makemask.cpp
+	// Without a pipeline, unscaled analysis frames are just headers pointing
+	// into the decoder's frames. The decoder only keeps the last few of
+	// those alive, though, so with a pipeline, and for scaled frames, they
+	// are written into the queue's own buffers instead. These are only
+	// reallocated when a camera with a different analysis size comes along.
 
-	if (mask.empty()) return;
+	framequeue& queue = detector.queue;
 
-	Mat tmp;
-	matrix.copyTo(tmp, mask);
-	matrix.release();
-	matrix = tmp;
+	if (framequeue_reset(queue, MOTION_RING + depth))
+		detector.buffered = Size();
 
-	/*
-	 * Old code, slower since OpenCV can magically parallelize this
-	 * by using Intel Thread Building Blocks:
-	 *
-	 * for(int row = 0; row < matrix.rows; row++)
-	 * 	for(int col = 0; col < matrix.cols; col++)
-	 * 	{
-	 * 		uchar pixel = mask.at<uchar>(row, col);
-	 * 		if (pixel == 0) matrix.at<uchar>(row, col) = 0;
-	 * 	}
-	 */
+	detector.copies = depth > 0 || cam.motionanalysisscale > 1;
+
+	if (!detector.copies)
+	{
+		for (size_t i = 0; i < queue.slots.size(); i++)
+			queue.slots[i].release();
+
+		detector.buffered = Size();
+		return;
+	}
+
+	const Size analysed = analysis_size(cam.roi.empty() ? frame : cam.roi.size(),
+		cam.motionanalysisscale);
+
+	if (detector.buffered == analysed)
+		return;
+
+	for (size_t i = 0; i < queue.slots.size(); i++)
+	{
+		queue.slots[i].release();
+		queue.slots[i].create(analysed, CV_8UC1);
+	}
+
+	detector.buffered = analysed;
+}
+
+void decode_frames(framesource source)
+{
+	// Decoding thread of a pipeline; runs until the end of the file or
+	// until the analysis stops early.
+
+	while (decode_frame(source))
+		;
+
+	framequeue_finish(source.detector->queue);
+}
+
+bool decode_frame(framesource& source)
+{
+	// Decodes the next analysis frame into the queue.
+
+	framequeue& queue = source.detector->queue;
+
+	Mat* slot = framequeue_reserve(queue);
+
+	if (slot == NULL)
+		return false;
+
+	if (!next_analysis_frame(*source.capture, *source.cam, *source.sampler,
+		*source.detector, *slot, *source.result))
+	{
+		return false;
+	}
+
+	framequeue_commit(queue, source.capture->pos_msec);
+
+	return true;
+}
+
+bool wait_for_frame(framesource& source, unsigned long index)
+{
+	// Returns true once frame "index" is in the queue, or false if the
+	// file has fewer frames than that.
+
+	framequeue& queue = source.detector->queue;
+
+	if (source.pipelined)
+		return framequeue_wait(queue, index);
+
+	while (queue.written <= index)
+	{
+		if (!decode_frame(source))
+			return false;
+	}
+
+	return true;
+}
+
+void finish_frames(framesource& source, std::thread& decoder)
+{
+	// Stops the decoding thread, if any, before the decoder is closed.
+
+	if (decoder.joinable())
+	{
+		framequeue_close(source.detector->queue);
+		decoder.join();
+	}
+}
+
+bool next_analysis_frame(lumadecoder& capture, const camera& cam, framesampler& sampler,
+	motiondetector& detector, Mat& frame, motionresult& result)
+{
+	// Decode until a frame is due for analysis. Frames in between must be
+	// decoded as later frames depend on them, but they are never looked at.
+
+	while (lumadecoder_grab(capture))
+	{
+		result.frames++;
+
+		// Frames an earlier scan has already looked at
+		if (capture.pos_msec <= sampler.skip_until)
+			continue;
+
+		if (sampler.interval > 0)
+		{
+			if (capture.pos_msec < sampler.next_due - sampler.tolerance)
+				continue;
+
+			sampler.next_due += sampler.interval;
+
+			if (sampler.next_due <= capture.pos_msec)
+				sampler.next_due = capture.pos_msec + sampler.interval;
+		}
+
+		const unsigned long allocations = allocation_count();
+
+		Mat luma;
+
+		if (!lumadecoder_retrieve(capture, luma) || !analysis_frame(luma, cam, detector, frame))
+			return false;
+
+		if (result.analysed > MOTION_RING)
+			result.allocations += allocation_count() - allocations;
+
+		result.analysed++;
+
+		return true;
+	}
+
+	return false;
+}
+
+inline bool analysis_frame(const Mat& luma, const camera& cam, motiondetector& detector, Mat& frame)
+{
+	// Cut the bounding box of the mask out of the frame (which does not
+	// copy anything) and shrink it if the camera is set up for that.
+
+	if (luma.empty())
+		return false;
+
+	const Mat area = cam.roi.empty() ? luma : luma(cam.roi);
+
+	if (detector.copies && cam.motionanalysisscale == 1)
+		area.copyTo(frame);
+	else
+		shrink_for_analysis(area, frame, cam.motionanalysisscale, detector.pyramid);
+
+	return true;
+}
+
+void shrink_for_analysis(const Mat& src, Mat& dst, int scale, Mat* levels)
+{
+	// Every step of the image pyramid halves width and height. The steps in
+	// between go to "levels", so their memory is reused for the next frame.
+
+	if (scale == 1)
+	{
+		dst = src;
+		return;
+	}
+
+	Mat level = src;
+
+	for (int i = 0; scale > 2; scale /= 2, i++)
+	{
+		assert(i < MOTION_PYRAMID_LEVELS);
+
+		pyrDown(level, levels[i]);
+		level = levels[i];
+	}
+
+	pyrDown(level, dst);
+}
+
+Size analysis_size(Size frame, int scale)
+{
+	// Same rounding as pyrDown()
+
+	for (; scale > 1; scale /= 2)
+	{
+		frame.width = (frame.width + 1) / 2;
+		frame.height = (frame.height + 1) / 2;
+	}
+
+	return frame;
+}
+
+double monotonic_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
 void LOG(int priority, const char *format, ...)
@@ -649,6 +2844,9 @@ void LOG(int priority, const char *format, ...)
 		default:			loglevel = "UNKNOWN";	break;
 	}
 
+	// Workers log too, so keep the pieces of a line together.
+	std::lock_guard<std::mutex> guard(m_LogLock);
+
 	printf("%s: ", loglevel.c_str());
 
 	va_list arglist;
@@ -16,14 +16,26 @@
 #ifndef MAINTENANCE_HPP
 #define MAINTENANCE_HPP
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <sstream>
 #include <string>
+#include <thread>
 
 #include <assert.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <syslog.h>
 #include <time.h>
+#include <sys/inotify.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/wait.h>
 
 #include <boost/filesystem.hpp>
@@ -32,11 +44,50 @@
 
 #include <opencv2/opencv.hpp>
 
+#include "alloccounter.hpp"
+#include "catalog.hpp"
+#include "framequeue.hpp"
+#include "heatmap.hpp"
 #include "locking.hpp"
+#include "lumadecoder.hpp"
+#include "motionkernel.hpp"
+#include "motionschedule.hpp"
+#include "retention.hpp"
+#include "timeline.hpp"
+#include "unlinkqueue.hpp"
 
 #define LOCKFILE "/var/lock/camsrvd-maintenance.pid"
+#define LOCKFILE_TAIL "/var/lock/camsrvd-maintenance-tail.pid"
 #define SYSLOG_IDENT "camsrv-maintenance"
 
+// Video files modified more recently than this are still being recorded
+#define MOTION_MIN_AGE 60
+
+// Saved state of a video file that is being followed (-t), or that motion
+// detection was interrupted on
+#define TAIL_EXTENSION ".tail"
+
+// How often (in seconds) motion detection saves how far it got with a file
+#define MOTION_CHECKPOINT_INTERVAL 10
+
+// How often motion detection may fail on a file before it is left alone; a
+// file may fail because it was still being finalised, or for want of file
+// descriptors, and then do fine the next time.
+#define MOTION_ATTEMPTS 3
+
+// Ways to analyse a recording more cheaply, for when a run would otherwise
+// take longer than "maxruntime": 0 is as configured, 1 analyses half as
+// many frames, and 2 also analyses them at half the resolution.
+#define MOTION_QUALITY_LEVELS 3
+
+// Analysis frames looked at the same time (prev, current, next). Without a
+// pipeline, the decoder keeps exactly as many frames alive for the queue to
+// point into.
+#define MOTION_RING LUMADECODER_FRAMES
+
+// Intermediate images for motionanalysisscale 4 and 8
+#define MOTION_PYRAMID_LEVELS 2
+
 using namespace std;
 using namespace boost;
 using namespace cv;
@@ -44,21 +95,212 @@ using namespace cv;
 typedef struct maintenancecamera
 {
 	int deleteafterdays;
+	double retentionweight;
+	int retentionmindays;
+	double motionpriority;
+	int motionquality;
 	int motionsensitivity;
 	int motionmaxdeviation;
 	int motioncontinuation;
+	int motioncontinuationms;
+	int motionanalysisscale;
+	double motionanalysisfps;
+	int analysissensitivity;
 	string name;
 	string destination;
 	Mat mask;
+	Rect roi;
+	Mat analysismask;
+	uint16_t settings;
 } camera;
 
+typedef struct budgetcandidate
+{
+	double age;
+	camera* cam;
+	const string* name;
+	int64_t size;
+} budgetcandidate;
+
+typedef struct motionresult
+{
+	unsigned long frames;
+	unsigned long analysed;
+	double duration;
+	unsigned long allocations;
+	unsigned long full_stalls;
+	unsigned long empty_stalls;
+	vector<timelineentry> timeline;
+	string trace;
+} motionresult;
+
+typedef struct motiondetector
+{
+	framequeue queue;
+	Size buffered;
+	bool copies;
+	Mat pyramid[MOTION_PYRAMID_LEVELS];
+	vector<uchar> scratch;
+} motiondetector;
+
+typedef struct framesampler
+{
+	double interval;
+	double tolerance;
+	double next_due;
+	double skip_until;
+} framesampler;
+
+typedef struct framesource
+{
+	lumadecoder* capture;
+	const camera* cam;
+	framesampler* sampler;
+	motiondetector* detector;
+	motionresult* result;
+	bool pipelined;
+} framesource;
+
+typedef struct motionstate
+{
+	double position;
+	int motion;
+	int last_motion_at;
+	int sequence;
+} motionstate;
+
+typedef struct motioncheckpoint
+{
+	motionstate state;
+	vector<timelineentry> timeline;
+} motioncheckpoint;
+
+typedef struct motionscan
+{
+	string videofile;
+	lumadecoder capture;
+	framesampler sampler;
+	framesource source;
+	std::thread decoder;
+	motiondetector* detector;
+	motionresult* result;
+	motionstate state;
+	bool checkpoint;
+	double checkpointed;
+	int continuation;
+	int pixels;
+	unsigned long window;
+	bool filled;
+	bool released;
+	bool steady;
+	unsigned long allocations;
+	vector<timelineentry> timeline;
+	ostringstream trace;
+} motionscan;
+
+typedef struct motionjob
+{
+	filesystem::path path;
+	camera cam;
+	time_t modified;
+	uintmax_t size;
+	int quality;
+	int motion;
+	motionresult result;
+	double elapsed;
+	bool done;
+} motionjob;
+
+typedef struct motionqueue
+{
+	vector<motionjob> jobs;
+	vector<uintmax_t> remaining;
+	double deadline;
+	int workers;
+	double spent[MOTION_QUALITY_LEVELS];
+	double analysed[MOTION_QUALITY_LEVELS];
+	std::atomic<size_t> next;
+	std::atomic<bool> cancel;
+	std::mutex lock;
+	std::condition_variable completed;
+} motionqueue;
+
+typedef struct daemonqueue
+{
+	motionschedule order;
+	map<size_t, motionjob> pending;
+	size_t tickets;
+	set<string> queued;
+	bool stop;
+	std::mutex lock;
+	std::condition_variable available;
+} daemonqueue;
+
 int main (int argc, char* const argv[]);
 void exit_usage(const char* argv0);
 void do_delete();
+void enforce_disk_budget(uint& processed, uintmax_t& totalbytes);
+bool younger_candidate(const budgetcandidate& a, const budgetcandidate& b);
 void do_motion();
+void collect_motion_jobs(vector<motionjob>& jobs);
+motionjob new_motion_job(const filesystem::path& path, const camera& cam, time_t modified);
+bool commit_motion(const motionjob& job);
+bool quarantine_motion(const motionjob& job);
+void misfit_motion(const motionjob& job);
+bool retry_motion(catalogentry& entry, const camera& cam);
+void motion_worker(motionqueue& queue);
+int plan_motion_quality(motionqueue& queue, size_t index);
+void degrade_camera(camera& cam, int quality);
+void do_daemon();
+void sweep(daemonqueue& queue);
+void report_deletes();
+void enqueue_motion_job(daemonqueue& queue, const motionjob& job);
+void daemon_worker(daemonqueue& queue);
+void do_tail();
+void tail_camera(camera cam);
+bool directory_changed(const string& directory, struct timespec& seen);
+filesystem::path newest_recording(const camera& cam);
+bool is_sidecar(const filesystem::path& path);
+bool is_recording_name(const char* name);
+catalog* camera_catalog(const camera& cam, int& status);
+void publish_catalog(catalog& cat);
+void save_catalogs();
+heatmap& camera_heatmap(const string& directory);
+void count_motion(const string& directory, catalog& cat);
+void apply_motion(heatmap& cube, const timelineheader& header,
+	const vector<timelineentry>& timeline, bool add);
+void uncount_motion(const string& name, void* context);
+void forget_motion(const string& name, const catalogentry& entry, void* context);
+bool subtract_motion(const string& directory, const string& name);
+bool is_being_followed(const filesystem::path& video);
+filesystem::path tail_state_path(const filesystem::path& video);
+bool load_tail_state(const filesystem::path& video, motioncheckpoint& saved);
+void save_tail_state(const filesystem::path& video, const motionscan& scan);
+filesystem::path motion_path(const filesystem::path& video, int motion);
+void write_timeline(const filesystem::path& video, int motion, const motionresult& result);
+void handle_signal(int signum);
 void load_settings(const string& filename);
-int video_motion_detection(const string& videofile, const camera& cam);
-int detect_motion(const Mat& frame, int max_deviation);
-void try_apply_mask(Mat& matrix, Mat mask);
+uintmax_t parse_size(const string& value);
+bool prepare_camera(camera& cam, const Mat& motionmask);
+uint16_t camera_settings(const camera& cam);
+int video_motion_detection(const string& videofile, const camera& cam,
+	motiondetector& detector, motionresult& result, bool checkpoint);
+int open_motion_scan(motionscan& scan, const string& videofile, const camera& cam,
+	motiondetector& detector, motionresult& result, bool follow, const motioncheckpoint* resume);
+bool scan_motion(motionscan& scan);
+int close_motion_scan(motionscan& scan);
+int detect_motion(const Mat& prev, const Mat& current, const Mat& next,
+	const camera& cam, int pixels, vector<uchar>& scratch);
+void prepare_detector(motiondetector& detector, const camera& cam, Size frame, int depth);
+void decode_frames(framesource source);
+bool decode_frame(framesource& source);
+bool wait_for_frame(framesource& source, unsigned long index);
+void finish_frames(framesource& source, std::thread& decoder);
+bool next_analysis_frame(lumadecoder& capture, const camera& cam, framesampler& sampler,
+	motiondetector& detector, Mat& frame, motionresult& result);
+bool analysis_frame(const Mat& luma, const camera& cam, motiondetector& detector, Mat& frame);
+void shrink_for_analysis(const Mat& src, Mat& dst, int scale, Mat* levels);
+Size analysis_size(Size frame, int scale);
+double monotonic_seconds();
 void LOG(int priority, const char *format, ...);
 #endif
@@ -43,12 +43,10 @@ int main(int argc, char* const argv[])
 
 	bool success = true;
 
-	VideoCapture capture;
+	lumadecoder capture;
 	Mat frame, mask;
 
-	capture = VideoCapture(input_file);
-
-	if (!capture.isOpened())
+	if (!lumadecoder_open(capture, input_file, 0))
 	{
 		printf("Error: Video file \"%s\" could not be opened.\n", input_file.c_str());
 		exit(1);
@@ -72,7 +70,15 @@ int main(int argc, char* const argv[])
 	}
 
 	printf("Extracting first frame...");
-	capture >> frame;
+
+	if (!lumadecoder_grab(capture) || !lumadecoder_retrieve(capture, frame))
+	{
+		printf(" failed.\n");
+		printf("Error: Video file \"%s\" contains no frames.\n", input_file.c_str());
+		success = false;
+		goto done;
+	}
+
 	printf(" OK.\n");
 
 	if (mask.empty())
@@ -83,7 +89,6 @@ int main(int argc, char* const argv[])
 	}
 
 	printf("Applying mask to first frame...");
-	cvtColor(frame, frame, COLOR_RGB2GRAY);
 	try_apply_mask(frame, mask);
 	printf(" OK.\n");
 
@@ -93,14 +98,14 @@ int main(int argc, char* const argv[])
 done:
 	frame.release();
 	mask.release();
-	capture.release();
+	lumadecoder_close(capture);
 
 	return success ? 0 : 1;
 }
 
 inline void try_apply_mask(Mat& matrix, Mat mask)
 {
-	// Compare with maintenance.cpp
+	// Compare with motionkernel.cpp
 
 	if (mask.empty()) return;
 
@@ -10,6 +10,8 @@
 #include <boost/filesystem.hpp>
 #include <opencv2/opencv.hpp>
 
+#include "lumadecoder.hpp"
+
 using namespace std;
 using namespace boost;
 using namespace cv;
@@ -0,0 +1,369 @@
+/*
+ * motionkernel - Fused Three-Frame Differencing for Motion Detection
+ *
+ * This does the same as the old OpenCV chain in motion_changes_reference(),
+ * which was absdiff() twice, bitwise_and(), threshold(), erode() with a 2x2
+ * rectangle, and finally countNonZero(). Every one of those is a full sweep
+ * over the frame and most of them allocate a temporary frame, which adds up
+ * quickly with 4K video.
+ *
+ * Here every row of the three frames is only read once. The thresholded
+ * row goes into a small scratch buffer that stays in the L1 cache, and a
+ * second pass over that buffer erodes and counts it. The counts are exactly
+ * the same as the ones of the OpenCV chain, which is kept around to check.
+ *
+ */
+
+#include "motionkernel.hpp"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+typedef void (*binarize_row_fn)(const uchar* p, const uchar* c, const uchar* n,
+	const uchar* m, uchar* out, int cols);
+typedef int (*erode_row_fn)(const uchar* b, const uchar* hprev, uchar* hcur, int cols);
+
+static void binarize_row_scalar(const uchar* p, const uchar* c, const uchar* n,
+	const uchar* m, uchar* out, int from, int cols)
+{
+	// out = ((|prev - next| & |next - current|) > threshold) ? 255 : 0,
+	// but only where the mask (if any) includes the pixel.
+
+	for (int x = from; x < cols; x++)
+	{
+		int d1 = abs((int)p[x] - (int)n[x]);
+		int d2 = abs((int)n[x] - (int)c[x]);
+
+		uchar b = ((d1 & d2) > MOTION_THRESHOLD) ? 255 : 0;
+
+		if (m != NULL && m[x] == 0)
+			b = 0;
+
+		out[x] = b;
+	}
+}
+
+static int erode_row_scalar(const uchar* b, const uchar* hprev, uchar* hcur, int from, int cols)
+{
+	// erode() with a 2x2 kernel and the default anchor takes the minimum
+	// of the pixel, its left, upper and upper left neighbour. Pixels beyond
+	// the border are ignored, so b[-1] and the row above the first one are
+	// all 255 in the scratch buffer.
+
+	int count = 0;
+
+	for (int x = from; x < cols; x++)
+	{
+		uchar h = b[x] & b[x - 1];
+		hcur[x] = h;
+
+		if ((h & hprev[x]) == 255)
+			count++;
+	}
+
+	return count;
+}
+
+static void binarize_row_plain(const uchar* p, const uchar* c, const uchar* n,
+	const uchar* m, uchar* out, int cols)
+{
+	binarize_row_scalar(p, c, n, m, out, 0, cols);
+}
+
+static int erode_row_plain(const uchar* b, const uchar* hprev, uchar* hcur, int cols)
+{
+	return erode_row_scalar(b, hprev, hcur, 0, cols);
+}
+
+#if defined(__SSE2__)
+static void binarize_row_sse2(const uchar* p, const uchar* c, const uchar* n,
+	const uchar* m, uchar* out, int cols)
+{
+	const __m128i threshold = _mm_set1_epi8((char)MOTION_THRESHOLD);
+	const __m128i zero = _mm_setzero_si128();
+
+	int x = 0;
+
+	for (; x + 16 <= cols; x += 16)
+	{
+		__m128i vp = _mm_loadu_si128((const __m128i*)(p + x));
+		__m128i vc = _mm_loadu_si128((const __m128i*)(c + x));
+		__m128i vn = _mm_loadu_si128((const __m128i*)(n + x));
+
+		__m128i d1 = _mm_or_si128(_mm_subs_epu8(vp, vn), _mm_subs_epu8(vn, vp));
+		__m128i d2 = _mm_or_si128(_mm_subs_epu8(vn, vc), _mm_subs_epu8(vc, vn));
+
+		// 0xFF where the difference is at or below the threshold
+		__m128i below = _mm_cmpeq_epi8(_mm_subs_epu8(_mm_and_si128(d1, d2), threshold), zero);
+
+		if (m != NULL)
+			below = _mm_or_si128(below, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(m + x)), zero));
+
+		_mm_storeu_si128((__m128i*)(out + x), _mm_andnot_si128(below, _mm_set1_epi8((char)0xFF)));
+	}
+
+	binarize_row_scalar(p, c, n, m, out, x, cols);
+}
+
+static int erode_row_sse2(const uchar* b, const uchar* hprev, uchar* hcur, int cols)
+{
+	int count = 0;
+	int x = 0;
+
+	for (; x + 16 <= cols; x += 16)
+	{
+		__m128i h = _mm_and_si128(_mm_loadu_si128((const __m128i*)(b + x)),
+			_mm_loadu_si128((const __m128i*)(b + x - 1)));
+
+		_mm_storeu_si128((__m128i*)(hcur + x), h);
+
+		__m128i e = _mm_and_si128(h, _mm_loadu_si128((const __m128i*)(hprev + x)));
+
+		count += __builtin_popcount(_mm_movemask_epi8(e));
+	}
+
+	return count + erode_row_scalar(b, hprev, hcur, x, cols);
+}
+
+__attribute__((target("avx2")))
+static void binarize_row_avx2(const uchar* p, const uchar* c, const uchar* n,
+	const uchar* m, uchar* out, int cols)
+{
+	const __m256i threshold = _mm256_set1_epi8((char)MOTION_THRESHOLD);
+	const __m256i zero = _mm256_setzero_si256();
+
+	int x = 0;
+
+	for (; x + 32 <= cols; x += 32)
+	{
+		__m256i vp = _mm256_loadu_si256((const __m256i*)(p + x));
+		__m256i vc = _mm256_loadu_si256((const __m256i*)(c + x));
+		__m256i vn = _mm256_loadu_si256((const __m256i*)(n + x));
+
+		__m256i d1 = _mm256_or_si256(_mm256_subs_epu8(vp, vn), _mm256_subs_epu8(vn, vp));
+		__m256i d2 = _mm256_or_si256(_mm256_subs_epu8(vn, vc), _mm256_subs_epu8(vc, vn));
+
+		__m256i below = _mm256_cmpeq_epi8(_mm256_subs_epu8(_mm256_and_si256(d1, d2), threshold), zero);
+
+		if (m != NULL)
+			below = _mm256_or_si256(below, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(m + x)), zero));
+
+		_mm256_storeu_si256((__m256i*)(out + x), _mm256_andnot_si256(below, _mm256_set1_epi8((char)0xFF)));
+	}
+
+	binarize_row_scalar(p, c, n, m, out, x, cols);
+}
+
+__attribute__((target("avx2,popcnt")))
+static int erode_row_avx2(const uchar* b, const uchar* hprev, uchar* hcur, int cols)
+{
+	int count = 0;
+	int x = 0;
+
+	for (; x + 32 <= cols; x += 32)
+	{
+		__m256i h = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(b + x)),
+			_mm256_loadu_si256((const __m256i*)(b + x - 1)));
+
+		_mm256_storeu_si256((__m256i*)(hcur + x), h);
+
+		__m256i e = _mm256_and_si256(h, _mm256_loadu_si256((const __m256i*)(hprev + x)));
+
+		count += __builtin_popcount((unsigned int)_mm256_movemask_epi8(e));
+	}
+
+	return count + erode_row_scalar(b, hprev, hcur, x, cols);
+}
+#endif
+
+typedef struct motionkernel
+{
+	binarize_row_fn binarize_row;
+	erode_row_fn erode_row;
+	const char* name;
+} motionkernel;
+
+// scalar, SSE2 and AVX2
+#define MOTION_KERNELS 3
+
+static int list_kernels(motionkernel* kernels)
+{
+	// Every kernel this CPU can run, the fastest last.
+
+	int count = 0;
+
+	kernels[count].binarize_row = binarize_row_plain;
+	kernels[count].erode_row = erode_row_plain;
+	kernels[count++].name = "scalar";
+
+#if defined(__SSE2__)
+	kernels[count].binarize_row = binarize_row_sse2;
+	kernels[count].erode_row = erode_row_sse2;
+	kernels[count++].name = "SSE2";
+
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+	{
+		kernels[count].binarize_row = binarize_row_avx2;
+		kernels[count].erode_row = erode_row_avx2;
+		kernels[count++].name = "AVX2";
+	}
+#endif
+
+	return count;
+}
+
+static motionkernel select_kernel()
+{
+	motionkernel kernels[MOTION_KERNELS];
+	return kernels[list_kernels(kernels) - 1];
+}
+
+static motionkernel& active_kernel()
+{
+	static motionkernel kernel = select_kernel();
+	return kernel;
+}
+
+int motion_changes(const Mat& prev, const Mat& current, const Mat& next,
+	const Mat& mask, vector<uchar>& scratch)
+{
+	// Returns how many pixels survive differencing, threshold and erosion.
+
+	assert(prev.type() == CV_8UC1 && prev.size() == current.size() && prev.size() == next.size());
+	assert(mask.empty() || mask.size() == prev.size());
+
+	const motionkernel& kernel = active_kernel();
+
+	const int rows = prev.rows;
+	const int cols = prev.cols;
+
+	// One thresholded row with a leading border byte, plus two rows of the
+	// horizontally eroded result (the current and the one above it).
+	const size_t stride = (size_t)cols + 1;
+
+	if (scratch.size() < stride * 3)
+		scratch.resize(stride * 3);
+
+	uchar* b = &scratch[0] + 1;
+	uchar* hprev = &scratch[stride];
+	uchar* hcur = &scratch[stride * 2];
+
+	b[-1] = 255;
+	memset(hprev, 255, cols);
+
+	int count = 0;
+
+	for (int y = 0; y < rows; y++)
+	{
+		kernel.binarize_row(prev.ptr(y), current.ptr(y), next.ptr(y),
+			mask.empty() ? NULL : mask.ptr(y), b, cols);
+
+		count += kernel.erode_row(b, hprev, hcur, cols);
+
+		swap(hprev, hcur);
+	}
+
+	return count;
+}
+
+int motion_changes_reference(const Mat& prev, const Mat& current, const Mat& next,
+	const Mat& mask)
+{
+	// The original chain of OpenCV calls, kept to verify motion_changes().
+
+	Mat motion;
+	motion_reference_frame(prev, current, next, mask, motion);
+
+	return countNonZero(motion == 255);
+}
+
+void motion_reference_frame(const Mat& prev, const Mat& current, const Mat& next,
+	const Mat& mask, Mat& motion)
+{
+	// The thresholded and eroded frame of motion_changes_reference(), which
+	// the standard deviation used to be worked out from; see motion_stddev().
+
+	Mat p, c, n;
+
+	if (mask.empty())
+	{
+		p = prev;
+		c = current;
+		n = next;
+	}
+	else
+	{
+		prev.copyTo(p, mask);
+		current.copyTo(c, mask);
+		next.copyTo(n, mask);
+	}
+
+	Mat d1, d2;
+
+	absdiff(p, n, d1);
+	absdiff(n, c, d2);
+	bitwise_and(d1, d2, motion);
+
+	threshold(motion, motion, MOTION_THRESHOLD, 255, THRESH_BINARY);
+	erode(motion, motion, getStructuringElement(MORPH_RECT, Size(2,2)));
+}
+
+double motion_stddev(int changes, int pixels)
+{
+	// After thresholding there are only 0 and 255 in the frame, so the
+	// mean and standard deviation follow from the number of changes.
+	// This is the same arithmetic that meanStdDev() uses.
+
+	if (pixels <= 0)
+		return 0;
+
+	const double scale = 1.0 / pixels;
+	const double mean = changes * 255.0 * scale;
+	const double sqmean = changes * (255.0 * 255.0) * scale;
+
+	return sqrt(max(sqmean - mean * mean, 0.0));
+}
+
+const char* motion_kernel_name()
+{
+	return active_kernel().name;
+}
+
+const char* motion_kernel_available(int index)
+{
+	// The name of the index-th kernel this CPU can run, or NULL past the
+	// last one; see motion_use_kernel().
+
+	motionkernel kernels[MOTION_KERNELS];
+
+	if (index < 0 || index >= list_kernels(kernels))
+		return NULL;
+
+	return kernels[index].name;
+}
+
+bool motion_use_kernel(const char* name)
+{
+	// Makes motion_changes() use another kernel than the fastest one, for
+	// checking them all (see check_motion.cpp). Not safe while other
+	// threads detect motion. Returns false if this CPU cannot run it.
+
+	motionkernel kernels[MOTION_KERNELS];
+	const int count = list_kernels(kernels);
+
+	for (int i = 0; i < count; i++)
+	{
+		if (strcmp(kernels[i].name, name) == 0)
+		{
+			active_kernel() = kernels[i];
+			return true;
+		}
+	}
+
+	return false;
+}
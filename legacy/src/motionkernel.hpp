@@ -0,0 +1,31 @@
+/*
+ * motionkernel - Fused Three-Frame Differencing for Motion Detection
+ *
+ */
+
+#ifndef MOTIONKERNEL_HPP
+#define MOTIONKERNEL_HPP
+
+#include <vector>
+
+#include <math.h>
+
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+using namespace cv;
+
+// Values at or below this difference are ignored (sunlight, rain, noise).
+#define MOTION_THRESHOLD 35
+
+int motion_changes(const Mat& prev, const Mat& current, const Mat& next,
+	const Mat& mask, vector<uchar>& scratch);
+int motion_changes_reference(const Mat& prev, const Mat& current, const Mat& next,
+	const Mat& mask);
+void motion_reference_frame(const Mat& prev, const Mat& current, const Mat& next,
+	const Mat& mask, Mat& motion);
+double motion_stddev(int changes, int pixels);
+const char* motion_kernel_name();
+const char* motion_kernel_available(int index);
+bool motion_use_kernel(const char* name);
+#endif
@@ -0,0 +1,113 @@
+/*
+ * motionschedule - Order in which Recordings are Analysed
+ *
+ * Recordings used to be analysed strictly oldest first across all cameras.
+ * A backlog on one busy camera then held up every other camera, and the
+ * latest recordings, which are the ones people look at, came last.
+ *
+ * Instead, every camera gets a lane of its own, in which its recordings
+ * wait either oldest or newest first. The lanes take turns by smooth
+ * weighted round-robin: on every turn, each lane with something waiting
+ * earns credit in proportion to its weight, the lane with the most credit
+ * goes and pays for it with the weights of all of those lanes. A camera
+ * with twice the weight of another gets twice as many turns while both
+ * have a backlog, its turns are spread out evenly rather than bunched up,
+ * and a camera with nothing waiting does not save up credit for later.
+ *
+ * What is scheduled are just numbers; the caller knows what they stand for.
+ *
+ */
+
+#include "motionschedule.hpp"
+
+#include <strings.h>
+
+void motionschedule_init(motionschedule& schedule, int order)
+{
+	schedule.order = order;
+	schedule.lanes.clear();
+	schedule.names.clear();
+	schedule.pending = 0;
+}
+
+size_t motionschedule_lane(motionschedule& schedule, const string& name, double weight)
+{
+	// The lane of a camera, made on first use. Weights must be positive.
+
+	map<string, size_t>::iterator it = schedule.names.find(name);
+
+	if (it != schedule.names.end())
+	{
+		schedule.lanes[it->second].weight = weight;
+		return it->second;
+	}
+
+	motionlane lane;
+
+	lane.name = name;
+	lane.weight = weight;
+	lane.credit = 0;
+
+	schedule.lanes.push_back(lane);
+	schedule.names[name] = schedule.lanes.size() - 1;
+
+	return schedule.lanes.size() - 1;
+}
+
+void motionschedule_push(motionschedule& schedule, size_t lane, time_t modified, size_t item)
+{
+	schedule.lanes[lane].waiting.insert(make_pair(modified, item));
+	schedule.pending++;
+}
+
+bool motionschedule_pop(motionschedule& schedule, size_t& item)
+{
+	// The next item to go, or false if nothing is waiting.
+
+	if (schedule.pending == 0)
+		return false;
+
+	motionlane* best = NULL;
+	double total = 0;
+
+	for (vector<motionlane>::iterator lane = schedule.lanes.begin(); lane != schedule.lanes.end(); ++lane)
+	{
+		if (lane->waiting.empty())
+		{
+			lane->credit = 0;
+			continue;
+		}
+
+		lane->credit += lane->weight;
+		total += lane->weight;
+
+		if (best == NULL || lane->credit > best->credit)
+			best = &*lane;
+	}
+
+	best->credit -= total;
+
+	multimap<time_t, size_t>::iterator next = best->waiting.begin();
+
+	if (schedule.order == MOTIONSCHEDULE_NEWEST)
+		next = --best->waiting.end();
+
+	item = next->second;
+
+	best->waiting.erase(next);
+	schedule.pending--;
+
+	return true;
+}
+
+bool motionschedule_parse_order(const string& value, int& order)
+{
+	if (strcasecmp(value.c_str(), "oldest") == 0)
+		order = MOTIONSCHEDULE_OLDEST;
+	else if (strcasecmp(value.c_str(), "newest") == 0)
+		order = MOTIONSCHEDULE_NEWEST;
+	else
+		return false;
+
+	return true;
+}
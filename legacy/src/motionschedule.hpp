@@ -0,0 +1,43 @@
+/*
+ * motionschedule - Order in which Recordings are Analysed
+ *
+ */
+
+#ifndef MOTIONSCHEDULE_HPP
+#define MOTIONSCHEDULE_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+#include <time.h>
+
+using namespace std;
+
+// Which recordings of a camera go first
+#define MOTIONSCHEDULE_OLDEST 0
+#define MOTIONSCHEDULE_NEWEST 1
+
+typedef struct motionlane
+{
+	string name;
+	double weight;
+	double credit;
+	multimap<time_t, size_t> waiting;
+} motionlane;
+
+typedef struct motionschedule
+{
+	int order;
+	vector<motionlane> lanes;
+	map<string, size_t> names;
+	size_t pending;
+} motionschedule;
+
+void motionschedule_init(motionschedule& schedule, int order);
+size_t motionschedule_lane(motionschedule& schedule, const string& name, double weight);
+void motionschedule_push(motionschedule& schedule, size_t lane, time_t modified, size_t item);
+bool motionschedule_pop(motionschedule& schedule, size_t& item);
+bool motionschedule_parse_order(const string& value, int& order);
+#endif
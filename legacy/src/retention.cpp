@@ -0,0 +1,275 @@
+/*
+ * retention - Deleting Old Recordings
+ *
+ * Deletes the recordings of a directory that the catalog says are expired,
+ * and the files maintenance keeps next to them. On a large array of slow
+ * disks, this used to take minutes, because every file was resolved by its
+ * full path several times over (is it a link, how old is it, how big is it,
+ * delete it).
+ *
+ * Instead, everything here works relative to one open file descriptor of the
+ * directory:
+ *
+ * - The directory is read with getdents64() in large chunks, which gives
+ *   names and inode numbers without touching any of the files.
+ *
+ * - Expired recordings are processed in the order of their inode numbers,
+ *   which on most file systems is roughly the order of their inodes on disk,
+ *   so the disk does not have to seek back and forth as much.
+ *
+ * - Every recording is checked once more with statx() before it goes, in
+ *   case it was modified since the catalog last saw it, and then removed
+ *   with unlinkat().
+ *
+ * - Files next to a recording are only removed if the listing says they
+ *   are there.
+ *
+ * The actual deleting can also be left to an unlinkqueue, see there.
+ *
+ */
+
+#include "retention.hpp"
+
+#include <algorithm>
+#include <unordered_set>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+// Older C libraries do not declare this.
+struct linux_dirent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+#define RETENTION_BUFFER (64 * 1024)
+
+static double elapsed_since(const struct timespec& start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static bool by_inode(const retentionfile& a, const retentionfile& b)
+{
+	return a.inode < b.inode;
+}
+
+static int file_status(int dirfd, const char* name, bool& regular, bool& link,
+	time_t& mtime, uintmax_t& size)
+{
+	// Returns 0 or an errno.
+
+#ifdef STATX_BASIC_STATS
+	struct statx st;
+
+	if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_MTIME | STATX_SIZE, &st) != 0)
+		return errno;
+
+	regular = S_ISREG(st.stx_mode);
+	link = S_ISLNK(st.stx_mode);
+	mtime = st.stx_mtime.tv_sec;
+	size = st.stx_size;
+#else
+	struct stat st;
+
+	if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+		return errno;
+
+	regular = S_ISREG(st.st_mode);
+	link = S_ISLNK(st.st_mode);
+	mtime = st.st_mtime;
+	size = st.st_size;
+#endif
+
+	return 0;
+}
+
+int retention_delete(const string& directory, const set<string>& expired, time_t cutoff,
+	const char* const* extensions, unlinkqueue* queue, retentionhook deleting, void* context,
+	retentionresult& result)
+{
+	// Deletes the recordings named in "expired" that were last modified
+	// before "cutoff", plus any file named like one of them followed by one
+	// of the (NULL terminated) "extensions". Returns 0 on success, -1 if
+	// the directory cannot be read, or -2 if a symbolic link was found
+	// (its name goes to result.problem); nothing is deleted after that.
+	//
+	// With a "queue", files are only handed to it rather than deleted right
+	// away, and result.bytes says how much will be freed once it is done.
+	//
+	// "deleting", if given, is called with "context" for every recording
+	// that goes, before the files next to it do.
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	result.deleted.clear();
+	result.sidecars = 0;
+	result.kept = 0;
+	result.failed = 0;
+	result.bytes = 0;
+	result.elapsed = 0;
+	result.problem.clear();
+
+	if (expired.empty())
+		return 0;
+
+	int dirfd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (dirfd < 0)
+		return -1;
+
+	int queuefd = -1;
+
+	if (queue != NULL)
+	{
+		queuefd = unlinkqueue_directory(*queue, directory);
+
+		if (queuefd < 0)
+		{
+			close(dirfd);
+			return -1;
+		}
+	}
+
+	vector<retentionfile> victims;
+	unordered_set<string> sidecars;
+	vector<char> buffer(RETENTION_BUFFER);
+
+	for (;;)
+	{
+		long length = syscall(SYS_getdents64, dirfd, &buffer[0], buffer.size());
+
+		if (length < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			close(dirfd);
+			return -1;
+		}
+
+		if (length == 0)
+			break;
+
+		for (long offset = 0; offset < length; )
+		{
+			const struct linux_dirent64* ent = (const struct linux_dirent64*)&buffer[offset];
+			offset += ent->d_reclen;
+
+			if (expired.count(ent->d_name) != 0)
+			{
+				retentionfile file;
+
+				file.name = ent->d_name;
+				file.inode = ent->d_ino;
+
+				victims.push_back(file);
+			}
+			else if (strchr(ent->d_name, '.') != NULL)
+			{
+				for (const char* const* extension = extensions; *extension != NULL; extension++)
+				{
+					size_t name_length = strlen(ent->d_name);
+					size_t extension_length = strlen(*extension);
+
+					if (name_length > extension_length &&
+						strcmp(ent->d_name + name_length - extension_length, *extension) == 0)
+					{
+						sidecars.insert(ent->d_name);
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	sort(victims.begin(), victims.end(), by_inode);
+
+	int status = 0;
+
+	for (vector<retentionfile>::iterator victim = victims.begin(); victim != victims.end(); ++victim)
+	{
+		bool regular = false;
+		bool link = false;
+		time_t mtime = 0;
+		uintmax_t size = 0;
+
+		int error = file_status(dirfd, victim->name.c_str(), regular, link, mtime, size);
+
+		// Gone already, which is just as good; the files next to it
+		// still go, and "deleting" is still told.
+		const bool gone = error == ENOENT;
+
+		if (error != 0 && !gone)
+		{
+			result.failed++;
+			continue;
+		}
+
+		if (link)
+		{
+			result.problem = victim->name;
+			status = -2;
+			break;
+		}
+
+		if (!gone && (!regular || mtime >= cutoff))
+		{
+			result.kept++;
+			continue;
+		}
+
+		if (gone)
+		{
+			// Nothing to delete
+		}
+		else if (queue != NULL)
+		{
+			unlinkqueue_push(*queue, queuefd, victim->name, size);
+		}
+		else if (unlinkat(dirfd, victim->name.c_str(), 0) != 0 && errno != ENOENT)
+		{
+			result.failed++;
+			continue;
+		}
+
+		result.deleted.push_back(victim->name);
+		result.bytes += size;
+
+		if (deleting != NULL)
+			deleting(victim->name, context);
+
+		for (const char* const* extension = extensions; *extension != NULL; extension++)
+		{
+			const string sidecar = victim->name + *extension;
+
+			if (sidecars.count(sidecar) == 0)
+				continue;
+
+			if (queue != NULL)
+				unlinkqueue_push(*queue, queuefd, sidecar, 0);
+			else if (unlinkat(dirfd, sidecar.c_str(), 0) != 0)
+				continue;
+
+			result.sidecars++;
+		}
+	}
+
+	close(dirfd);
+
+	result.elapsed = elapsed_since(start);
+
+	return status;
+}
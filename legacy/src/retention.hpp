@@ -0,0 +1,44 @@
+/*
+ * retention - Deleting Old Recordings
+ *
+ */
+
+#ifndef RETENTION_HPP
+#define RETENTION_HPP
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <time.h>
+
+#include "unlinkqueue.hpp"
+
+using namespace std;
+
+typedef struct retentionfile
+{
+	string name;
+	uint64_t inode;
+} retentionfile;
+
+typedef struct retentionresult
+{
+	vector<string> deleted;
+	unsigned long sidecars;
+	unsigned long kept;
+	unsigned long failed;
+	uintmax_t bytes;
+	double elapsed;
+	string problem;
+} retentionresult;
+
+// Told about every recording that goes (or had gone already), while the
+// files next to it are still there.
+typedef void (*retentionhook)(const string& name, void* context);
+
+int retention_delete(const string& directory, const set<string>& expired, time_t cutoff,
+	const char* const* extensions, unlinkqueue* queue, retentionhook deleting, void* context,
+	retentionresult& result);
+#endif
@@ -0,0 +1,108 @@
+/*
+ * timeline - Per-Second Motion Timeline of a Video File
+ *
+ * Besides renaming a video file to say how often there was motion in it,
+ * maintenance writes a small file next to it that says what happened in
+ * every second of the video. It is a fixed header followed by one entry per
+ * second, both in the byte order of the machine that wrote them, so the
+ * file can simply be mapped into memory and indexed by second.
+ *
+ * For every second, there is the largest number of changed pixels of any
+ * analysed frame, how many frames were analysed, and whether there was
+ * motion. Seconds in which no frame was analysed (e.g. while a follower
+ * was not running) are all zero.
+ *
+ * The file is written under a temporary name first and then renamed, so
+ * nobody ever gets to see half of it.
+ *
+ */
+
+#include "timeline.hpp"
+#include "fileio.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// The layout of the file must not depend on the compiler.
+static_assert(sizeof(timelineheader) == 40, "timelineheader must be 40 bytes");
+static_assert(sizeof(timelineentry) == 8, "timelineentry must be 8 bytes");
+
+timelineentry& timeline_at(vector<timelineentry>& timeline, size_t second)
+{
+	// The entry of a second, adding empty ones up to it as needed.
+
+	if (second >= timeline.size())
+	{
+		timelineentry empty;
+		memset(&empty, 0, sizeof(empty));
+
+		timeline.resize(second + 1, empty);
+	}
+
+	return timeline[second];
+}
+
+void timeline_header(timelineheader& header, const vector<timelineentry>& timeline)
+{
+	// Fills in everything but the totals of the video file.
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TIMELINE_MAGIC, sizeof(header.magic));
+
+	header.version = TIMELINE_VERSION;
+	header.entry_size = sizeof(timelineentry);
+	header.seconds = timeline.size();
+}
+
+bool timeline_write(const string& filename, const timelineheader& header,
+	const vector<timelineentry>& timeline)
+{
+	const string temporary = filename + ".tmp";
+
+	int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+	if (fd < 0)
+		return false;
+
+	bool success = fileio_write_all(fd, &header, sizeof(header)) &&
+		(timeline.empty() || fileio_write_all(fd, &timeline[0], timeline.size() * sizeof(timelineentry)));
+
+	success = close(fd) == 0 && success;
+
+	if (success)
+		success = rename(temporary.c_str(), filename.c_str()) == 0;
+
+	if (!success)
+		unlink(temporary.c_str());
+
+	return success;
+}
+
+bool timeline_read(const string& filename, timelineheader& header,
+	vector<timelineentry>& timeline)
+{
+	FILE* file = fopen(filename.c_str(), "rb");
+
+	if (file == NULL)
+		return false;
+
+	bool success = fread(&header, sizeof(header), 1, file) == 1 &&
+		memcmp(header.magic, TIMELINE_MAGIC, sizeof(header.magic)) == 0 &&
+		header.version == TIMELINE_VERSION &&
+		header.entry_size == sizeof(timelineentry);
+
+	if (success)
+	{
+		timeline.resize(header.seconds);
+
+		success = header.seconds == 0 ||
+			fread(&timeline[0], sizeof(timelineentry), header.seconds, file) == header.seconds;
+	}
+
+	fclose(file);
+
+	return success;
+}
@@ -0,0 +1,50 @@
+/*
+ * timeline - Per-Second Motion Timeline of a Video File
+ *
+ */
+
+#ifndef TIMELINE_HPP
+#define TIMELINE_HPP
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+using namespace std;
+
+#define TIMELINE_EXTENSION ".motion"
+#define TIMELINE_MAGIC "CAMSRVTL"
+#define TIMELINE_VERSION 1
+
+// Flags of a second
+#define TIMELINE_ACTIVE 0x01 // At least one frame had enough changed pixels
+#define TIMELINE_MOTION 0x02 // Counted as motion
+
+typedef struct timelineheader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint32_t seconds;
+	uint32_t motion;
+	uint32_t duration_ms;
+	uint32_t analysed;
+	int64_t recorded;
+} timelineheader;
+
+typedef struct timelineentry
+{
+	uint32_t changes;
+	uint16_t frames;
+	uint8_t flags;
+	uint8_t reserved;
+} timelineentry;
+
+timelineentry& timeline_at(vector<timelineentry>& timeline, size_t second);
+void timeline_header(timelineheader& header, const vector<timelineentry>& timeline);
+bool timeline_write(const string& filename, const timelineheader& header,
+	const vector<timelineentry>& timeline);
+bool timeline_read(const string& filename, timelineheader& header,
+	vector<timelineentry>& timeline);
+#endif
@@ -0,0 +1,203 @@
+/*
+ * timerwheel - Hierarchical Timer Wheel
+ *
+ * Keeps a fixed number of timers (one per camera in camsrvd), each of which
+ * is either off or due at some tick. Setting, cancelling and expiring a
+ * timer takes the same time however many there are, so the supervisor does
+ * not have to look at every camera whenever something happens.
+ *
+ * There are TIMERWHEEL_LEVELS wheels of TIMERWHEEL_SLOTS slots each. A
+ * timer goes into the lowest wheel in which it is due within the current
+ * turn: the bits of its tick above that wheel are the same as those of the
+ * current tick, and its slot is given by the bits of that wheel. Whenever
+ * a wheel comes round to a slot, the timers in it are spread out over the
+ * wheels below, so that every timer ends up in the lowest wheel by the
+ * time it is due. Timers in a slot are a doubly linked list through
+ * "nodes", so they can also be taken out again right away.
+ *
+ * With 4 wheels of 64 slots and ticks of 100 ms, timers can be set up to
+ * about 19 days ahead, and finding out when the next one is due means
+ * looking at no more than 256 slots.
+ *
+ */
+
+#include "timerwheel.hpp"
+
+#include <assert.h>
+
+static size_t timerwheel_slot(uint64_t now, uint64_t due)
+{
+	// The slot a timer due at "due" goes into, as of "now" (< "due").
+
+	for (int level = 0; level < TIMERWHEEL_LEVELS - 1; level++)
+	{
+		const int above = TIMERWHEEL_BITS * (level + 1);
+
+		if ((due >> above) == (now >> above))
+			return level * TIMERWHEEL_SLOTS + ((due >> (TIMERWHEEL_BITS * level)) & (TIMERWHEEL_SLOTS - 1));
+	}
+
+	const int level = TIMERWHEEL_LEVELS - 1;
+
+	return level * TIMERWHEEL_SLOTS + ((due >> (TIMERWHEEL_BITS * level)) & (TIMERWHEEL_SLOTS - 1));
+}
+
+static void timerwheel_link(timerwheel& wheel, size_t timer)
+{
+	timerwheelnode& node = wheel.nodes[timer];
+
+	node.slot = timerwheel_slot(wheel.now, node.due);
+	node.prev = TIMERWHEEL_NONE;
+	node.next = wheel.heads[node.slot];
+
+	if (node.next != TIMERWHEEL_NONE)
+		wheel.nodes[node.next].prev = timer;
+
+	wheel.heads[node.slot] = timer;
+}
+
+static void timerwheel_unlink(timerwheel& wheel, size_t timer)
+{
+	timerwheelnode& node = wheel.nodes[timer];
+
+	if (node.prev != TIMERWHEEL_NONE)
+		wheel.nodes[node.prev].next = node.next;
+	else
+		wheel.heads[node.slot] = node.next;
+
+	if (node.next != TIMERWHEEL_NONE)
+		wheel.nodes[node.next].prev = node.prev;
+
+	node.slot = TIMERWHEEL_NONE;
+}
+
+void timerwheel_init(timerwheel& wheel, size_t timers, uint64_t now)
+{
+	wheel.now = now;
+
+	for (size_t i = 0; i < TIMERWHEEL_LEVELS * TIMERWHEEL_SLOTS; i++)
+		wheel.heads[i] = TIMERWHEEL_NONE;
+
+	timerwheelnode off;
+
+	off.due = 0;
+	off.slot = TIMERWHEEL_NONE;
+	off.prev = TIMERWHEEL_NONE;
+	off.next = TIMERWHEEL_NONE;
+
+	wheel.nodes.assign(timers, off);
+}
+
+void timerwheel_set(timerwheel& wheel, size_t timer, uint64_t due)
+{
+	// Sets (or moves) a timer. Ticks that have passed already mean the
+	// next one, and ones too far ahead as far ahead as possible.
+
+	timerwheel_cancel(wheel, timer);
+
+	if (due <= wheel.now)
+		due = wheel.now + 1;
+
+	if (due - wheel.now > TIMERWHEEL_SPAN)
+		due = wheel.now + TIMERWHEEL_SPAN;
+
+	wheel.nodes[timer].due = due;
+	timerwheel_link(wheel, timer);
+}
+
+void timerwheel_cancel(timerwheel& wheel, size_t timer)
+{
+	if (wheel.nodes[timer].slot != TIMERWHEEL_NONE)
+		timerwheel_unlink(wheel, timer);
+}
+
+bool timerwheel_pending(const timerwheel& wheel, size_t timer)
+{
+	return wheel.nodes[timer].slot != TIMERWHEEL_NONE;
+}
+
+void timerwheel_advance(timerwheel& wheel, uint64_t now, vector<size_t>& expired)
+{
+	// Moves on to tick "now" and adds the timers that went off on the way
+	// to "expired", in the order they were due.
+
+	while (wheel.now < now)
+	{
+		// Ticks at which nothing happens are skipped, so that this takes
+		// no longer after hours without any timers than after a second.
+		uint64_t next;
+
+		if (!timerwheel_next(wheel, next) || next > now)
+		{
+			wheel.now = now;
+			break; // while
+		}
+
+		wheel.now = next;
+
+		// Wheels that have come round to their next slot hand the timers
+		// in it down, highest wheel first.
+		for (int level = TIMERWHEEL_LEVELS - 1; level > 0; level--)
+		{
+			const int below = TIMERWHEEL_BITS * level;
+
+			if ((wheel.now & (((uint64_t)1 << below) - 1)) != 0)
+				continue;
+
+			const size_t slot = level * TIMERWHEEL_SLOTS + ((wheel.now >> below) & (TIMERWHEEL_SLOTS - 1));
+			size_t timer = wheel.heads[slot];
+
+			wheel.heads[slot] = TIMERWHEEL_NONE;
+
+			while (timer != TIMERWHEEL_NONE)
+			{
+				const size_t next = wheel.nodes[timer].next;
+
+				assert(wheel.nodes[timer].due >= wheel.now);
+				timerwheel_link(wheel, timer);
+				timer = next;
+			}
+		}
+
+		const size_t slot = wheel.now & (TIMERWHEEL_SLOTS - 1);
+
+		while (wheel.heads[slot] != TIMERWHEEL_NONE)
+		{
+			const size_t timer = wheel.heads[slot];
+
+			timerwheel_unlink(wheel, timer);
+			expired.push_back(timer);
+		}
+	}
+}
+
+bool timerwheel_next(const timerwheel& wheel, uint64_t& tick)
+{
+	// The next tick at which timerwheel_advance() has something to do,
+	// either because a timer is due or because timers have to be handed
+	// down. False if no timer is set.
+
+	for (int level = 0; level < TIMERWHEEL_LEVELS; level++)
+	{
+		const int below = TIMERWHEEL_BITS * level;
+		const int above = below + TIMERWHEEL_BITS;
+		const size_t current = (wheel.now >> below) & (TIMERWHEEL_SLOTS - 1);
+
+		// Every slot of a wheel but the top one is ahead of the current
+		// one; the top one wraps around.
+		const size_t slots = level == TIMERWHEEL_LEVELS - 1 ? TIMERWHEEL_SLOTS : TIMERWHEEL_SLOTS - current;
+
+		for (size_t i = 1; i < slots; i++)
+		{
+			const size_t slot = (current + i) & (TIMERWHEEL_SLOTS - 1);
+
+			if (wheel.heads[level * TIMERWHEEL_SLOTS + slot] == TIMERWHEEL_NONE)
+				continue;
+
+			tick = ((wheel.now >> above) << above) + ((uint64_t)(current + i) << below);
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,47 @@
+/*
+ * timerwheel - Hierarchical Timer Wheel
+ *
+ */
+
+#ifndef TIMERWHEEL_HPP
+#define TIMERWHEEL_HPP
+
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+using namespace std;
+
+#define TIMERWHEEL_BITS 6
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_BITS)
+#define TIMERWHEEL_LEVELS 4
+
+// Furthest a timer can be set ahead, in ticks. One slot of the top wheel
+// short of a whole turn, so that it never wraps round to the current slot.
+#define TIMERWHEEL_SPAN ((uint64_t)(TIMERWHEEL_SLOTS - 1) << (TIMERWHEEL_BITS * (TIMERWHEEL_LEVELS - 1)))
+
+#define TIMERWHEEL_NONE ((size_t)-1)
+
+typedef struct timerwheelnode
+{
+	uint64_t due;
+	size_t slot;
+	size_t prev;
+	size_t next;
+} timerwheelnode;
+
+typedef struct timerwheel
+{
+	uint64_t now;
+	size_t heads[TIMERWHEEL_LEVELS * TIMERWHEEL_SLOTS];
+	vector<timerwheelnode> nodes;
+} timerwheel;
+
+void timerwheel_init(timerwheel& wheel, size_t timers, uint64_t now);
+void timerwheel_set(timerwheel& wheel, size_t timer, uint64_t due);
+void timerwheel_cancel(timerwheel& wheel, size_t timer);
+bool timerwheel_pending(const timerwheel& wheel, size_t timer);
+void timerwheel_advance(timerwheel& wheel, uint64_t now, vector<size_t>& expired);
+bool timerwheel_next(const timerwheel& wheel, uint64_t& tick);
+#endif
@@ -0,0 +1,403 @@
+/*
+ * unlinkqueue - Deleting Files in the Background
+ *
+ * Deleting a large video file can take a while on ext4 or XFS, because all
+ * of its extents have to be freed before unlink() returns. Doing that for
+ * hundreds of files held up everything that came after deleting, i.e.
+ * motion detection. So files are handed to this queue instead, which
+ * deletes them in the background while the caller moves on.
+ *
+ * Where the kernel supports it, files are deleted with io_uring: a thread
+ * takes up to UNLINKQUEUE_BATCH files at a time, hands them to the kernel
+ * with a single system call and waits for all of them to be done. Where it
+ * does not (kernels before 5.11, or io_uring turned off), a few threads
+ * simply call unlinkat() one file after the other.
+ *
+ * Adding a file waits while UNLINKQUEUE_CAPACITY files are waiting already,
+ * so a caller that finds lots to delete cannot get too far ahead. Files are
+ * named relative to a directory file descriptor that belongs to the queue
+ * (see unlinkqueue_directory()), so they stay valid for as long as needed.
+ *
+ */
+
+#include "unlinkqueue.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+// Operations are not macros, but IORING_OP_UNLINKAT came with this one.
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_EXT_ARG) && defined(IO_URING_OP_SUPPORTED)
+#define UNLINKQUEUE_URING
+#endif
+
+static void finish(unlinkqueue& queue, const unlinkjob* jobs, const int* results, size_t count)
+{
+	// Books what happened to a number of files taken from the queue.
+
+	{
+		std::lock_guard<std::mutex> guard(queue.lock);
+
+		for (size_t i = 0; i < count; i++)
+		{
+			// Gone already is just as good.
+			if (results[i] == 0 || results[i] == -ENOENT)
+			{
+				queue.completed++;
+				queue.freed += jobs[i].size;
+			}
+			else
+			{
+				queue.failed++;
+			}
+
+			uintmax_t& pending = queue.pending_bytes[jobs[i].device];
+			pending -= jobs[i].size;
+
+			if (pending == 0)
+				queue.pending_bytes.erase(jobs[i].device);
+		}
+
+		queue.inflight -= count;
+	}
+
+	queue.changed.notify_all();
+}
+
+static bool take(unlinkqueue& queue, vector<unlinkjob>& jobs, size_t most)
+{
+	// Waits for files to delete. Returns false once the queue is being
+	// closed and there is nothing left.
+
+	jobs.clear();
+
+	{
+		std::unique_lock<std::mutex> guard(queue.lock);
+
+		while (queue.pending.empty() && !queue.closing)
+			queue.changed.wait(guard);
+
+		if (queue.pending.empty())
+			return false;
+
+		while (!queue.pending.empty() && jobs.size() < most)
+		{
+			jobs.push_back(queue.pending.front());
+			queue.pending.pop_front();
+		}
+
+		queue.inflight += jobs.size();
+	}
+
+	// There is room for more now.
+	queue.changed.notify_all();
+
+	return true;
+}
+
+static void unlink_worker(unlinkqueue& queue)
+{
+	vector<unlinkjob> jobs;
+
+	while (take(queue, jobs, 1))
+	{
+		int result = unlinkat(jobs[0].dirfd, jobs[0].name.c_str(), 0) == 0 ? 0 : -errno;
+		finish(queue, &jobs[0], &result, 1);
+	}
+}
+
+#ifdef UNLINKQUEUE_URING
+static bool ring_open(unlinkring& ring, unsigned entries)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	ring.fd = syscall(__NR_io_uring_setup, entries, &params);
+
+	if (ring.fd < 0)
+		return false;
+
+	// Make sure deleting files is something this kernel can do.
+	const size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	vector<char> probe_buffer(probe_size, 0);
+	struct io_uring_probe* probe = (struct io_uring_probe*)&probe_buffer[0];
+
+	if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, 256) < 0 ||
+		probe->last_op < IORING_OP_UNLINKAT ||
+		!(probe->ops[IORING_OP_UNLINKAT].flags & IO_URING_OP_SUPPORTED))
+	{
+		close(ring.fd);
+		return false;
+	}
+
+	ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring.fd, IORING_OFF_SQ_RING);
+	ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring.fd, IORING_OFF_CQ_RING);
+	ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring.fd, IORING_OFF_SQES);
+
+	if (ring.sq_ring == MAP_FAILED || ring.cq_ring == MAP_FAILED || ring.sqes == MAP_FAILED)
+	{
+		if (ring.sq_ring != MAP_FAILED) munmap(ring.sq_ring, ring.sq_ring_size);
+		if (ring.cq_ring != MAP_FAILED) munmap(ring.cq_ring, ring.cq_ring_size);
+		if (ring.sqes != MAP_FAILED) munmap(ring.sqes, ring.sqes_size);
+
+		close(ring.fd);
+		return false;
+	}
+
+	char* sq = (char*)ring.sq_ring;
+	char* cq = (char*)ring.cq_ring;
+
+	ring.sq_head = (unsigned*)(sq + params.sq_off.head);
+	ring.sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	ring.sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+	ring.sq_array = (unsigned*)(sq + params.sq_off.array);
+	ring.cq_head = (unsigned*)(cq + params.cq_off.head);
+	ring.cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	ring.cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+	ring.cqes = cq + params.cq_off.cqes;
+
+	return true;
+}
+
+static void ring_close(unlinkring& ring)
+{
+	munmap(ring.sqes, ring.sqes_size);
+	munmap(ring.cq_ring, ring.cq_ring_size);
+	munmap(ring.sq_ring, ring.sq_ring_size);
+	close(ring.fd);
+}
+
+static bool ring_unlink(unlinkring& ring, const vector<unlinkjob>& jobs, vector<int>& results)
+{
+	// Deletes all of "jobs" with one system call and waits for them.
+
+	struct io_uring_sqe* sqes = (struct io_uring_sqe*)ring.sqes;
+	struct io_uring_cqe* cqes = (struct io_uring_cqe*)ring.cqes;
+
+	unsigned tail = *ring.sq_tail;
+
+	for (size_t i = 0; i < jobs.size(); i++, tail++)
+	{
+		const unsigned index = tail & *ring.sq_mask;
+		struct io_uring_sqe* sqe = &sqes[index];
+
+		memset(sqe, 0, sizeof(*sqe));
+
+		sqe->opcode = IORING_OP_UNLINKAT;
+		sqe->fd = jobs[i].dirfd;
+		sqe->addr = (uintptr_t)jobs[i].name.c_str();
+		sqe->user_data = i;
+
+		ring.sq_array[index] = index;
+	}
+
+	__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+	results.assign(jobs.size(), -ECANCELED);
+
+	size_t done = 0;
+	unsigned submit = jobs.size();
+
+	while (done < jobs.size())
+	{
+		long entered = syscall(__NR_io_uring_enter, ring.fd, submit, jobs.size() - done,
+			IORING_ENTER_GETEVENTS, NULL, 0);
+
+		if (entered < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		submit -= min((unsigned)entered, submit);
+
+		unsigned head = *ring.cq_head;
+		const unsigned available = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+		for (; head != available; head++)
+		{
+			const struct io_uring_cqe* cqe = &cqes[head & *ring.cq_mask];
+
+			if (cqe->user_data < results.size())
+				results[cqe->user_data] = cqe->res;
+
+			done++;
+		}
+
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	return true;
+}
+
+static void ring_worker(unlinkqueue& queue)
+{
+	vector<unlinkjob> jobs;
+	vector<int> results;
+
+	while (take(queue, jobs, UNLINKQUEUE_BATCH))
+	{
+		if (!ring_unlink(queue.ring, jobs, results))
+		{
+			// Should not happen; do it the slow way.
+			for (size_t i = 0; i < jobs.size(); i++)
+				results[i] = unlinkat(jobs[i].dirfd, jobs[i].name.c_str(), 0) == 0 ? 0 : -errno;
+		}
+
+		finish(queue, &jobs[0], &results[0], jobs.size());
+	}
+}
+#endif
+
+void unlinkqueue_open(unlinkqueue& queue)
+{
+	queue.inflight = 0;
+	queue.pending_bytes.clear();
+	queue.closing = false;
+	queue.uring = false;
+	queue.completed = 0;
+	queue.failed = 0;
+	queue.freed = 0;
+
+#ifdef UNLINKQUEUE_URING
+	queue.uring = ring_open(queue.ring, UNLINKQUEUE_BATCH);
+
+	if (queue.uring)
+	{
+		queue.threads.push_back(std::thread(ring_worker, std::ref(queue)));
+		return;
+	}
+#endif
+
+	for (int i = 0; i < UNLINKQUEUE_THREADS; i++)
+		queue.threads.push_back(std::thread(unlink_worker, std::ref(queue)));
+}
+
+int unlinkqueue_directory(unlinkqueue& queue, const string& path)
+{
+	// A file descriptor of a directory to name files relative to. It stays
+	// open until the queue is closed. Returns -1 on error.
+
+	std::lock_guard<std::mutex> guard(queue.lock);
+
+	map<string, int>::iterator it = queue.directories.find(path);
+
+	if (it != queue.directories.end())
+		return it->second;
+
+	int dirfd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (dirfd < 0)
+		return -1;
+
+	// What is freed is booked by file system; see unlinkqueue_pending_bytes().
+	struct stat st;
+
+	if (fstat(dirfd, &st) != 0)
+	{
+		close(dirfd);
+		return -1;
+	}
+
+	queue.directories[path] = dirfd;
+	queue.devices[dirfd] = st.st_dev;
+
+	return dirfd;
+}
+
+void unlinkqueue_push(unlinkqueue& queue, int dirfd, const string& name, uintmax_t size)
+{
+	{
+		std::unique_lock<std::mutex> guard(queue.lock);
+
+		while (queue.pending.size() >= UNLINKQUEUE_CAPACITY)
+			queue.changed.wait(guard);
+
+		unlinkjob job;
+
+		job.dirfd = dirfd;
+		job.device = queue.devices[dirfd];
+		job.name = name;
+		job.size = size;
+
+		queue.pending.push_back(job);
+		queue.pending_bytes[job.device] += size;
+	}
+
+	queue.changed.notify_all();
+}
+
+uintmax_t unlinkqueue_pending_bytes(unlinkqueue& queue, dev_t device)
+{
+	// What will be freed on a file system once everything that is waiting
+	// has been deleted
+
+	std::lock_guard<std::mutex> guard(queue.lock);
+
+	map<dev_t, uintmax_t>::const_iterator it = queue.pending_bytes.find(device);
+
+	return it != queue.pending_bytes.end() ? it->second : 0;
+}
+
+void unlinkqueue_stats(unlinkqueue& queue, unsigned long& completed, unsigned long& failed,
+	uintmax_t& freed)
+{
+	std::lock_guard<std::mutex> guard(queue.lock);
+
+	completed = queue.completed;
+	failed = queue.failed;
+	freed = queue.freed;
+}
+
+void unlinkqueue_drain(unlinkqueue& queue)
+{
+	std::unique_lock<std::mutex> guard(queue.lock);
+
+	while (!queue.pending.empty() || queue.inflight > 0)
+		queue.changed.wait(guard);
+}
+
+void unlinkqueue_close(unlinkqueue& queue)
+{
+	// Deletes whatever is still waiting first.
+
+	{
+		std::lock_guard<std::mutex> guard(queue.lock);
+		queue.closing = true;
+	}
+
+	queue.changed.notify_all();
+
+	for (vector<std::thread>::iterator thread = queue.threads.begin(); thread != queue.threads.end(); ++thread)
+		thread->join();
+
+	queue.threads.clear();
+
+#ifdef UNLINKQUEUE_URING
+	if (queue.uring)
+		ring_close(queue.ring);
+#endif
+
+	queue.uring = false;
+
+	for (map<string, int>::iterator it = queue.directories.begin(); it != queue.directories.end(); ++it)
+		close(it->second);
+
+	queue.directories.clear();
+	queue.devices.clear();
+}
@@ -0,0 +1,84 @@
+/*
+ * unlinkqueue - Deleting Files in the Background
+ *
+ */
+
+#ifndef UNLINKQUEUE_HPP
+#define UNLINKQUEUE_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+using namespace std;
+
+// Files that may wait to be deleted before adding more has to wait
+#define UNLINKQUEUE_CAPACITY 256
+
+// Deletes handed to the kernel at once
+#define UNLINKQUEUE_BATCH 32
+
+// Threads deleting files if io_uring cannot be used
+#define UNLINKQUEUE_THREADS 4
+
+typedef struct unlinkjob
+{
+	int dirfd;
+	dev_t device;
+	string name;
+	uintmax_t size;
+} unlinkjob;
+
+typedef struct unlinkring
+{
+	int fd;
+	void* sq_ring;
+	size_t sq_ring_size;
+	void* cq_ring;
+	size_t cq_ring_size;
+	void* sqes;
+	size_t sqes_size;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	void* cqes;
+} unlinkring;
+
+typedef struct unlinkqueue
+{
+	deque<unlinkjob> pending;
+	size_t inflight;
+	map<dev_t, uintmax_t> pending_bytes; // By file system
+	bool closing;
+	bool uring;
+	unlinkring ring;
+	vector<std::thread> threads;
+	map<string, int> directories;
+	map<int, dev_t> devices;
+	unsigned long completed;
+	unsigned long failed;
+	uintmax_t freed;
+	std::mutex lock;
+	std::condition_variable changed;
+} unlinkqueue;
+
+void unlinkqueue_open(unlinkqueue& queue);
+int unlinkqueue_directory(unlinkqueue& queue, const string& path);
+void unlinkqueue_push(unlinkqueue& queue, int dirfd, const string& name, uintmax_t size);
+uintmax_t unlinkqueue_pending_bytes(unlinkqueue& queue, dev_t device);
+void unlinkqueue_stats(unlinkqueue& queue, unsigned long& completed, unsigned long& failed,
+	uintmax_t& freed);
+void unlinkqueue_drain(unlinkqueue& queue);
+void unlinkqueue_close(unlinkqueue& queue);
+#endif